@@ -67,6 +67,15 @@ class ADSREnvelope {
     phase_ = 0;
   }
 
+  // goes into the decay from wherever the envelope is, for letting go during the attack
+  inline void Release() {
+    a_ = value_;
+    b_ = target_[ADSR_ENV_SEGMENT_DECAY];
+    priorValue_ = value_;
+    segment_ = ADSR_ENV_SEGMENT_DECAY;
+    phase_ = 0;
+  }
+
   inline uint16_t Render() {
     uint32_t increment = increment_[segment_]>>7;
     phase_ += increment;
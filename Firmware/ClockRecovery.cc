@@ -0,0 +1,228 @@
+#include "ClockRecovery.h"
+
+void ClockRecovery::Init(uint16_t bandwidth)
+{
+    SetBandwidth(bandwidth);
+    // the first edge restarts the loop, which clears the outliers
+    edgeCount = 0;
+    pendingEdges = 0;
+    waitForEdge = true;
+    locked = false;
+    period = 0;
+    drift = 0;
+    jitter = 0;
+}
+
+void ClockRecovery::SetBandwidth(uint16_t bandwidth)
+{
+    // critically damped, b is sqrt(2)*w and c is w*w
+    b = ((uint32_t)bandwidth*92682)>>16;
+    c = ((uint32_t)bandwidth*bandwidth)>>16;
+}
+
+void ClockRecovery::Restart(uint32_t now)
+{
+    locked = false;
+    edgeCount = 1;
+    outliers = 0;
+    lastRawEdge = now;
+    lastEdge = now;
+    nextEdge = now+period;
+    drift = 0;
+    jitter = period/4;
+}
+
+void ClockRecovery::OnEdge(uint32_t time)
+{
+    uint32_t now = time<<8;
+    if(pendingEdges < 4)
+        pendingEdges++;
+    if(edgeCount == 0)
+    {
+        Restart(now);
+        return;
+    }
+    uint32_t interval = now-lastRawEdge;
+    lastRawEdge = now;
+    if(edgeCount == 1)
+    {
+        // the first interval is all there is to go on
+        period = interval;
+        lastEdge = now;
+        nextEdge = now+period;
+        edgeCount = 2;
+        return;
+    }
+    int32_t error = now-nextEdge;
+    uint32_t errorSize = error < 0 ? -error : error;
+    if(errorSize > period/2)
+    {
+        // a single odd edge is noise, a few in a row is a new tempo
+        if(++outliers < CLOCK_RELOCK_OUTLIERS)
+            return;
+        period = interval;
+        Restart(now);
+        edgeCount = 2;
+        return;
+    }
+    outliers = 0;
+    // rounded, the corrections are small enough that flooring them would bias the period
+    lastEdge = nextEdge+(((int64_t)b*error+0x8000)>>16);
+    nextEdge = lastEdge+period;
+    period += ((int64_t)c*error+0x8000)>>16;
+    drift += (error-drift)>>4;
+    jitter += ((int32_t)errorSize-(int32_t)jitter)>>4;
+    if(edgeCount < 0xff)
+        edgeCount++;
+    // this runs from the audio, the ui shows the lock and jitter instead of printing them
+    if(!locked && edgeCount >= 8 && jitter < period/16)
+        locked = true;
+    else if(locked && jitter > period/8)
+        locked = false;
+}
+
+void ClockRecovery::ResetEdges()
+{
+    pendingEdges = 0;
+    waitForEdge = true;
+}
+
+void ClockRecovery::OnEdgePulse()
+{
+    waitForEdge = false;
+    if(pendingEdges > -1)
+        pendingEdges--;
+}
+
+bool ClockRecovery::CanPlayEdgePulse(uint32_t time)
+{
+    if(pendingEdges > 0)
+        return true;
+    if(waitForEdge || !locked || pendingEdges < 0)
+        return false;
+    // the edge is close enough to due that it is only jitter, it gets counted when it comes
+    int32_t late = (time<<8)-nextEdge;
+    return late > -(int32_t)(period/4) && late < (int32_t)(period/4);
+}
+
+uint32_t ClockRecovery::GetPhaseIncrement(uint32_t time, uint32_t position, uint8_t pulsesPerEdge)
+{
+    if(period == 0)
+        return 0;
+    int32_t cycle = (int32_t)pulsesPerEdge<<16;
+    // where the clock is since the last edge, in pulses
+    int32_t sinceEdge = (time<<8)-lastEdge;
+    if(sinceEdge < 0)
+        sinceEdge = 0;
+    int64_t clockPosition = ((int64_t)sinceEdge*cycle)/period;
+    if(clockPosition > 2*cycle)
+        clockPosition = 2*cycle;
+    // edges that haven't been played yet are whole cycles the sequencer is behind
+    int64_t error = (int64_t)pendingEdges*cycle+clockPosition-position;
+    // close the gap over one edge, at most half again or half the tempo
+    if(error > cycle/2)
+        error = cycle/2;
+    if(error < -cycle/2)
+        error = -cycle/2;
+    int64_t increment = (((uint64_t)0x80000000*SAMPLES_PER_BLOCK*pulsesPerEdge)<<8)/period;
+    increment += increment*error/cycle;
+    if(increment < 0)
+        return 0;
+    if(increment > 0x7fffffff)
+        return 0x7fffffff;
+    return increment;
+}
+
+// feeds the loop a clock with jitter, and plays a sequencer against it the way GrooveBox::Render does
+// the edge pulses should land on the clock without the jitter
+// jitter is the most an edge is off by, samples
+static bool TestClockStream(const char *name, uint32_t periodQ8, uint8_t pulsesPerEdge, uint32_t jitter, bool blockTimes)
+{
+    ClockRecovery clock;
+    clock.Init();
+    clock.ResetEdges();
+    uint32_t random = 0x12345678;
+    const uint32_t firstEdge = 1000<<8;
+    uint32_t nextEdge = firstEdge;
+    uint32_t tempoPhase = 0x7fffffff;
+    uint8_t sinceEdgePulse = 0;
+    int lockedAt = -1;
+    uint32_t edgePulses = 0;
+    uint32_t totalError = 0;
+    uint32_t maxError = 0;
+    for(int block=0;block<32000*20/SAMPLES_PER_BLOCK;block++)
+    {
+        uint32_t time = block*SAMPLES_PER_BLOCK;
+        while(nextEdge>>8 < time+SAMPLES_PER_BLOCK)
+        {
+            random = random*1664525+1013904223;
+            int32_t offset = (int32_t)((random>>16)%(2*jitter+1))-(int32_t)jitter;
+            clock.OnEdge(blockTimes ? time : (nextEdge>>8)+offset);
+            nextEdge += periodQ8;
+        }
+        if(lockedAt < 0 && clock.IsLocked())
+            lockedAt = block;
+        uint32_t position = ((uint32_t)((sinceEdgePulse+pulsesPerEdge-1)%pulsesPerEdge)<<16)|(tempoPhase>>15);
+        uint32_t lastTempoPhase = tempoPhase;
+        uint32_t increment = clock.GetPhaseIncrement(time, position, pulsesPerEdge);
+        tempoPhase += increment;
+        if((tempoPhase>>31) == 0)
+            continue;
+        if(sinceEdgePulse == 0 && !clock.CanPlayEdgePulse(time))
+        {
+            tempoPhase = 0x7fffffff;
+            continue;
+        }
+        tempoPhase &= 0x7fffffff;
+        sinceEdgePulse = (sinceEdgePulse+1)%pulsesPerEdge;
+        if(sinceEdgePulse != 1)
+            continue;
+        clock.OnEdgePulse();
+        // give the loop a couple of seconds to settle before measuring
+        if(lockedAt < 0 || block < lockedAt+1000)
+            continue;
+        uint32_t pulseTime = (time<<8)+((((0x80000000-lastTempoPhase)>>8)*SAMPLES_PER_BLOCK/((increment>>8)+1))<<8);
+        uint32_t sinceFirst = pulseTime-firstEdge;
+        int32_t error = (int32_t)((sinceFirst+periodQ8/2)%periodQ8)-(int32_t)(periodQ8/2);
+        uint32_t errorSize = (error < 0 ? -error : error)>>8;
+        totalError += errorSize;
+        if(errorSize > maxError)
+            maxError = errorSize;
+        edgePulses++;
+    }
+    int32_t periodError = (int32_t)(clock.GetPeriod()-periodQ8);
+    uint32_t averageError = edgePulses ? totalError/edgePulses : 0;
+    printf("%s: locked %i after %i blocks, period error %i/256 samples, jitter %i samples, edge pulses %i, average error %i max %i samples\n",
+        name, clock.IsLocked(), lockedAt, periodError, clock.GetJitter()>>8, edgePulses, averageError, maxError);
+    // edges seen once per block are off by up to a block on top of their own jitter
+    uint32_t edgeJitter = jitter+(blockTimes ? SAMPLES_PER_BLOCK/2 : 0);
+    bool passed = true;
+    // locks within a dozen edges
+    if(!clock.IsLocked() || lockedAt < 0 || (uint32_t)lockedAt*SAMPLES_PER_BLOCK > 12*(periodQ8>>8))
+        passed = false;
+    // the filtered period is within 0.4% of the real one
+    if((uint32_t)(periodError < 0 ? -periodError : periodError) > periodQ8/256)
+        passed = false;
+    // the loop measures no more jitter than there is
+    if((clock.GetJitter()>>8) > edgeJitter+1)
+        passed = false;
+    // and the pulses land closer to the clean clock than the edges do
+    if(edgePulses == 0 || averageError > jitter/2+SAMPLES_PER_BLOCK*3/4 || maxError > jitter+SAMPLES_PER_BLOCK)
+        passed = false;
+    if(!passed)
+        printf("%s: clock recovery out of bounds\n", name);
+    return passed;
+}
+
+bool TestClockRecovery()
+{
+    bool passed = true;
+    // 120bpm midi clock is 24ppq, 666.67 samples apart at 32k
+    passed &= TestClockStream("midi 120bpm, seen per block", (32000*60*256)/(120*24), 4, 0, true);
+    passed &= TestClockStream("midi 97bpm, 1ms jitter", (32000*60*256)/(97*24), 4, 32, false);
+    // pocket operator sync is two pulses per beat
+    passed &= TestClockStream("po 120bpm, 2ms jitter", (32000*60*256)/(120*2), 48, 64, false);
+    passed &= TestClockStream("4ppq 140bpm, no jitter", (32000*60*256)/(140*4), 24, 0, false);
+    printf("clock recovery test %s\n", passed ? "passed" : "failed");
+    return passed;
+}
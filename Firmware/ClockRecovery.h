@@ -0,0 +1,79 @@
+#ifndef CLOCK_RECOVERY_H_
+#define CLOCK_RECOVERY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "GlobalDefines.h"
+
+/*
+
+clock recovery
+--------------
+the midi clock and the audio sync pulses both come in as edges with a few ms
+of jitter. the midi ones only get seen once per block. instead of working the
+tempo out from the last interval, the edges go through a second order delay
+locked loop that predicts when the next edge is due. the tempo comes from the
+filtered period, so one late edge doesn't pull the tempo around.
+
+times are in samples, kept with 8 fractional bits. differences are signed 32
+bits, so the sample counter can wrap.
+
+the sequencer side is steered rather than jumped. GetPhaseIncrement compares
+where the sequencer is since its last edge pulse with where the clock is,
+and speeds up or slows down the tempo phase to close the gap over about one
+edge. the pulse that lines up with an edge waits for that edge, unless the
+loop is locked and the edge is only a bit late.
+
+*/
+
+// loop bandwidth as 2*pi*bandwidth/edge rate, 16 fractional bits
+// a 32nd of the edge rate is smooth at midi clock rates and still follows tempo changes in a beat or two
+#define CLOCK_DEFAULT_BANDWIDTH 12868
+// edges in a row more than half a period off the prediction before the loop starts over
+#define CLOCK_RELOCK_OUTLIERS 3
+
+class ClockRecovery
+{
+    public:
+        void Init(uint16_t bandwidth = CLOCK_DEFAULT_BANDWIDTH);
+        void SetBandwidth(uint16_t bandwidth);
+        // an edge of the external clock, time in samples
+        void OnEdge(uint32_t time);
+        // forget the edges that haven't been played yet, for starting and continuing
+        void ResetEdges();
+        // the sequencer played the pulse that lines up with an edge
+        void OnEdgePulse();
+        // false while the next edge pulse has to wait for its edge
+        bool CanPlayEdgePulse(uint32_t time);
+        // tempo phase increment for the next block
+        // position is the number of pulses since the last edge pulse, 16 fractional bits
+        uint32_t GetPhaseIncrement(uint32_t time, uint32_t position, uint8_t pulsesPerEdge);
+        bool IsLocked() { return locked; }
+        bool HasPeriod() { return period != 0; }
+        // samples between edges, 8 fractional bits
+        uint32_t GetPeriod() { return period; }
+        // average error of the edges against the prediction, positive when the edges are late
+        // samples, 8 fractional bits
+        int32_t GetDrift() { return drift; }
+        // average size of the error, samples, 8 fractional bits
+        uint32_t GetJitter() { return jitter; }
+    private:
+        void Restart(uint32_t time);
+        int32_t b;
+        int32_t c;
+        uint8_t edgeCount;
+        uint8_t outliers;
+        int8_t pendingEdges;
+        bool waitForEdge;
+        bool locked;
+        uint32_t lastRawEdge;
+        uint32_t lastEdge;
+        uint32_t nextEdge;
+        uint32_t period;
+        int32_t drift;
+        uint32_t jitter;
+};
+
+bool TestClockRecovery();
+
+#endif // CLOCK_RECOVERY_H_
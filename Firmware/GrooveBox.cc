@@ -49,7 +49,7 @@ void OnNoteOn(uint8_t channel, uint8_t note, uint8_t velocity)
 }
 void OnNoteOff(uint8_t channel, uint8_t note, uint8_t velocity)
 {
-
+    groovebox->OnMidiNoteOff(note);
 }
 
 void GrooveBox::CalculateTempoIncrement()
@@ -59,16 +59,20 @@ void GrooveBox::CalculateTempoIncrement()
 void GrooveBox::init(uint32_t *_color)
 {
     // usbSerialDevice = _usbSerialDevice;
-    needsInitialADC = 30;
+    needsInitialADC = 1;
     groovebox = this;
     midi.Init();
 
     midi.OnCCChanged = OnCCChangedBare;
+    midi.OnNoteOn = OnNoteOn;
+    midi.OnNoteOff = OnNoteOff;
     midi.OnSync = OnSync;
     midi.OnStart = OnStart;
     midi.OnStop = OnStop;
     midi.OnPosition = OnPosition;
     midi.OnContinue = OnContinue;
+    clockSync.Init();
+    voiceAllocator.Init();
     
     ResetADCLatch();
     tempoPhase = 0;
@@ -133,7 +137,7 @@ void __not_in_flash_func(GrooveBox::Render)(int16_t* output_buffer, int16_t* inp
     // update some song parameters
     delay.SetFeedback(songData.GetDelayFeedback());
     delay.SetTime(songData.GetDelayTime());
-    bool hadExternalSync = false;
+    uint8_t externalSyncOffset = 0;
     //printf("input %i\n", workBuffer2[0]);
     for(int i=0;i<SAMPLES_PER_BLOCK;i++)
     {
@@ -149,23 +153,18 @@ void __not_in_flash_func(GrooveBox::Render)(int16_t* output_buffer, int16_t* inp
         if(!audio_sync_state){
             if(delta > 0x7000)
             {
-                // need to recalculate the tempo phase here based on the number of samples that have passed since the last sync
-                // samples since last sync is 1/8th notes, and we need to get up to 96ppq where the phase overflows at 31bits aka 0x7fffffff
-                // 0x7fffffff * 1/(samples_since_last_sync / 2 / 96) - I'm not sure where the 32 is coming from here :/ I just tweaked it until it seemed right
-                int syncMultiplier = 32;
-                // if((songData.GetSyncInMode() & SyncMode4PQ) > 0)
-                //     syncMultiplier = 48;
-
-                tempoPhaseIncrement = ((uint64_t)0x7fffffff*syncMultiplier*96)/(samples_since_last_sync);
                 ssls = samples_since_last_sync;
                 samples_since_last_sync = 0;
                 audio_sync_state = true;
-                hadExternalSync = true;
+                externalSyncOffset = i;
                 if(waitingForSync)
                 {
                     waitingForSync = false;
                     StartPlaying();
                 }
+                // the tempo comes from the clock recovery loop, it gets the edge with its sample
+                if((songData.GetSyncInMode()&(SyncMode4PQ|SyncModePO)) > 0)
+                    clockSync.OnEdge(sampleClock+i);
             }
         }
         else if(samples_since_last_sync > 250)
@@ -196,8 +195,56 @@ void __not_in_flash_func(GrooveBox::Render)(int16_t* output_buffer, int16_t* inp
     if(recordBufferOffset==128) recordBufferOffset = 0;
     if(songData.GetSyncInMode() == SyncModeNone)
         CalculateTempoIncrement();
+    uint8_t playingMask = 0;
+    for(int i=0;i<VOICE_COUNT;i++)
+    {
+        if(instruments[i].IsPlaying())
+            playingMask |= 1<<i;
+    }
+    voiceAllocator.SetPlaying(playingMask);
+    HandleMidiEvents();
+    UpdateMidiParams();
     if(!recording)
     {
+        // notes and pulses go before the voices render, so the triggers land in this block
+        int requestedNote = GetNote();
+        if(requestedNote >= 0)
+        {
+            patterns[currentVoice].ClearNextRequestedStep();
+            uint8_t _key = lastKeyPlayed;
+            TriggerInstrument(_key, requestedNote, 0, 0, true, patterns[currentVoice], currentVoice);
+        }
+ 
+        if(IsPlaying())
+        {
+            bool tempoPulse = false;
+            uint32_t lastTempoPhase = tempoPhase;
+            bool externalClock = songData.GetSyncInMode() != SyncModeNone;
+            if(externalClock)
+                tempoPhaseIncrement = clockSync.GetPhaseIncrement(sampleClock, GetSyncPosition(), trackPeriod[19]);
+            tempoPhase += tempoPhaseIncrement;
+            if((tempoPhase >> 31) > 0)
+            {
+                // the pulse on an edge of the external clock waits for that edge
+                if(externalClock && GetBeatCounter(19) == 0 && !clockSync.CanPlayEdgePulse(sampleClock))
+                {
+                    tempoPhase = 0x7fffffff;
+                }
+                else
+                {
+                    tempoPulse = true;
+                    // a pulse that was held for its edge goes where the edge came in
+                    pulseOffset = lastTempoPhase == 0x7fffffff ? externalSyncOffset : GetPulseOffset(lastTempoPhase);
+                    tempoPhase &= 0x7fffffff;
+                }
+            }
+            if(tempoPulse)
+            {
+                OnTempoPulse();
+                pulseOffset = 0;
+            }
+        }
+
         for(int v=0;v<VOICE_COUNT;v++)
         {
             // put in a request to render the other voice on the second core
@@ -299,82 +346,6 @@ void __not_in_flash_func(GrooveBox::Render)(int16_t* output_buffer, int16_t* inp
             chan[1] = mainR;
 
         }
-
-        int requestedNote = GetNote();
-        if(requestedNote >= 0)
-        {
-            patterns[currentVoice].ClearNextRequestedStep();
-            uint8_t _key = lastKeyPlayed;
-            TriggerInstrument(_key, requestedNote, 0, 0, true, patterns[currentVoice], currentVoice);
-        }
- 
-        if(IsPlaying())
-        {
-            bool tempoPulse = false;
-            tempoPhase += tempoPhaseIncrement;
-            if(songData.GetSyncInMode() == SyncModeNone)
-            {
-                if((tempoPhase >> 31) > 0)
-                {
-                    tempoPhase &= 0x7fffffff;
-                    tempoPulse = true;
-                }
-            }
-            else if(songData.GetSyncInMode() == SyncModeMidi)
-            {
-                if((beatCounter[19]+1)%4 != 0)
-                {
-                    if((tempoPhase >> 31) > 0)
-                    {
-                        tempoPhase &= 0x7fffffff;
-                        tempoPulse = true;
-                    }
-                }
-            }
-            else
-            {
-                if(hadExternalSync)
-                {
-                    int syncRate = getTickCountForRateIndex(4);
-                    // if((songData.GetSyncOutMode() & SyncModePO) > 0)
-                    //     rate = 4;
-                    if((songData.GetSyncInMode() & SyncMode4PQ) > 0)
-                        syncRate = getTickCountForRateIndex(2);
-                    if((beatCounter[19]+1)%syncRate == 0)
-                    {
-                        tempoPhase = 0;
-                        tempoPulse = true;
-                    }
-                    else
-                    {
-                        // we got the external sync earlier than we were expecting, and need to do catchup
-                        while(beatCounter[19] != 0)
-                        {
-                            OnTempoPulse();
-                        }
-                        tempoPhase = 0;
-                    }
-                }
-                // if we are running from an external clock, and the next pulse would be the clock pulse of the external sync, then wait for it to pulse
-                else
-                {
-                    int syncRate = getTickCountForRateIndex(4);
-                    // if((songData.GetSyncOutMode() & SyncModePO) > 0)
-                    //     rate = 4;
-                    if((songData.GetSyncInMode() & SyncMode4PQ) > 0)
-                        syncRate = getTickCountForRateIndex(2);
-                    if(beatCounter[19]%syncRate == 0 && (tempoPhase >> 31) > 0)
-                    {
-                        tempoPhase &= 0x7fffffff;
-                        tempoPulse = true;
-                    }
-                }
-            }
-            if(tempoPulse)
-            {
-                OnTempoPulse();
-            }
-        }
     }
     if((songData.GetSyncOutMode()&(SyncModePO|SyncMode4PQ)) > 0)
     {
@@ -430,9 +401,18 @@ void __not_in_flash_func(GrooveBox::Render)(int16_t* output_buffer, int16_t* inp
     int64_t currentRender = absolute_time_diff_us(renderStartTime, renderEndTime);
     renderTime += currentRender;
     sampleCount++;
+    sampleClock += SAMPLES_PER_BLOCK;
     midi.Flush();
 }
 
+// where in the block the tempo phase overflowed, it moves on by tempoPhaseIncrement every block
+uint8_t __not_in_flash_func(GrooveBox::GetPulseOffset)(uint32_t lastTempoPhase)
+{
+    uint32_t remaining = (0x80000000-lastTempoPhase)>>8;
+    uint32_t offset = remaining*SAMPLES_PER_BLOCK/((tempoPhaseIncrement>>8)+1);
+    return offset < SAMPLES_PER_BLOCK ? offset : SAMPLES_PER_BLOCK-1;
+}
+
 void GrooveBox::OnMidiNote(int note)
 {
     if( note >= 0)
@@ -442,27 +422,68 @@ void GrooveBox::OnMidiNote(int note)
     }
 }
 
-void GrooveBox::OnMidiSync()
+void GrooveBox::OnMidiNoteOff(int note)
 {
-    if(songData.GetSyncInMode() != SyncModeMidi)
-        return;
-    // need to recalculate our samples since last sync, etc
-    tempoPhaseIncrement = ((uint64_t)0x7fffffff*16*96)/samples_since_last_sync;
-    if(!IsPlaying())
-        return;
-    if((beatCounter[19]+1)%8 == 0)
-    {
-        tempoPhase = 0;
-        OnTempoPulse();
-    }
+    uint8_t voice = voiceAllocator.NoteOff(note);
+    // stolen notes and the ones the sequencer took over have nothing to let go of
+    if(voice != ALLOCATOR_NO_VOICE)
+        instruments[voice].NoteOff();
+}
+
+// plays the midi that came in, a block after it came in so each event can land on its own sample
+// blocks that get rendered back to back are further behind the wall clock, the latency follows the
+// furthest behind a block has been recently, so it stays the same from block to block
+void __not_in_flash_func(GrooveBox::HandleMidiEvents)()
+{
+    uint64_t now = time_us_64();
+    uint32_t nowUs = now;
+    // the wall clock in samples, 32 samples per ms
+    int32_t lag = (uint32_t)(now*4/125)-sampleClock;
+    if(lag > midiLatency)
+        midiLatency = lag;
     else
+        midiLatency--;
+    MidiEvent event;
+    while(midi.PeekEvent(event))
+    {
+        int32_t age = (int32_t)(nowUs-event.time)*4/125;
+        int32_t offset = lag-midiLatency-age+SAMPLES_PER_BLOCK;
+        // came in after the wall clock time of this block, wait for the next one
+        if(offset >= SAMPLES_PER_BLOCK)
+            break;
+        midi.PopEvent();
+        midiEventTime = sampleClock+offset;
+        pulseOffset = offset < 0 ? 0 : offset;
+        midi.Dispatch(event);
+    }
+    pulseOffset = 0;
+}
+
+void __not_in_flash_func(GrooveBox::UpdateMidiParams)()
+{
+    uint16_t changed = midiMap.Update(patterns, GetCurrentPattern());
+    if(changed == 0)
+        return;
+    // one update per voice per block, however many messages came in
+    for(int i=0;i<8;i++)
     {
-        // we got the external sync earlier than we were expecting, and need to do catchup
-        while((beatCounter[19]+1)%8 != 0)
-        {
-            OnTempoPulse();
-        }
+        if(((changed>>voiceChannel[i])&1) > 0)
+            instruments[i].UpdateVoiceData(patterns[voiceChannel[i]]);
     }
+    ResetADCLatch();
+}
+
+void GrooveBox::OnMidiSync()
+{
+    if(songData.GetSyncInMode() != SyncModeMidi)
+        return;
+    clockSync.OnEdge(midiEventTime);
+}
+
+// pulses since the last pulse on an edge of the external clock, 16 fractional bits
+uint32_t GrooveBox::GetSyncPosition()
+{
+    return ((uint32_t)((GetBeatCounter(19)+trackPeriod[19]-1)%trackPeriod[19])<<16)|(tempoPhase>>15);
 }
 void GrooveBox::OnMidiStart()
 {
@@ -486,31 +507,168 @@ void GrooveBox::OnMidiPosition(uint16_t position)
 {
     if(songData.GetSyncInMode() != SyncModeMidi)
         return;
-    // position is given in 16th notes, so we need to tempo pulse up to the current song position from zero
-    // * 6 to get 24ppq, * 4 to get 96 ppq
-    ResetPatternOffset();
-    position = position * 6 * 4;
-    chainStep = 0;
-    for(int i=0;i<position;i++)
+    // position is given in 16th notes, * 6 to get 24ppq, * 4 to get 96 ppq
+    SeekToTick((uint32_t)position * 6 * 4);
+}
+
+// puts every track where it would be after playing the chain from the start for this many pulses
+// the next OnTempoPulse plays that pulse
+void GrooveBox::SeekToTick(uint32_t tick)
+{
+    // the chain entries last for the length of the global pattern
+    uint32_t chainTicks = 0;
+    bool singlePattern = true;
+    for(int c=0;c<patternChainLength;c++)
+    {
+        chainTicks += songData.GetLength(patternChain[c])*24;
+        if(patternChain[c] != patternChain[0])
+            singlePattern = false;
+    }
+    uint32_t ticksInChain = tick%chainTicks;
+    int entry = 0;
+    uint32_t entryTicks = songData.GetLength(patternChain[0])*24;
+    while(ticksInChain >= entryTicks)
+    {
+        ticksInChain -= entryTicks;
+        entry++;
+        entryTicks = songData.GetLength(patternChain[entry])*24;
+    }
+    // the tracks restart whenever the pattern changes, so find where this run of the pattern started
+    uint32_t runStart = tick-ticksInChain;
+    if(singlePattern)
+    {
+        runStart = 0;
+    }
+    else
+    {
+        int previous = (entry+patternChainLength-1)%patternChainLength;
+        while(runStart > 0 && patternChain[previous] == patternChain[entry])
+        {
+            runStart -= songData.GetLength(patternChain[previous])*24;
+            previous = (previous+patternChainLength-1)%patternChainLength;
+        }
+    }
+    // the first pulse of an entry is the one that moves the chain on to it
+    chainStep = entry;
+    if(ticksInChain == 0)
+        chainStep = (entry+patternChainLength-1)%patternChainLength;
+    playingPattern = patternChain[chainStep];
+    // the tick the next pulse plays is tick, everything is scheduled relative to that
+    uint32_t origin = tickCount-tick;
+    for(int v=0;v<20;v++)
+    {
+        // the midi clock out keeps running through seeks
+        if(v==18)
+            continue;
+        trackPeriod[v] = GetTrackPeriod(v);
+        uint32_t start = runStart;
+        if(v == 16)
+            start = tick-ticksInChain;
+        // the input sync only restarts with the song
+        if(v == 19)
+            start = 0;
+        // steps played since the track started, including one on its first tick
+        uint32_t steps = (tick-start+trackPeriod[v]-1)/trackPeriod[v];
+        nextTrackTick[v] = origin+start+steps*trackPeriod[v];
+        if(v == 16)
+        {
+            patternStep[v] = steps%songData.GetLength(GetCurrentPattern());
+        }
+        else if(v < 16)
+        {
+            uint8_t length = patterns[v].GetLength(GetCurrentPattern());
+            patternStep[v] = steps%length;
+            patternLoopCount[v] = steps/length;
+        }
+    }
+    UpdateNextEventTick();
+}
+
+
+uint8_t GrooveBox::GetTrackPeriod(uint8_t track)
+{
+    uint8_t rate = 0;
+    switch(track)
+    {
+        case 16: // global pattern (pattern change counter) always uses 16th notes
+            rate = 2;
+            break;
+        case 17: // pocket operator / pulse sync
+            if((songData.GetSyncOutMode() & SyncModePO) > 0)
+                rate = 4;
+            else if((songData.GetSyncOutMode() & SyncMode4PQ) > 0)
+                rate = 2;
+            else
+                rate = 0;
+            break;
+        case 18: // midi sync
+            rate = 7;
+            break;
+        case 19: // input sync, steps on every edge of the external clock
+            // rate = 8;
+            if((songData.GetSyncInMode() & SyncModePO) > 0)
+                rate = 4;
+            else if((songData.GetSyncInMode() & SyncMode4PQ) > 0)
+                rate = 2;
+            else if((songData.GetSyncInMode() & SyncModeMidi) > 0)
+                rate = 7;
+            break;
+        default:
+            rate = ((patterns[track].GetRateForPattern(GetCurrentPattern())*7)>>8);
+    }
+    return getTickCountForRateIndex(rate);
+}
+
+void GrooveBox::RescheduleTracks()
+{
+    for(int v=0;v<20;v++)
     {
-        OnTempoPulse(true);
+        // keep the ticks since the last step, wrapped to the new period
+        uint8_t counter = GetBeatCounter(v);
+        trackPeriod[v] = GetTrackPeriod(v);
+        counter = counter%trackPeriod[v];
+        nextTrackTick[v] = tickCount + (counter == 0 ? 0 : trackPeriod[v]-counter);
     }
+    UpdateNextEventTick();
 }
 
+void GrooveBox::UpdateNextEventTick()
+{
+    uint32_t soonest = 0xffffffff;
+    for(int v=0;v<20;v++)
+    {
+        // distances, so this keeps working when the tick count wraps
+        uint32_t distance = nextTrackTick[v]-tickCount;
+        if(distance < soonest)
+            soonest = distance;
+    }
+    nextEventTick = tickCount+soonest;
+}
 
-void GrooveBox::OnTempoPulse(bool advanceOnly)
+void __not_in_flash_func(GrooveBox::OnTempoPulse)()
 {
+    // hold on the first step of the next song until it has been swapped in
+    if(songSwitchDue)
+        return;
+    if(VoiceData::rateChanged)
+    {
+        VoiceData::rateChanged = false;
+        RescheduleTracks();
+    }
+    // a queued song takes over where the chain would start over
+    if(nextTrackTick[16]==tickCount && patternStep[16] == 0 && chainStep == patternChainLength-1 && SongSwitchReady())
+    {
+        songSwitchDue = true;
+        return;
+    }
     bool needsMidiSync = false;
     // send the sync pulse to all the instruments
-    if(!advanceOnly)
+    for(int v=0;v<VOICE_COUNT;v++)
     {
-        for(int v=0;v<VOICE_COUNT;v++)
-        {
-            instruments[v].TempoPulse(patterns[v]);
-        }
+        instruments[v].TempoPulse(patterns[v]);
     }
     // advance chain if the global pattern just overflowed on the last beat counter
-    if(beatCounter[16]==0 && patternStep[16] == 0)
+    if(nextTrackTick[16]==tickCount && patternStep[16] == 0)
     {
         chainStep = (++chainStep)%patternChainLength;
         // if we are moving to a new pattern, reset all the steps to zero
@@ -520,45 +678,19 @@ void GrooveBox::OnTempoPulse(bool advanceOnly)
             ResetPatternOffset();
         }
     }
-    // four extra counters
-    // 17: the pattern change counter
-    // 18: the pulse sync output counter
-    // 19: the midi sync
-    // 20: input pulse counter
+    // most pulses don't step any track, skip the scan until the soonest one is due
+    if(tickCount != nextEventTick)
+    {
+        tickCount++;
+        return;
+    }
     for(int v=0;v<20;v++)
     {
-        bool needsTrigger = beatCounter[v]==0;
-        beatCounter[v]++;
-        uint8_t rate = 0;
-        switch(v)
-        {
-            case 16: // global pattern (pattern change counter) always uses 16th notes
-                rate = 2;
-                break;
-            case 17: // pocket operator / pulse sync
-                if((songData.GetSyncOutMode() & SyncModePO) > 0)
-                    rate = 4;
-                else if((songData.GetSyncOutMode() & SyncMode4PQ) > 0)
-                    rate = 2;
-                else
-                    rate = 0;
-                break;
-            case 18: // midi sync
-                rate = 7;
-                break;
-            case 19: // input sync
-                // rate = 8;
-                if((songData.GetSyncInMode() & SyncModePO) > 0)
-                    rate = 4;
-                else if((songData.GetSyncInMode() & SyncMode4PQ) > 0)
-                    rate = 2;
-                break;
-            default:
-                rate = ((patterns[v].GetRateForPattern(GetCurrentPattern())*7)>>8);
-        }
-        beatCounter[v] = beatCounter[v]%getTickCountForRateIndex(rate);
-        if(!needsTrigger)
+        if(nextTrackTick[v] != tickCount)
             continue;
+        // the rate is read when the track steps, same as the old per pulse counters
+        trackPeriod[v] = GetTrackPeriod(v);
+        nextTrackTick[v] = tickCount+trackPeriod[v];
         if(v==17){
             sync_count = 6;
             continue;
@@ -570,12 +702,14 @@ void GrooveBox::OnTempoPulse(bool advanceOnly)
         }
         if(v==19)
         {
+            if(songData.GetSyncInMode() != SyncModeNone)
+                clockSync.OnEdgePulse();
             continue;
         }
         // never trigger for the global pattern
         uint8_t requestedNote;
         uint8_t requestedKey = {0};
-        if(!advanceOnly && v!=16 && v!=17 && GetTrigger(v, patternStep[v], requestedNote, requestedKey))
+        if(v!=16 && v!=17 && GetTrigger(v, patternStep[v], requestedNote, requestedKey))
         {
             hadTrigger = hadTrigger|(1<<v);
             if((allowPlayback>>v)&0x1)
@@ -616,7 +750,9 @@ void GrooveBox::OnTempoPulse(bool advanceOnly)
             }
         }
     }
-    if(!advanceOnly && needsMidiSync && ((songData.GetSyncOutMode()&SyncModeMidi) > 0))
+    UpdateNextEventTick();
+    tickCount++;
+    if(needsMidiSync && ((songData.GetSyncOutMode()&SyncModeMidi) > 0))
     {
         midi.TimingClock();
     }
@@ -628,33 +764,18 @@ void GrooveBox::TriggerInstrument(uint8_t key, int16_t midi_note, uint8_t step,
     voiceCounter = channel%4+(channel/8)*4;
     Instrument *nextPlay = &instruments[voiceCounter];
     voiceChannel[voiceCounter] = channel;
+    voiceAllocator.Take(voiceCounter);
     //printf("playing file for voice: %i %x\n", channel, voiceData.GetFile());
 
-    nextPlay->NoteOn(key, midi_note, step, pattern, livePlay, voiceData);
+    nextPlay->NoteOn(key, midi_note, step, pattern, livePlay, voiceData, pulseOffset);
     return;    
 }
 void GrooveBox::TriggerInstrumentMidi(int16_t midi_note, uint8_t step, uint8_t pattern, VoiceData &voiceData, int channel)
 {
-    Instrument *nextPlay = &instruments[channel];
-    // determine if any of the voices are done playing
-    bool foundVoice = false;
-    for (size_t i = 0; i < VOICE_COUNT; i++)
-    {
-        if(!instruments[i].IsPlaying())
-        {
-            nextPlay = &instruments[i];
-            foundVoice = true;
-            voiceChannel[i] = channel;
-            break;
-        }
-    }
+    uint8_t voice = voiceAllocator.NoteOn(midi_note);
+    voiceChannel[voice] = channel;
     uint8_t _key = {0}; 
-    nextPlay->NoteOn(_key, midi_note, step, pattern, true, voiceData);
-    if(!foundVoice)
-    {
-        voiceChannel[voiceCounter] = channel;
-        voiceCounter = (++voiceCounter)%VOICE_COUNT;
-    }
+    instruments[voice].NoteOn(_key, midi_note, step, pattern, true, voiceData, pulseOffset);
 }
 bool GrooveBox::GetTrigger(uint voice, uint step, uint8_t &note, uint8_t &key)
 {
@@ -679,12 +800,12 @@ void GrooveBox::OnCCChanged(uint8_t cc, uint8_t newValue)
     {
         // set the midi mapping
         //lastEditedParam = param*2+1;
-        midiMap.SetCCTarget(cc, currentVoice, lastEditedParam, lastKeyPlayed);
+        midiMap.Learn(cc, currentVoice, lastEditedParam, lastKeyPlayed);
     }
     else
     {
+        // only sets where the parameter is headed, UpdateMidiParams moves it there
         midiMap.UpdateCC(patterns, cc, newValue*2, GetCurrentPattern());
-        ResetADCLatch(); // I'm not sure what this does :0 - but without it, we can't update the graphics :(
     }
 }
 bool GrooveBox::IsPlaying()
@@ -696,13 +817,16 @@ uint32_t screen_lfo_phase = 0;
 void GrooveBox::LowBatteryDisplay(ssd1306_t *p)
 {
     drawCount++;
-    LowBatteryDisplayInternal(p);
+    UiDisplayList *ui = GetDisplayList();
+    ui->Begin();
+    LowBatteryDisplayInternal(ui);
+    ui->End(p);
     // after a few seconds, force shutdown the system
     const int sixseconds = 30*6;
     if(drawCount > sixseconds)
         hardware_shutdown();
 }
-void GrooveBox::LowBatteryDisplayInternal(ssd1306_t *p)
+void GrooveBox::LowBatteryDisplayInternal(UiDisplayList *ui)
 {
     // blink the low battery indicator for 2 seconds every 20 seconds
     const int eightseconds = 30*8;
@@ -710,17 +834,17 @@ void GrooveBox::LowBatteryDisplayInternal(ssd1306_t *p)
     if(drawCount%eightseconds<twoseconds)
     {
         // low battery display
-        ssd1306_clear_square(p, 0, 0, 45, 16);
-        ssd1306_draw_square_rounded(p, 2, 2, 36, 12);
+        ui->ClearSquare(0, 0, 45, 16);
+        ui->DrawSquareRounded(2, 2, 36, 12);
         // bump at the top of the battery
-        ssd1306_draw_square_rounded(p, 35, 5, 6, 6);
-        ssd1306_clear_square_rounded(p, 34, 6, 6, 4);
+        ui->DrawSquareRounded(35, 5, 6, 6);
+        ui->ClearSquareRounded(34, 6, 6, 4);
         // clear center of battery
-        ssd1306_clear_square_rounded(p, 3, 3, 34, 10);
+        ui->ClearSquareRounded(3, 3, 34, 10);
 
         // battery fill
         if(drawCount%20>10)
-            ssd1306_draw_square_rounded(p, 4, 4, 6, 8);
+            ui->DrawSquareRounded(4, 4, 6, 8);
     }
 }
 void GrooveBox::SaveAndShutdown()
@@ -731,11 +855,9 @@ void GrooveBox::SaveAndShutdown()
     Serialize();
     hardware_shutdown();
 }
-void GrooveBox::UpdateDisplay(ssd1306_t *p)
+void GrooveBox::UpdateHousekeeping()
 {
-    drawCount++;
     framesSinceLastTouch++;
-    screen_lfo_phase += 0x2ffffff;
 
     // 5 minutes & 20 minutes 
     #define TWOMINS 0x1c20>>1
@@ -746,6 +868,18 @@ void GrooveBox::UpdateDisplay(ssd1306_t *p)
     {
         SaveAndShutdown();
     }
+    // erase slots left behind by full saves a block at a time, erasing stalls audio so wait until stopped
+    if(!IsPlaying() && !recording)
+    {
+        songFile.UpdateReclaim();
+    }
+    // saves only write what changed, so this is cheap enough to run in the background
+    framesSinceLastSave++;
+    if(framesSinceLastSave > AUTOSAVE_FRAMES && !recording && !erasing)
+    {
+        // compacting erases flash, which stalls audio for too long while playing
+        SerializeInBackground(!IsPlaying());
+    }
     // if(usbSerialDevice->NeedsSongData())
     // {
     //     SerializeToSerial();
@@ -754,11 +888,33 @@ void GrooveBox::UpdateDisplay(ssd1306_t *p)
     // {
     //     DeserializeFromSerial();
     // }
-
-
-    ssd1306_clear(p);
+}
+void GrooveBox::UpdateDisplay(ssd1306_t *p)
+{
+    drawCount++;
+    screen_lfo_phase += 0x2ffffff;
+    uint32_t frameStart = time_us_32();
+    UiDisplayList *ui = GetDisplayList();
+    ui->Begin();
+    DrawDisplay(ui);
+    ui->End(p);
+    // the drawing and working out the leds, SendDisplay adds the rest
+    uiFrameTime = time_us_32()-frameStart;
+}
+void GrooveBox::SendDisplay(ssd1306_t *p)
+{
+    uint32_t sendStart = time_us_32();
+    ssd1306_show(p);
+    ws2812_setColors(color+5);
+    ws2812_trigger();
+    uiFrameTime += time_us_32()-sendStart;
+    if(uiFrameTime > uiFrameTimeMax)
+        uiFrameTimeMax = uiFrameTime;
+}
+// records the screen into the display list, it only reaches the framebuffer when it changed
+void GrooveBox::DrawDisplay(UiDisplayList *ui)
+{
     char str[64];
-    ssd1306_set_string_color(p, false);
 
     //printf("raw: 0x%03x, volt: %f V\n", result, result * conversion_factor * 2.3368f);
     // 3.1f here is a number that I just typed in until it lined up correctly with the measurement from the board
@@ -797,13 +953,13 @@ void GrooveBox::UpdateDisplay(ssd1306_t *p)
                 patterns[currentVoice].SetDefaultParams();
             }
         }
-        ssd1306_draw_string_gfxfont(p, 3, 12, str, true, 1, 1, &m6x118pt7b);
+        ui->DrawString(3, 12, str, true);
         return;
     }
     else if(holdingArm && holdingEscape)
     {
         sprintf(str, "press red to erase sample");
-        ssd1306_draw_string_gfxfont(p, 3, 12, str, true, 1, 1, &m6x118pt7b);
+        ui->DrawString(3, 12, str, true);
         for(int i=0;i<16;i++)
         {
             int x = i%4;
@@ -822,10 +978,9 @@ void GrooveBox::UpdateDisplay(ssd1306_t *p)
     }
     else if(erasing)
     {
-        ssd1306_clear(p);
         sprintf(str, "ERASING...");
         // ssd1306_draw_square_rounded(p, 0, 17, width, 15);
-        ssd1306_draw_string_gfxfont(p, 3, 12, str, true, 1, 1, &m6x118pt7b);
+        ui->DrawString(3, 12, str, true);
         return;
     }
     else if(holdingArm && !recording)
@@ -834,8 +989,8 @@ void GrooveBox::UpdateDisplay(ssd1306_t *p)
         {
             sprintf(str, "hold red to sample");
             // ssd1306_draw_square_rounded(p, 0, 17, width, 15);
-            ssd1306_draw_string_gfxfont(p, 3, 12, str, true, 1, 1, &m6x118pt7b);
-            ssd1306_draw_square(p, 0, 17, last_input>>8, 32-17);
+            ui->DrawString(3, 12, str, true);
+            ui->DrawSquare(0, 17, last_input>>8, 32-17);
             for(int i=0;i<16;i++)
             {
                 int x = i%4;
@@ -855,15 +1010,15 @@ void GrooveBox::UpdateDisplay(ssd1306_t *p)
         {
             sprintf(str, "no time remaining");
             // ssd1306_draw_square_rounded(p, 0, 17, width, 15);
-            ssd1306_draw_string_gfxfont(p, 3, 12, str, true, 1, 1, &m6x118pt7b);
-            ssd1306_draw_square(p, 0, 17, last_input>>8, 32-17);
+            ui->DrawString(3, 12, str, true);
+            ui->DrawSquare(0, 17, last_input>>8, 32-17);
         }
         return;
     }
     else if(shutdownTime > 0 && holdingEscape)
     {
         sprintf(str, "shutdown in %i", shutdownTime/30);
-        ssd1306_draw_string_gfxfont(p, 3, 12, str, true, 1, 1, &m6x118pt7b);
+        ui->DrawString(3, 12, str, true);
         shutdownTime--;  
         if(shutdownTime == 0)
         {
@@ -874,83 +1029,135 @@ void GrooveBox::UpdateDisplay(ssd1306_t *p)
     else if(clearTime == 0 && patternSelectMode && holdingEscape)
     {
         sprintf(str, "pat %i cleared", GetCurrentPattern()+1);
-        ssd1306_draw_string_gfxfont(p, 3, 12, str, true, 1, 1, &m6x118pt7b);
+        ui->DrawString(3, 12, str, true);
         return;
     }
     else if(clearTime == 0 && paramSelectMode && holdingEscape)
     {
         sprintf(str, "voice %i cleared", currentVoice+1);
-        ssd1306_draw_string_gfxfont(p, 3, 12, str, true, 1, 1, &m6x118pt7b);
+        ui->DrawString(3, 12, str, true);
         return;
     }
     else if(recording)
     {
         sprintf(str, "Sampling to %i", recordingTarget+1);
-        ssd1306_draw_string_gfxfont(p, 3, 12, str, true, 1, 1, &m6x118pt7b);
+        ui->DrawString(3, 12, str, true);
         sprintf(str, "%i Secs Remaining", (GetRemainingRecordingBytes())/64000);
-        ssd1306_draw_string_gfxfont(p, 3, 17+12, str, true, 1, 1, &m6x118pt7b);
+        ui->DrawString(3, 17+12, str, true);
+        return;
+    }
+    else if(soundSelectMode && patternSelectMode)
+    {
+        // song library
+        if(!songLibraryScanned)
+            ScanSongLibrary();
+        sprintf(str, "Song %i", GetCurrentSong()+1);
+        ui->DrawString(3, 12, str, true);
+        if(queuedSong >= 0)
+        {
+            sprintf(str, "next %i%s", queuedSong+1, songFile.IsPrepared()?"":"...");
+            ui->DrawString(3, 17+12, str, true);
+        }
+        for(int i=0;i<SONG_COUNT;i++)
+        {
+            int x = i%4;
+            int y = i/4;
+            int key = x+(y+1)*5;
+            if(GetCurrentSong() == i)
+            {
+                color[key] = urgb_u32(10, 200, 45);
+            }
+            else if(queuedSong == i)
+            {
+                color[key] = (drawCount>>3)&1 ? urgb_u32(200, 120, 10) : urgb_u32(0,0,0);
+            }
+            else if((songLibrary>>i)&1)
+            {
+                color[key] = urgb_u32(150, 40, 150);
+            }
+            else
+            {
+                color[key] = urgb_u32(0,0,0);
+            }
+        }
         return;
     }
     else if(patternSelectMode && holdingWrite)
     {
         sprintf(str, "copy pat %i to", GetCurrentPattern()+1);
-        ssd1306_draw_string_gfxfont(p, 3, 12, str, true, 1, 1, &m6x118pt7b);
+        ui->DrawString(3, 12, str, true);
         return;
     }
     else if(soundSelectMode && holdingWrite)
     {
         sprintf(str, "copy voice %i to", currentVoice+1);
-        ssd1306_draw_string_gfxfont(p, 3, 12, str, true, 1, 1, &m6x118pt7b);
+        ui->DrawString(3, 12, str, true);
         return;
     }
     else if(!patternSelectMode)
     {
-        int width = 45;
-        sprintf(str, "Snd %i", currentVoice+1);
-        if(soundSelectMode)
-            ssd1306_draw_square_rounded(p, 0, 0, width, 15);
-        ssd1306_draw_string_gfxfont(p, 3, 12, str, !soundSelectMode, 1, 1, &m6x118pt7b);
-        // sprintf(str, "Snd %i", currentVoice);
-        sprintf(str, "Pat %i", GetCurrentPattern()+1);
-        // sprintf(str, "%i", AdcInterpolatedA>>2);
-        // ssd1306_draw_square_rounded(p, 0, 17, width, 15);
-        ssd1306_draw_string_gfxfont(p, 3, 17+12, str, true, 1, 1, &m6x118pt7b);
+        const uint32_t inputs[] = {currentVoice, soundSelectMode, GetCurrentPattern()};
+        if(!ui->Reuse(UiWidgetStatus, inputs, 3))
+        {
+            int width = 45;
+            sprintf(str, "Snd %i", currentVoice+1);
+            if(soundSelectMode)
+                ui->DrawSquareRounded(0, 0, width, 15);
+            ui->DrawString(3, 12, str, !soundSelectMode);
+            // sprintf(str, "Snd %i", currentVoice);
+            sprintf(str, "Pat %i", GetCurrentPattern()+1);
+            // sprintf(str, "%i", AdcInterpolatedA>>2);
+            // ssd1306_draw_square_rounded(p, 0, 17, width, 15);
+            ui->DrawString(3, 17+12, str, true);
+        }
     }
 
     // copy pattern
     if(patternSelectMode && clearTime < 0 && !holdingWrite)
     {
-        ssd1306_draw_string(p, 0, 8, 1, "chn");
-        if(patternChainLength>0)
+        // patterns are 4 bits, so the chain packs into two inputs
+        uint32_t inputs[4] = {(uint32_t)patternChainLength, (uint32_t)chainStep, 0, 0};
+        for(int i=0;i<patternChainLength;i++)
+            inputs[2+i/8] |= (patternChain[i]&0xf)<<((i%8)*4);
+        if(!ui->Reuse(UiWidgetStatus, inputs, 4))
         {
+            ui->DrawSmallString(0, 8, "chn");
             for(int i=0;i<patternChainLength;i++)
             {
                 int boxX = 24+(i%8)*12;
                 int boxY = 8+12*(i/8);
                 if(i==chainStep)
                 {
-                    ssd1306_draw_square(p, boxX, boxY+10, 15, 1);
+                    ui->DrawSquare(boxX, boxY+10, 15, 1);
                 }
                 int pDisp = patternChain[i]+1;
                 sprintf(str, "%i", pDisp);
                 int offset = pDisp < 10?3:0;
-                ssd1306_draw_string(p, boxX+2+offset, boxY+2, 1, str);
+                ui->DrawSmallString(boxX+2+offset, boxY+2, str);
             }
         }
     }
     else
     {
-        if(selectedGlobalParam)
-        {
-            // special casing the octave display
-            songData.DrawParamString(param, GetCurrentPattern(), str, patterns[currentVoice].GetOctave());
-        }
-        else
-        {
-            uint8_t paramLockSignal = storingParamLockForStep;
-            if(holdingWrite)
-                paramLockSignal = patternStep[currentVoice];
-            patterns[currentVoice].DrawParamString(param, str, lastKeyPlayed, GetCurrentPattern(), 0x7f&paramLockSignal, 0x80&storingParamLockForStep);
+        uint8_t paramLockSignal = storingParamLockForStep;
+        if(holdingWrite)
+            paramLockSignal = patternStep[currentVoice];
+        // the jitter from samples with 8 fractional bits to tenths of a ms
+        int16_t clockJitter = clockSync.IsLocked() ? (clockSync.GetJitter()>>8)*10/32 : -1;
+        // the values shown come out of the song data, any edit or load moves the edit count
+        const uint32_t inputs[] = {param, selectedGlobalParam, currentVoice, GetCurrentPattern(), lastKeyPlayed,
+            (uint32_t)(0x7f&paramLockSignal)|(0x80&storingParamLockForStep), SongFile::GetEditCount(), (uint32_t)clockJitter};
+        if(!ui->Reuse(UiWidgetParams, inputs, 8))
+        {
+            if(selectedGlobalParam)
+            {
+                // special casing the octave display
+                songData.DrawParamString(param, GetCurrentPattern(), str, patterns[currentVoice].GetOctave(), clockJitter);
+            }
+            else
+            {
+                patterns[currentVoice].DrawParamString(param, str, lastKeyPlayed, GetCurrentPattern(), 0x7f&paramLockSignal, 0x80&storingParamLockForStep);
+            }
         }
     }
     uint8_t fade_speed = 0xaf;
@@ -1085,17 +1292,19 @@ void GrooveBox::UpdateDisplay(ssd1306_t *p)
     // input level monitor
     // ssd1306_draw_line(p, 0, 0, last_input>>8, 0);
     // draw the current page within the pattern that we are editing 
+    ui->SetWidget(UiWidgetPages);
     for (size_t i = 0; i < 4; i++)
     {
         if((i+1) > ((patterns[currentVoice].GetLength(GetCurrentPattern())-1)/16+1))
             break;
-        ssd1306_draw_square_rounded(p, 48, i*8+1, 6, 6);
+        ui->DrawSquareRounded(48, i*8+1, 6, 6);
         if(editPage[currentVoice] != i)
         {
-            ssd1306_clear_square(p, 48+1, i*8+1+1, 4, 4);
+            ui->ClearSquare(48+1, i*8+1+1, 4, 4);
         }
     }
     hadTrigger = 0;
+    ui->SetWidget(UiWidgetBattery);
     if(!hardware_has_usb_power())
     {
         float bLev = hardware_get_battery_level_float();
@@ -1105,7 +1314,7 @@ void GrooveBox::UpdateDisplay(ssd1306_t *p)
         }
         else if(bLev < 3.7f)
         {
-            LowBatteryDisplayInternal(p);
+            LowBatteryDisplayInternal(ui);
         }
         
     }
@@ -1114,15 +1323,26 @@ void GrooveBox::UpdateDisplay(ssd1306_t *p)
         powerHoldTime++;
         if(powerHoldTime > 30*2)
         {
-            ssd1306_clear_square(p, 0, 0, 45, 16);
-            sprintf(str, "v:%.2f",  hardware_get_battery_level_float());
-            ssd1306_draw_string_gfxfont(p, 3, 12, str, true, 1, 1, &m6x118pt7b);
+            // formatting a float is slow, only do it when the shown digits change
+            const uint32_t inputs[] = {(uint32_t)(hardware_get_battery_level_float()*100.0f+0.5f)};
+            if(!ui->Reuse(UiWidgetVoltage, inputs, 1))
+            {
+                ui->ClearSquare(0, 0, 45, 16);
+                sprintf(str, "v:%.2f", inputs[0]/100.0f);
+                ui->DrawString(3, 12, str, true);
+            }
         }
     }
     else
     {
         powerHoldTime = -1;
     }
+    // save progress along the bottom edge
+    ui->SetWidget(UiWidgetSave);
+    if(songFile.IsSaving())
+    {
+        ui->DrawLine(0, 31, songFile.GetSaveProgress()>>1, 31);
+    }
 
     // uint16_t param = instruments[currentVoice%4+(currentVoice/8)*4].pWithMods;
 
@@ -1154,11 +1374,25 @@ void GrooveBox::SetGlobalParameter(uint8_t a, uint8_t b, bool setA, bool setB)
     uint8_t& current_b = songData.GetParam(param*2+1, GetCurrentPattern());
     if(paramSetA)
     {
+        if(*current_a != a)
+        {
+            if(param == 24)
+                patterns[currentVoice].MarkDirty();
+            else
+                songData.MarkDirty();
+            // the sync modes set the rate of the sync tracks
+            VoiceData::rateChanged = true;
+        }
         *current_a = a;
         lastAdcValA = a;
     }
     if(paramSetB)
     {
+        if(current_b != b)
+        {
+            songData.MarkDirty();
+            VoiceData::rateChanged = true;
+        }
         current_b = b;
         lastAdcValB = b;
     }
@@ -1185,15 +1419,9 @@ void GrooveBox::OnAdcUpdate(uint16_t a_in, uint16_t b_in)
         );
     };
 
-    a_in = remap(a_in<<4)>>4;
-    b_in = remap(b_in<<4)>>4;
-    
-    // interpolate the input values
-    uint16_t interpolationbias = 0xd000; 
-    AdcInterpolatedA = (((uint32_t)a_in)*(0xffff-interpolationbias) + ((uint32_t)AdcInterpolatedA)*interpolationbias)>>16;
-    AdcInterpolatedB = (((uint32_t)b_in)*(0xffff-interpolationbias) + ((uint32_t)AdcInterpolatedB)*interpolationbias)>>16;
-    uint8_t a = AdcInterpolatedA>>4;
-    uint8_t b = AdcInterpolatedB>>4; 
+    // the pots come in oversampled with hysteresis, and only when they move, so there is no smoothing here
+    uint8_t a = remap(a_in<<4)>>8;
+    uint8_t b = remap(b_in<<4)>>8;
     if(needsInitialADC > 0)
     {
         lastAdcValA = a;
@@ -1288,6 +1516,8 @@ void GrooveBox::OnAdcUpdate(uint16_t a_in, uint16_t b_in)
     {
         // eventually will need to encode the page number in the param - not there yet
         lastEditedParam = param*2;
+        if(current_a != a)
+            patterns[currentVoice].MarkParamDirty(param*2, GetCurrentPattern());
         current_a = a;
         voiceNeedsUpdate = true;
         lastAdcValA = a;
@@ -1295,6 +1525,8 @@ void GrooveBox::OnAdcUpdate(uint16_t a_in, uint16_t b_in)
     if(paramSetB)
     {
         lastEditedParam = param*2+1;
+        if(current_b != b)
+            patterns[currentVoice].MarkParamDirty(param*2+1, GetCurrentPattern());
         current_b = b;
         voiceNeedsUpdate = true;
         lastAdcValB = b;
@@ -1327,6 +1559,10 @@ void GrooveBox::FinishRecording()
 void GrooveBox::StartPlaying()
 {
     ResetPatternOffset();
+    nextTrackTick[19] = tickCount;
+    // on an external clock the first pulse goes with the first edge
+    if(songData.GetSyncInMode() != SyncModeNone)
+        tempoPhase = 0x7fffffff;
     ContinuePlaying();
 }
 void GrooveBox::StartWaitingForSync()
@@ -1336,6 +1572,7 @@ void GrooveBox::StartWaitingForSync()
 void GrooveBox::ContinuePlaying()
 {
     playing = true;
+    clockSync.ResetEdges();
     if((songData.GetSyncOutMode()&SyncModeMidi) > 0)
     {
         midi.StopSequence();
@@ -1352,6 +1589,17 @@ void GrooveBox::StopPlaying()
     if((songData.GetSyncOutMode()&SyncModeMidi) > 0)
         midi.StopSequence();
 }
+void GrooveBox::HandleKeyEvents()
+{
+    key_event_t event;
+    while(hardware_get_key_event(&event))
+    {
+        keyLatency = time_us_32()-event.time;
+        if(keyLatency > keyLatencyMax)
+            keyLatencyMax = keyLatency;
+        OnKeyUpdate(event.key, event.pressed);
+    }
+}
 void GrooveBox::OnKeyUpdate(uint key, bool pressed)
 {
     framesSinceLastTouch = 0;
@@ -1420,6 +1668,7 @@ void GrooveBox::OnKeyUpdate(uint key, bool pressed)
             else
             {
                 patterns[currentVoice].SetNoteForPattern(GetCurrentPattern(), sequenceStep+editPage[currentVoice]*16, (0x7f&lastNotePlayed)|0x80);
+                patterns[currentVoice].MarkPatternDirty(GetCurrentPattern());
                 patterns[currentVoice].GetKeysForPattern(GetCurrentPattern())[sequenceStep+editPage[currentVoice]*16] = lastKeyPlayed;
             }
         }
@@ -1452,6 +1701,10 @@ void GrooveBox::OnKeyUpdate(uint key, bool pressed)
                 FinishRecording();
             }
         }
+        else if(soundSelectMode && patternSelectMode)
+        {
+            QueueSong(sequenceStep);
+        }
         else if(soundSelectMode)
         {
 
@@ -1505,6 +1758,8 @@ void GrooveBox::OnKeyUpdate(uint key, bool pressed)
             {
                 // copy pattern
                 int currentPattern = patternChain[0];
+                songFile.LoadPattern(currentPattern);
+                songFile.LoadPattern(sequenceStep);
                 for (size_t voice = 0; voice < 16; voice++)
                 {
                     patterns[voice].CopyPattern(currentPattern, sequenceStep);
@@ -1526,6 +1781,8 @@ void GrooveBox::OnKeyUpdate(uint key, bool pressed)
                 }
                 if(patternChainLength<15)
                 {
+                    // normally already loaded in the background, but the chain can be picked right after boot
+                    songFile.LoadPattern(sequenceStep);
                     if(!playing && patternChainLength == 0)
                     {
                         playingPattern = sequenceStep;
@@ -1546,6 +1803,7 @@ void GrooveBox::OnKeyUpdate(uint key, bool pressed)
             uint16_t noteToModify = patternStep[currentVoice];
             uint8_t newValue = (0x7f&songData.GetNote(sequenceStep, patterns[currentVoice].GetOctave()))|0x80;
             patterns[currentVoice].SetNoteForPattern(patternChain[chainStep], noteToModify, newValue);
+            patterns[currentVoice].MarkPatternDirty(patternChain[chainStep]);
             patterns[currentVoice].GetKeysForPattern(patternChain[chainStep])[noteToModify] = sequenceStep;
         }
         else // writing
@@ -1709,61 +1967,251 @@ void GrooveBox::OnKeyUpdate(uint key, bool pressed)
 
 /* FILELIST
 *  --------
-*  0xffff: global data (last playing song)
-*  0-15: song data
+*  0x7fff, 0x7ffe: global data (last playing song, which slot each song is in)
+*  0-15: song data, one file per song in the library
+*  0x1000|0-15: other slot for song data, see SongFile.h
 *  (1<<8)&0-15: sample data
 */
 #define GLOBAL_DATA_FILEID 0x7fff
-bool serialize_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+#define GLOBAL_DATA_FILEID_ALT 0x7ffe
+// a global data file holds one record per page, once it is full the next commit moves to the other file
+#define GLOBAL_DATA_PAGES 15
+// version 2: song files are record logs, see SongFile.h
+// version 3: song segments end in a crc'd commit, global data is a crc'd log
+#define GLOBAL_DATA_VERSION 3
+void GrooveBox::SerializeGlobalData()
 {
-   Serializer *s = (Serializer*) stream->state;
-    for (size_t i = 0; i < count; i++)
+    // each record is written to its own page, so committing a new song id never erases the old one
+    ffs_file globalDataFile;
+    ffs_open(GetFilesystem(), &globalDataFile, globalDataFileId);
+    if(ffs_file_size(GetFilesystem(), &globalDataFile) >= GLOBAL_DATA_PAGES*256)
     {
-        s->AddData(buf[i]);
+        // this can run while playing, so the full file is left to the reclaim instead of erased here.
+        // until the other one is empty this one just keeps growing
+        uint16_t otherFileId = globalDataFileId == GLOBAL_DATA_FILEID ? GLOBAL_DATA_FILEID_ALT : GLOBAL_DATA_FILEID;
+        ffs_file otherFile;
+        ffs_open(GetFilesystem(), &otherFile, otherFileId);
+        if(!otherFile.initialized && !songFile.IsReclaiming(otherFileId))
+        {
+            // the records in this file stay valid until the other one has a newer one
+            songFile.Reclaim(globalDataFileId);
+            globalDataFileId = otherFileId;
+        }
     }
-    return true;
-}
-void GrooveBox::Serialize()
-{
-    // copy the floating bits of data
-    songData.SetPlayingPattern(playingPattern);
-    songData.StorePatternChain(patternChain);
-    songData.SetPatternChainLength(patternChainLength);
+    globalData.generation++;
 
-    // erase the existing file first
-    ffs_file globalDataFile;
-    erasing = true;
-    ffs_open(GetFilesystem(), &globalDataFile, GLOBAL_DATA_FILEID);
-    ffs_erase(GetFilesystem(), &globalDataFile);
-    erasing = false;
-    
     Serializer globalDataSerializer;
-    globalDataSerializer.Init(GLOBAL_DATA_FILEID);
+    globalDataSerializer.Init(globalDataFileId);
 
     pb_ostream_t serializerStream = {&serialize_callback, &globalDataSerializer, SIZE_MAX, 0};
+    globalDataSerializer.BeginCrc();
     pb_encode_ex(&serializerStream, GlobalData_fields, &globalData, PB_ENCODE_DELIMITED);
+    uint32_t crc = globalDataSerializer.EndCrc();
+    uint8_t crcBytes[4] = {(uint8_t)crc, (uint8_t)(crc>>8), (uint8_t)(crc>>16), (uint8_t)(crc>>24)};
+    pb_write(&serializerStream, crcBytes, 4);
     globalDataSerializer.Finish();
+}
+bool GrooveBox::DeserializeGlobalData()
+{
+    bool found = false;
+    const uint16_t fileIds[2] = {GLOBAL_DATA_FILEID, GLOBAL_DATA_FILEID_ALT};
+    for(int f=0;f<2;f++)
+    {
+        Serializer globalDataSerializer;
+        globalDataSerializer.Init(fileIds[f]);
+        pb_istream_t globalDataStream = {&deserialize_callback, &globalDataSerializer, SIZE_MAX};
+        for(uint32_t page=0;page<globalDataSerializer.writeFile.filesize;page+=256)
+        {
+            GlobalData record = GlobalData_init_zero;
+            globalDataSerializer.SeekTo(page);
+            globalDataStream.bytes_left = 256-4;
+            if(!pb_decode_ex(&globalDataStream, GlobalData_fields, &record, PB_DECODE_DELIMITED))
+                continue;
+            uint32_t length = globalDataSerializer.GetReadPosition()-page;
+            uint32_t storedCrc = 0;
+            for(int i=0;i<4;i++)
+            {
+                storedCrc |= globalDataSerializer.GetNextValue()<<(i*8);
+            }
+            // torn writes and records from before version 3 don't have a valid crc
+            if(globalDataSerializer.CalculateCrc(page, length) != storedCrc)
+                continue;
+            if(!found || record.generation > globalData.generation)
+            {
+                globalData = record;
+                globalDataFileId = fileIds[f];
+                found = true;
+            }
+        }
+    }
+    if(found)
+        return true;
 
-    ffs_file songFile;
-    erasing = true;
-    ffs_open(GetFilesystem(), &songFile, globalData.songId);
-    ffs_erase(GetFilesystem(), &songFile);
-    erasing = false;
-
-    Serializer s;
-    s.Init(0);
-    serializerStream = {&serialize_callback, &s, SIZE_MAX, 0};
-    songData.Serialize(&serializerStream);
-
-    for(int i=0;i<16;i++)
+    // version 1 and 2 stored a single record without a crc
+    Serializer globalDataSerializer;
+    globalDataSerializer.Init(GLOBAL_DATA_FILEID);
+    if(!globalDataSerializer.writeFile.initialized)
+        return false;
+    pb_istream_t globalDataStream = {&deserialize_callback, &globalDataSerializer, SIZE_MAX};
+    if(!pb_decode_ex(&globalDataStream, GlobalData_fields, &globalData, PB_DECODE_DELIMITED))
     {
-        patterns[i].Serialize(&serializerStream);
+        printf("GlobalData deserialize error: %s\n", PB_GET_ERROR(&globalDataStream));
     }
-    serializerStream.bytes_written = 0;
-    VoiceData::SerializeStatic(&serializerStream);
-
-    s.Finish();
-    printf("serialized song file size %i\n", s.writeFile.filesize);
+    globalDataFileId = GLOBAL_DATA_FILEID;
+    return true;
+}
+void GrooveBox::PrepareSerialize()
+{
+    // copy the floating bits of data
+    songData.SetPlayingPattern(playingPattern);
+    songData.StorePatternChain(patternChain);
+    songData.SetPatternChainLength(patternChainLength);
+    framesSinceLastSave = 0;
+}
+void GrooveBox::Serialize(bool allowCompaction)
+{
+    // let a background save land first, it has to be committed before the next one starts
+    while(songFile.IsSaving())
+    {
+        UpdateSave();
+    }
+    PrepareSerialize();
+    CommitSongFile(songFile.Save(globalData.songId, allowCompaction));
+}
+void GrooveBox::SerializeInBackground(bool allowCompaction)
+{
+    if(songFile.IsSaving())
+        return;
+    PrepareSerialize();
+    if(!songFile.BeginSave(globalData.songId, allowCompaction))
+    {
+        // nothing changed, but the global data might still need upgrading
+        CommitSongFile(globalData.songId);
+    }
+}
+void GrooveBox::UpdateSave()
+{
+    SongSaveResult result = songFile.UpdateSave();
+    if(result == SongSaveResultDone)
+    {
+        uint16_t savedFileId = songFile.SavedFileId();
+        if((savedFileId&~SONG_SLOT_FLAG) != GetCurrentSong())
+        {
+            // the snapshot of the song that was switched away from, it stays in its slot
+            songLibrary |= 1<<(savedFileId&~SONG_SLOT_FLAG);
+            return;
+        }
+        CommitSongFile(savedFileId);
+        // anything the collection moves goes into the next save
+        lockCollector.Begin(true);
+    }
+    else if(result == SongSaveResultIdle)
+    {
+        if(songSwitchDue || (!IsPlaying() && SongSwitchReady()))
+        {
+            SwitchSong();
+        }
+        else if(!songFile.UpdatePrepare())
+        {
+            // patterns that weren't needed at boot get decoded in the same gaps
+            if(!songFile.UpdateLoad())
+                lockCollector.Update();
+        }
+    }
+}
+void GrooveBox::CommitSongFile(uint16_t songFileId)
+{
+    uint8_t song = songFileId&~SONG_SLOT_FLAG;
+    songLibrary |= 1<<song;
+    // the global data only changes when the song moves to its other slot or the format changes
+    if(songFileId != globalData.songId || globalData.version != GLOBAL_DATA_VERSION)
+    {
+        uint16_t oldSongFileId = globalData.songId;
+        globalData.songId = songFileId;
+        globalData.version = GLOBAL_DATA_VERSION;
+        // the other songs are found through their slot bits
+        globalData.songSlots &= ~(1<<song);
+        if(songFileId&SONG_SLOT_FLAG)
+            globalData.songSlots |= 1<<song;
+        // this is the commit, until it lands the old slot is the live song
+        SerializeGlobalData();
+        if(oldSongFileId != songFileId)
+        {
+            songFile.Reclaim(oldSongFileId);
+        }
+    }
+}
+uint8_t GrooveBox::GetCurrentSong()
+{
+    return globalData.songId&~SONG_SLOT_FLAG;
+}
+uint16_t GrooveBox::GetSongFileId(uint8_t song)
+{
+    return ((globalData.songSlots>>song)&1) ? song|SONG_SLOT_FLAG : song;
+}
+void GrooveBox::QueueSong(uint8_t song)
+{
+    if(song == GetCurrentSong())
+    {
+        queuedSong = -1;
+        songFile.CancelPrepare();
+        return;
+    }
+    queuedSong = song;
+    songFile.Prepare(GetSongFileId(song));
+    // saving now keeps the snapshot taken at the switch small
+    SerializeInBackground(!IsPlaying());
+}
+bool GrooveBox::SongSwitchReady()
+{
+    // unsaved edits don't hold it up, SwitchSong saves them from a snapshot
+    return queuedSong >= 0 && songFile.IsPrepared() && !songFile.IsSaving();
+}
+void GrooveBox::SwitchSong()
+{
+    absolute_time_t switchStart = get_absolute_time();
+    PrepareSerialize();
+    if(!songFile.SaveSnapshot(globalData.songId))
+    {
+        // too much changed to hold in ram, save it the slow way and switch at the next chain end
+        songSwitchDue = false;
+        SerializeInBackground(!IsPlaying());
+        return;
+    }
+    if(!songFile.SwitchToPrepared())
+        return;
+    uint8_t song = queuedSong;
+    queuedSong = -1;
+    songSwitchDue = false;
+    globalData.songId = GetSongFileId(song);
+    SerializeGlobalData();
+    playingPattern = songData.GetPlayingPattern();
+    songData.LoadPatternChain(patternChain);
+    patternChainLength = songData.GetPatternChainLength();
+    songFile.LoadPattern(playingPattern);
+    for(int i=0;i<patternChainLength;i++)
+    {
+        songFile.LoadPattern(patternChain[i]);
+    }
+    // the next pulse starts the new chain from the top
+    ResetPatternOffset();
+    chainStep = patternChainLength-1;
+    nextPatternSelected = false;
+    framesSinceLastSave = 0;
+    lockCollector.Begin(false);
+    printf("switched to song %i in %lldus\n", song+1, absolute_time_diff_us(switchStart, get_absolute_time()));
+}
+void GrooveBox::ScanSongLibrary()
+{
+    songLibrary = 0;
+    for(int i=0;i<SONG_COUNT;i++)
+    {
+        ffs_file songFile;
+        ffs_open(GetFilesystem(), &songFile, GetSongFileId(i));
+        if(songFile.initialized)
+            songLibrary |= 1<<i;
+    }
+    songLibraryScanned = true;
 }
 
 bool serialize_to_serial_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count)
@@ -1791,28 +2239,19 @@ void GrooveBox::SerializeToSerial()
     // printf("completed send.\n");
 }
 
-bool deserialize_callback(pb_istream_t *stream, uint8_t *buf, size_t count)
-{
-    Serializer *s = (Serializer*) stream->state;
-    for (size_t i = 0; i < count; i++)
-    {
-        buf[i] = s->GetNextValue();
-    }
-    return true;
-}
-
 void GrooveBox::Deserialize()
 {
+    absolute_time_t loadStart = get_absolute_time();
     // setup our song data
     songData.InitDefaults();
+    songFile.Init(&songData, patterns);
+    lockCollector.Init(patterns);
     
-    // should probably put this is some different class
-    Serializer globalDataSerializer;
-    globalDataSerializer.Init(GLOBAL_DATA_FILEID);
+    globalDataFileId = GLOBAL_DATA_FILEID;
     // my first migration?
-    if(!globalDataSerializer.writeFile.initialized)
+    if(!DeserializeGlobalData())
     {
-        globalData.version = 1;
+        globalData.version = GLOBAL_DATA_VERSION;
         // erase all the old sample data that is living where the song data now lives
         for(int i=0;i<16;i++)
         {
@@ -1834,23 +2273,35 @@ void GrooveBox::Deserialize()
     }
 
     // because we don't have a "real" song id, we can just rely on the zero'd data - which stores the song id in position 0
-    Serializer s;
-    s.Init(globalData.songId);
-    pb_istream_t serializerStream = {&deserialize_callback, &s, SIZE_MAX};
-    songData.Deserialize(&serializerStream);
-
-    // load pattern data
-    for(int i=0;i<16;i++)
+    if(globalData.version < GLOBAL_DATA_VERSION)
     {
-        patterns[i].Deserialize(&serializerStream);
+        songFile.LoadLegacy(globalData.songId);
     }
-    VoiceData::DeserializeStatic(&serializerStream);
+    else
+    {
+        songFile.Load(globalData.songId, globalData.version >= 3);
+    }
+    // a full save that never got committed, or a reclaim that got cut off
+    songFile.Reclaim(globalData.songId ^ SONG_SLOT_FLAG);
+    songFile.Reclaim(globalDataFileId == GLOBAL_DATA_FILEID ? GLOBAL_DATA_FILEID_ALT : GLOBAL_DATA_FILEID);
+    // global data from before the song library only knows about the current song
+    if(globalData.songId&SONG_SLOT_FLAG)
+        globalData.songSlots |= 1<<GetCurrentSong();
+    else
+        globalData.songSlots &= ~(1<<GetCurrentSong());
     
     playingPattern = songData.GetPlayingPattern();
     songData.LoadPatternChain(patternChain);
     patternChainLength = songData.GetPatternChainLength();
-
-    printf("loaded filesize %i\n", s.writeFile.filesize);
+    // only what can play right away gets decoded now, UpdateLoad does the rest
+    songFile.LoadPattern(playingPattern);
+    for(int i=0;i<patternChainLength;i++)
+    {
+        songFile.LoadPattern(patternChain[i]);
+    }
+    printf("song load %lldus\n", absolute_time_diff_us(loadStart, get_absolute_time()));
+    // songs from older firmware can have lost locks
+    lockCollector.Begin(false);
 }
 
 bool deserialize_from_serial_callback(pb_istream_t *stream, uint8_t *buf, size_t count)
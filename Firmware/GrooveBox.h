@@ -20,23 +20,39 @@ extern "C" {
 #include "Reverb2.h"
 #include "Delay.h"
 #include "MidiParamMapper.h"
+#include "SongFile.h"
+#include "LockCollector.h"
+#include "ClockRecovery.h"
+#include "VoiceAllocator.h"
+#include "UiDisplayList.h"
 #include "GlobalData.pb.h"
 #include "USBSerialDevice.h"
 
 #define VOICE_COUNT 8
+// ~5 seconds at the 30hz display rate
+#define AUTOSAVE_FRAMES 150
+// songs live in file ids 0-15, see the FILELIST in GrooveBox.cc
+#define SONG_COUNT 16
 
 class GrooveBox {
  public:
   void init(uint32_t *_color);
   void OnKeyUpdate(uint key, bool pressed);
+  // passes the debounced key changes from the scanner to OnKeyUpdate
+  void HandleKeyEvents();
   bool GetTrigger(uint voice, uint step, uint8_t &note, uint8_t &key);
   void UpdateDisplay(ssd1306_t *p);
+  // sends what UpdateDisplay drew to the screen and the leds
+  void SendDisplay(ssd1306_t *p);
+  // auto shutdown, autosave and flash reclaim, once a display frame
+  void UpdateHousekeeping();
   void LowBatteryDisplay(ssd1306_t *p);
   void OnAdcUpdate(uint16_t a, uint16_t b);
   void SetGlobalParameter(uint8_t a, uint8_t b, bool setA, bool setB);
   bool IsPlaying();
   int GetNote();
   void OnMidiNote(int noteVal);
+  void OnMidiNoteOff(int noteVal);
   void OnMidiSync();
   void OnMidiStart();
   void OnMidiStop();
@@ -45,7 +61,15 @@ class GrooveBox {
   void Render(int16_t* output_buffer, int16_t* input_buffer, size_t size);
   uint8_t GetInstrumentParamA(int voice);
   uint8_t GetInstrumentParamB(int voice);
-  void Serialize();
+  // blocking, finishes any save that is running first
+  void Serialize(bool allowCompaction = true);
+  // starts a save that runs a step at a time from UpdateSave
+  void SerializeInBackground(bool allowCompaction);
+  // call between audio blocks, encodes one record or writes one page of a running save
+  void UpdateSave();
+  // switches to another song at the end of the pattern chain, or right away when stopped
+  void QueueSong(uint8_t song);
+  uint8_t GetCurrentSong();
   void Deserialize(); 
   void FinishRecording();
   int GetLostLockCount();
@@ -71,13 +95,17 @@ class GrooveBox {
     for (size_t i = 0; i < 17; i++)
     {
         patternStep[i] = 0;
-        beatCounter[i] = 0;
+        nextTrackTick[i] = tickCount;
         if(i<16)
           patternLoopCount[i] = 0;
     }
-    beatCounter[17] = 0;
-    // external sync counter
-    beatCounter[19] = 0;
+    nextTrackTick[17] = tickCount;
+    nextEventTick = tickCount;
+  }
+  // ticks since the track last stepped, 0 when it steps on the next pulse
+  uint8_t GetBeatCounter(uint8_t track)
+  {
+    return (trackPeriod[track]-(nextTrackTick[track]-tickCount))%trackPeriod[track];
   }
   void OnCCChanged(uint8_t cc, uint8_t newValue);
   static int getTickCountForRateIndex(int rate)
@@ -112,13 +140,27 @@ class GrooveBox {
     return 24;
   }
  private:
-  void LowBatteryDisplayInternal(ssd1306_t *p);
+  void LowBatteryDisplayInternal(UiDisplayList *ui);
+  void DrawDisplay(UiDisplayList *ui);
   void SaveAndShutdown();
+  void SerializeGlobalData();
+  void PrepareSerialize();
+  void CommitSongFile(uint16_t songFileId);
+  bool DeserializeGlobalData();
+  uint16_t GetSongFileId(uint8_t song);
+  bool SongSwitchReady();
+  void SwitchSong();
+  void ScanSongLibrary();
   USBSerialDevice *usbSerialDevice;
   MidiParamMapper midiMap;
-  int8_t needsInitialADC = 30; 
+  // the first pot reading is where they start, not a move
+  int8_t needsInitialADC = 1;
   void SerializeToSerial();
   void DeserializeFromSerial();
+  uint8_t GetPulseOffset(uint32_t lastTempoPhase);
+  uint32_t GetSyncPosition();
+  void HandleMidiEvents();
+  void UpdateMidiParams();
   void TriggerInstrument(uint8_t key, int16_t midi_note, uint8_t step, uint8_t pattern, bool livePlay, VoiceData &voiceData, int channel);
   void TriggerInstrumentMidi(int16_t midi_note, uint8_t step, uint8_t pattern, VoiceData &voiceData, int channel);
   void CalculateTempoIncrement();
@@ -126,7 +168,12 @@ class GrooveBox {
   void StartWaitingForSync();
   void ContinuePlaying();
   void StopPlaying();
-  void OnTempoPulse(bool advanceOnly = false);
+  void OnTempoPulse();
+  void SeekToTick(uint32_t tick);
+  uint8_t GetTrackPeriod(uint8_t track);
+  // call after a rate or sync mode changed, keeps every track where it is in its step
+  void RescheduleTracks();
+  void UpdateNextEventTick();
   uint GetRemainingRecordingBytes();
   uint8_t voiceCounter = 0;
   uint8_t instrumentParamA[8];
@@ -134,11 +181,28 @@ class GrooveBox {
   int needsNoteTrigger = -1;
   int drawY = 0;
   uint16_t drawCount = 0;
+  // a display frame from drawing to the screen and leds going out, us
+  uint32_t uiFrameTime = 0;
+  uint32_t uiFrameTimeMax = 0;
+  // time between the debouncer seeing a key and it getting handled, us
+  uint32_t keyLatency = 0;
+  uint32_t keyLatencyMax = 0;
   int lastNotePlayed = 60;
   uint8_t lastKeyPlayed = 0;
   bool paramSetA, paramSetB;
   uint32_t tempoPhaseIncrement = 0, tempoPhase = 0;
-  uint8_t beatCounter[20] = {0};
+  // sample in the current block of the pulse or midi event being handled, the triggers start there
+  uint8_t pulseOffset = 0;
+  // the sequencer tracks, the 16 voices and four extra counters
+  // 16: the pattern change counter
+  // 17: the pulse sync output counter
+  // 18: the midi sync
+  // 19: input pulse counter
+  // each one only gets looked at on the tick it steps, ticks in between only compare against nextEventTick
+  uint32_t tickCount = 0;
+  uint32_t nextTrackTick[20] = {0};
+  uint8_t trackPeriod[20] = {24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24};
+  uint32_t nextEventTick = 0;
   bool playing = false;
   bool waitingForSync = false;
   bool writing = false;
@@ -171,6 +235,7 @@ class GrooveBox {
   uint8_t patternLoopCount[16] = {0};
 
   uint32_t framesSinceLastTouch = 0;
+  uint32_t framesSinceLastSave = 0;
   // the page we are currently editing for each sound
   // clamped to the length of this pattern / sound
   uint8_t editPage[16] = {0};
@@ -191,14 +256,32 @@ class GrooveBox {
   uint16_t nextTrigger = 0;
   uint8_t lastAdcValA = 0;
   uint8_t lastAdcValB = 0;
-  uint16_t AdcInterpolatedA = 0;
-  uint16_t AdcInterpolatedB = 0;
   Delay delay;
   Reverb2 verb;
   ffs_file files[16];
   int64_t renderTime = 0;
   int64_t sampleCount = 0;
   GlobalData globalData = GlobalData_init_zero;
+  SongFile songFile;
+  // puts lost param locks back in the pool between audio blocks
+  LockCollector lockCollector;
+  ClockRecovery clockSync;
+  VoiceAllocator voiceAllocator;
+  // samples rendered, the time base for the external clock
+  uint32_t sampleClock = 0;
+  // samples between an event coming in and being played, see HandleMidiEvents
+  int32_t midiLatency = 0;
+  // the sample the midi event being handled came in on
+  uint32_t midiEventTime = 0;
+  // global data is a log split over two files, this is the one being appended to
+  uint16_t globalDataFileId;
+  // the song that plays next, -1 if none
+  int8_t queuedSong = -1;
+  // set by the sequencer at the end of the chain, it holds there until UpdateSave switches songs
+  bool songSwitchDue = false;
+  // bit n is set when song n has a file
+  uint16_t songLibrary = 0;
+  bool songLibraryScanned = false;
 };
 
 extern GrooveBox *groovebox; // used for the midi callbacks
@@ -82,10 +82,23 @@ q15_t Instrument::GetLfoState()
     return mult_q15(Interpolate824(wav_sine, lfo_phase), lfo_depth);
 }
 void __not_in_flash_func(Instrument::Render)(const uint8_t* sync, int16_t* buffer, size_t size)
+{
+    if(!hasPendingNoteOn)
+    {
+        RenderSegment(sync, buffer, size);
+        return;
+    }
+    // the old note plays up to the trigger, the new one starts on its own sample
+    size_t split = pendingNoteOn.offset;
+    RenderSegment(sync, buffer, split);
+    ApplyPendingNoteOn();
+    RenderSegment(sync+split, buffer+split, size-split);
+}
+void __not_in_flash_func(Instrument::RenderSegment)(const uint8_t* sync, int16_t* buffer, size_t size)
 {
     if(instrumentType == INSTRUMENT_MIDI)
     {
-        for(int i=0;i<SAMPLES_PER_BLOCK;i++)
+        for(int i=0;i<size;i++)
         {
             noteOffSchedule--;
             if(noteOffSchedule == 0)
@@ -135,6 +148,9 @@ void __not_in_flash_func(Instrument::Render)(const uint8_t* sync, int16_t* buffe
     lfoPhaseIncrement = lfoPhaseIncrement + (lfoPhaseIncrement>>1);
     lfoPhaseIncrement = lfoPhaseIncrement/((lfo_rate>>4)+2);
     //int32_t phaseOff = ((uint32_t)(0xffff-Interpolate824(lut_env_expo, (0x7fff-lfo_rate)<<16))<<13)-0x7fffff; 
+    // split blocks advance the lfo by their share of the block
+    if(size != SAMPLES_PER_BLOCK)
+        lfoPhaseIncrement = lfoPhaseIncrement/SAMPLES_PER_BLOCK*size;
     lfo_phase += lfoPhaseIncrement;//((0xffff-Interpolate824(lut_env_expo, (0x7fff-lfo_rate)<<16))<<13)-0x7ffff; //((lfo_rate*(0xabf0000-0xfffff))>>4)+0xfffff;
 
     for (size_t i = 0; i < 2; i++)
@@ -187,7 +203,7 @@ void __not_in_flash_func(Instrument::Render)(const uint8_t* sync, int16_t* buffe
         uint32_t filesize = ffs_file_size(GetFilesystem(), file);
         if(!file || filesize == 0 || sampleSegment == SMP_COMPLETE)
         {
-            memset(buffer, 0, SAMPLES_PER_BLOCK*2);
+            memset(buffer, 0, size*2);
             return;
         }
         // double check the file length
@@ -195,7 +211,7 @@ void __not_in_flash_func(Instrument::Render)(const uint8_t* sync, int16_t* buffe
             sampleSegment = SMP_COMPLETE;
         if(sampleSegment == SMP_COMPLETE)
         {
-            for(int i=0;i<SAMPLES_PER_BLOCK;i++)
+            for(int i=0;i<size;i++)
             {
                 buffer[i] = 0;
             }
@@ -212,7 +228,7 @@ void __not_in_flash_func(Instrument::Render)(const uint8_t* sync, int16_t* buffe
         // uint16_t readAmount = (sampleOffset*2+2*128*5)>filesize?filesize-sampleOffset*2:2*128*5;
         // ffs_read(GetFilesystem(), file, wave, readAmount);
         uint32_t startingSampleOffset = sampleOffset;
-        for(int i=0;i<SAMPLES_PER_BLOCK;i++)
+        for(int i=0;i<size;i++)
         {
             if(sampleOffset > sampleEnd - 1)
             {
@@ -256,13 +272,13 @@ void __not_in_flash_func(Instrument::Render)(const uint8_t* sync, int16_t* buffe
         osc.set_pitch(pitchWithMods);
         osc.set_parameter_1(param1_withMods);
         osc.set_parameter_2(param2_withMods);
-        osc.Render(sync, buffer, SAMPLES_PER_BLOCK);
+        osc.Render(sync, buffer, size);
     }
     RenderGlobal(sync, buffer, size);
 }
 void Instrument::RenderGlobal(const uint8_t* sync, int16_t* buffer, size_t size)
 {
-    for(int i=0;i<SAMPLES_PER_BLOCK;i++)
+    for(int i=0;i<size;i++)
     {
         lastenv2val = env2.Render();
         lastenvval = env.Render();
@@ -284,8 +300,21 @@ void Instrument::RenderGlobal(const uint8_t* sync, int16_t* buffer, size_t size)
         buffer[i] = mult_q15(buffer[i], volume);
     }
 }
+void Instrument::NoteOff()
+{
+    // the envelopes don't sustain, so only a note still in its attack has anything to release
+    // a note that hasn't started yet plays out its attack, it would be silent otherwise
+    if(hasPendingNoteOn)
+        return;
+    if(env.segment() == ADSR_ENV_SEGMENT_ATTACK)
+        env.Release();
+    if(env2.segment() == ADSR_ENV_SEGMENT_ATTACK)
+        env2.Release();
+}
 bool Instrument::IsPlaying()
 {
+    if(hasPendingNoteOn)
+        return true;
     if(env.segment() == ADSR_ENV_SEGMENT_DEAD)
         return false;
     if(instrumentType == INSTRUMENT_SAMPLE && sampleSegment == SMP_COMPLETE)
@@ -300,18 +329,24 @@ void Instrument::SetOscillator(uint8_t oscillator)
 
 void Instrument::UpdateVoiceData(VoiceData &voiceData)
 {
-    lfo1Target = (LfoTargets)((((uint16_t)voiceData.GetParamValue(Lfo1Target, lastPressedKey, playingStep, playingPattern))*Lfo_Target_Count)>>8);
+    voiceData.ResolveParams(playingStep, playingPattern, params);
+    ApplyParams(voiceData);
+}
 
-    delaySend = voiceData.GetParamValue(DelaySend, lastPressedKey, playingStep, playingPattern);
-    reverbSend = voiceData.GetParamValue(ReverbSend, lastPressedKey, playingStep, playingPattern);
-    volume = ((q15_t)voiceData.GetParamValue(Volume, lastPressedKey, playingStep, playingPattern))<<7;
-    panning = ((q15_t)voiceData.GetParamValue(Pan, lastPressedKey, playingStep, playingPattern))<<7;
-    portamentoParamAmt = voiceData.GetParamValue(Portamento, lastPressedKey, playingStep, playingPattern);
-    fineTuneParamAmt = voiceData.GetParamValue(FineTune, lastPressedKey, playingStep, playingPattern);
-    q15_t env1A = voiceData.GetParamValue(AttackTime, lastPressedKey, playingStep, playingPattern)<<7;
-    q15_t env1D = voiceData.GetParamValue(DecayTime, lastPressedKey, playingStep, playingPattern)<<7;
-    q15_t env2A = voiceData.GetParamValue(AttackTime2, lastPressedKey, playingStep, playingPattern)<<7;
-    q15_t env2D = voiceData.GetParamValue(DecayTime2, lastPressedKey, playingStep, playingPattern)<<7;
+void Instrument::ApplyParams(VoiceData &voiceData)
+{
+    lfo1Target = (LfoTargets)((((uint16_t)params.values[Lfo1Target])*Lfo_Target_Count)>>8);
+
+    delaySend = params.values[DelaySend];
+    reverbSend = params.values[ReverbSend];
+    volume = ((q15_t)params.values[Volume])<<7;
+    panning = ((q15_t)params.values[Pan])<<7;
+    portamentoParamAmt = params.values[Portamento];
+    fineTuneParamAmt = params.values[FineTune];
+    q15_t env1A = params.values[AttackTime]<<7;
+    q15_t env1D = params.values[DecayTime]<<7;
+    q15_t env2A = params.values[AttackTime2]<<7;
+    q15_t env2D = params.values[DecayTime2]<<7;
     q15_t lfoState = GetLfoState();
     switch(lfo1Target)
     {
@@ -346,22 +381,23 @@ void Instrument::UpdateVoiceData(VoiceData &voiceData)
     {
         env.Update(env1A>>8, env1D>>8);
         env2.Update(env2A>>8, env2D>>8);
-        lfo_depth = (voiceData.GetParamValue(LFODepth, lastPressedKey, playingStep, playingPattern)>>1)<<7;
-        lfo_rate = (voiceData.GetParamValue(LFORate, lastPressedKey, playingStep, playingPattern)>>1)<<7;
-        mainCutoff = (voiceData.GetParamValue(Cutoff, lastPressedKey, playingStep, playingPattern)>>1) << 7;
+        lfo_depth = (params.values[LFODepth]>>1)<<7;
+        lfo_rate = (params.values[LFORate]>>1)<<7;
+        // all 8 bits, so a 14 bit cc sweep gets the in between steps
+        mainCutoff = params.values[Cutoff] << 6;
         svf.set_frequency(add_q15(mainCutoff, lastenv2val>>1));
-        svf.set_resonance((voiceData.GetParamValue(Resonance, lastPressedKey, playingStep, playingPattern)>>1) << 7);
-        env1Target = (EnvTargets)((((uint16_t)voiceData.GetParamValue(Env1Target, lastPressedKey, playingStep, playingPattern))*Target_Count)>>8);
-        env1Depth = (voiceData.GetParamValue(Env1Depth, lastPressedKey, playingStep, playingPattern))<<7;
-        env2Target = (EnvTargets)((((uint16_t)voiceData.GetParamValue(Env2Target, lastPressedKey, playingStep, playingPattern))*Target_Count)>>8);
-        env2Depth = (voiceData.GetParamValue(Env2Depth, lastPressedKey, playingStep, playingPattern))<<7;
-        distortionAmount = (voiceData.GetParamValue(DelaySend, lastPressedKey, playingStep, playingPattern))<<7;
+        svf.set_resonance(params.values[Resonance] << 6);
+        env1Target = (EnvTargets)((((uint16_t)params.values[Env1Target])*Target_Count)>>8);
+        env1Depth = (params.values[Env1Depth])<<7;
+        env2Target = (EnvTargets)((((uint16_t)params.values[Env2Target])*Target_Count)>>8);
+        env2Depth = (params.values[Env2Depth])<<7;
+        distortionAmount = (params.values[DelaySend])<<7;
     }
     if(voiceData.GetInstrumentType() == INSTRUMENT_MACRO)
     {
         // copy parameters from voice
-        param1Base = voiceData.GetParamValue(Timbre, lastPressedKey, playingStep, playingPattern) << 7;
-        param2Base = voiceData.GetParamValue(Color, lastPressedKey, playingStep, playingPattern) << 7;
+        param1Base = params.values[Timbre] << 7;
+        param2Base = params.values[Color] << 7;
     }
 }
 
@@ -384,7 +420,7 @@ void __not_in_flash_func(Instrument::TempoPulse)(VoiceData &voiceData)
     if(retriggerNextPulse == 0)
     {
         retriggersRemaining--;
-        retriggerNextPulse = playingVoice->GetParamValue(RetriggerSpeed, lastPressedKey, playingStep, playingPattern);
+        retriggerNextPulse = params.values[RetriggerSpeed];
         retriggerNextPulse = (((uint16_t)retriggerNextPulse*8)>>8) * 4;
         Retrigger();
     }
@@ -416,7 +452,35 @@ void __not_in_flash_func(Instrument::Retrigger)()
     }
 }
 
-void __not_in_flash_func(Instrument::NoteOn)(uint8_t key, int16_t midinote, uint8_t step, uint8_t pattern, bool livePlay, VoiceData &voiceData)
+void __not_in_flash_func(Instrument::NoteOn)(uint8_t key, int16_t midinote, uint8_t step, uint8_t pattern, bool livePlay, VoiceData &voiceData, uint8_t offset)
+{
+    // a note still waiting on its offset is earlier than this one
+    ApplyPendingNoteOn();
+    // some of the braids shapes render two samples at a time, so blocks only split on even samples
+    offset &= ~1;
+    // midi goes out right away, only the audio can start part way through a block
+    if(offset == 0 || offset >= SAMPLES_PER_BLOCK || voiceData.GetInstrumentType() == INSTRUMENT_MIDI)
+    {
+        StartNote(key, midinote, step, pattern, livePlay, voiceData);
+        return;
+    }
+    pendingNoteOn.voiceData = &voiceData;
+    pendingNoteOn.midinote = midinote;
+    pendingNoteOn.key = key;
+    pendingNoteOn.step = step;
+    pendingNoteOn.pattern = pattern;
+    pendingNoteOn.offset = offset;
+    pendingNoteOn.livePlay = livePlay;
+    hasPendingNoteOn = true;
+}
+void __not_in_flash_func(Instrument::ApplyPendingNoteOn)()
+{
+    if(!hasPendingNoteOn)
+        return;
+    hasPendingNoteOn = false;
+    StartNote(pendingNoteOn.key, pendingNoteOn.midinote, pendingNoteOn.step, pendingNoteOn.pattern, pendingNoteOn.livePlay, *pendingNoteOn.voiceData);
+}
+void __not_in_flash_func(Instrument::StartNote)(uint8_t key, int16_t midinote, uint8_t step, uint8_t pattern, bool livePlay, VoiceData &voiceData)
 {
     if(livePlay)
     {
@@ -425,15 +489,16 @@ void __not_in_flash_func(Instrument::NoteOn)(uint8_t key, int16_t midinote, uint
     playingStep = step;
     playingPattern = pattern;
     playingVoice = &voiceData;
+    voiceData.ResolveParams(step, pattern, params);
     int note = midinote;
     if(!livePlay)
     {
-        retriggersRemaining = voiceData.GetParamValue(RetriggerLength, lastPressedKey, playingStep, playingPattern);
-        retriggerNextPulse = voiceData.GetParamValue(RetriggerSpeed, lastPressedKey, playingStep, playingPattern);
+        retriggersRemaining = params.values[RetriggerLength];
+        retriggerNextPulse = params.values[RetriggerSpeed];
         retriggersRemaining = ((uint16_t)retriggersRemaining*8)>>8;
         retriggerNextPulse = (((uint16_t)retriggerNextPulse*8)>>8) * 4;
 
-        int16_t fade = voiceData.GetParamValue(RetriggerFade, lastPressedKey, playingStep, playingPattern) << 7;
+        int16_t fade = params.values[RetriggerFade] << 7;
         fade = (fade-0x3fff)*-2; // center at zero
         
         // lets just fade out all the retriggers - so the retrigger volume multiplier starts at full, and fades down
@@ -456,7 +521,7 @@ void __not_in_flash_func(Instrument::NoteOn)(uint8_t key, int16_t midinote, uint
     if(voiceData.GetInstrumentType() == INSTRUMENT_SAMPLE)
     {
         microFade = 0;
-        UpdateVoiceData(voiceData);
+        ApplyParams(voiceData);
         playingSlice = key;
         file = voiceData.GetFile();
         instrumentType = voiceData.GetInstrumentType();
@@ -523,7 +588,7 @@ void __not_in_flash_func(Instrument::NoteOn)(uint8_t key, int16_t midinote, uint
     if(voiceData.GetInstrumentType() == INSTRUMENT_MACRO)
     {
         // copy parameters from voice
-        UpdateVoiceData(voiceData);
+        ApplyParams(voiceData);
         // only set shape on initial trigger
         osc.set_shape(voiceData.GetShape());
         enable_env = true;
@@ -541,12 +606,11 @@ void __not_in_flash_func(Instrument::NoteOn)(uint8_t key, int16_t midinote, uint
     else if(voiceData.GetInstrumentType() == INSTRUMENT_MIDI)
     {
         
-        uint8_t noteHoldTime = (voiceData.GetParamValue(MidiHold, lastPressedKey, playingStep, playingPattern)>>4)+1;
+        uint8_t noteHoldTime = (params.values[MidiHold]>>4)+1;
 
         noteHoldTime *= GrooveBox::getTickCountForRateIndex((voiceData.GetRateForPattern(playingPattern)*7)>>8);
 
         // determine if this note is already playing
-        voiceData.GetParamValue(Timbre, lastPressedKey, playingStep, playingPattern)>>1;
         bool noteIsPlaying = false;
         for(int i=0;i<16;i++)
         {
@@ -571,7 +635,7 @@ void __not_in_flash_func(Instrument::NoteOn)(uint8_t key, int16_t midinote, uint
                 if(midiNoteStates[i].note < 0)
                 {
                     // found a channel that is no longer playing, we can use this one to trigger
-                    midi->NoteOn(voiceData.GetMidiChannel(), note-12, voiceData.GetParamValue(Timbre, lastPressedKey, playingStep, playingPattern)>>1);
+                    midi->NoteOn(voiceData.GetMidiChannel(), note-12, params.values[Timbre]>>1);
                     midiNoteStates[i].note = note;
                     midiNoteStates[i].ticksRemaining = noteHoldTime;
                     triggered = true;
@@ -582,7 +646,7 @@ void __not_in_flash_func(Instrument::NoteOn)(uint8_t key, int16_t midinote, uint
             {
                 // need to steal a channel
                 midi->NoteOff(voiceData.GetMidiChannel(), midiNoteStates[lowestTimeIdx].note-12);
-                midi->NoteOn(voiceData.GetMidiChannel(), note-12, voiceData.GetParamValue(Timbre, lastPressedKey, playingStep, playingPattern)>>1);
+                midi->NoteOn(voiceData.GetMidiChannel(), note-12, params.values[Timbre]>>1);
                 midiNoteStates[lowestTimeIdx].note = note;
                 midiNoteStates[lowestTimeIdx].ticksRemaining = noteHoldTime;
             }
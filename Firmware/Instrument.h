@@ -42,7 +42,10 @@ class Instrument
         void Render(const uint8_t* sync,int16_t* buffer,size_t size);
         void RenderGlobal(const uint8_t* sync,int16_t* buffer,size_t size);
         void SetParameter(uint8_t param, uint8_t value);
-        void NoteOn(uint8_t key, int16_t midinote, uint8_t step, uint8_t pattern, bool livePlay, VoiceData &voiceData);
+        // offset is the sample in the next rendered block where the note starts
+        void NoteOn(uint8_t key, int16_t midinote, uint8_t step, uint8_t pattern, bool livePlay, VoiceData &voiceData, uint8_t offset = 0);
+        // the key was let go of
+        void NoteOff();
         void SetAHD(uint32_t attackTime, uint32_t holdTime, uint32_t decayTime);
         bool IsPlaying();
         void UpdateVoiceData(VoiceData &voiceData);
@@ -66,7 +69,26 @@ class Instrument
         q15_t pWithMods;
 
     private:
+        void RenderSegment(const uint8_t* sync,int16_t* buffer,size_t size);
+        void StartNote(uint8_t key, int16_t midinote, uint8_t step, uint8_t pattern, bool livePlay, VoiceData &voiceData);
+        void ApplyPendingNoteOn();
+        // a note on that lands inside the next block, the block is split there
+        struct PendingNoteOn
+        {
+          VoiceData *voiceData;
+          int16_t midinote;
+          uint8_t key;
+          uint8_t step;
+          uint8_t pattern;
+          uint8_t offset;
+          bool livePlay;
+        };
+        PendingNoteOn pendingNoteOn;
+        bool hasPendingNoteOn = false;
         VoiceData *playingVoice;
+        // the parameters of the step that is playing, resolved once per trigger
+        ParamVector params;
+        void ApplyParams(VoiceData &voiceData);
         void Retrigger();
         q15_t GetLfoState();
         // lets hardcode some retriggers here
@@ -0,0 +1,105 @@
+#include "LockCollector.h"
+
+void LockCollector::Init(VoiceData *_voices)
+{
+    voices = _voices;
+    state = LockCollectIdle;
+}
+
+void LockCollector::Begin(bool allowCompaction)
+{
+    compact = allowCompaction;
+    nextVoice = 0;
+    VoiceData::lockPool.BeginMarking();
+    state = LockCollectMarking;
+}
+
+bool LockCollector::IsCollecting()
+{
+    return state != LockCollectIdle;
+}
+
+bool LockCollector::Update()
+{
+    ParamLockPool &pool = VoiceData::lockPool;
+    if(state == LockCollectIdle)
+        return false;
+    // loading a song resets the pool, the marks are gone with it
+    if(!pool.IsMarking())
+    {
+        state = LockCollectIdle;
+        return false;
+    }
+    switch(state)
+    {
+        case LockCollectMarking:
+            for(int p=0;p<16;p++)
+            {
+                pool.MarkList(voices[nextVoice].locksForPattern[p]);
+            }
+            if(++nextVoice == 16)
+                state = LockCollectSweeping;
+            return true;
+        case LockCollectSweeping:
+            recovered = pool.Sweep();
+            moved = 0;
+            if(compact && pool.CountHoles() > LOCK_COMPACT_HOLES)
+            {
+                state = LockCollectCompacting;
+                return true;
+            }
+            break;
+        case LockCollectCompacting:
+            Compact();
+            break;
+        default:
+            break;
+    }
+    pool.EndMarking();
+    state = LockCollectIdle;
+    if(recovered || moved)
+        printf("lock collection recovered %i moved %i\n", recovered, moved);
+    return false;
+}
+
+void LockCollector::Compact()
+{
+    ParamLockPool &pool = VoiceData::lockPool;
+    // has to happen in one go, the old positions are only valid until FinishCompact
+    moved = pool.Compact();
+    for(int v=0;v<16;v++)
+    {
+        for(int p=0;p<16;p++)
+        {
+            uint16_t head = pool.Forward(voices[v].locksForPattern[p]);
+            if(head != voices[v].locksForPattern[p])
+            {
+                voices[v].MarkDirty();
+                voices[v].locksForPattern[p] = head;
+            }
+        }
+    }
+    pool.FinishCompact();
+    for(int v=0;v<16;v++)
+    {
+        voices[v].RebuildLockIndex();
+    }
+}
+
+uint16_t LockCollector::CountLost()
+{
+    ParamLockPool &pool = VoiceData::lockPool;
+    // this uses the same marks, so it cancels a collection that is running
+    state = LockCollectIdle;
+    pool.BeginMarking();
+    for(int v=0;v<16;v++)
+    {
+        for(int p=0;p<16;p++)
+        {
+            pool.MarkList(voices[v].locksForPattern[p]);
+        }
+    }
+    uint16_t lost = pool.CountLost();
+    pool.EndMarking();
+    return lost;
+}
@@ -0,0 +1,61 @@
+#ifndef LOCK_COLLECTOR_H_
+#define LOCK_COLLECTOR_H_
+
+#include <stdio.h>
+#include "ParamLockPool.h"
+#include "voice_data.h"
+
+/*
+
+lock collection
+---------------
+locks that aren't on any pattern list or the free list are lost until the pool
+is reset. the collector finds them with one pass over the lists instead of
+searching the lists for every lock.
+
+Update marks the lists of one voice per call, so it can run between audio
+blocks like the song saves. the next call sweeps, every unmarked lock goes back
+on the free list in order. the pool keeps the marks right for locks that get
+handed out or returned in between.
+
+with compaction allowed, a pool with more than LOCK_COMPACT_HOLES holes below its
+last live lock gets its live locks moved down to the start, so the pool stays
+dense and new locks come from the same few save records.
+
+*/
+
+// free locks below the last live lock before a collection compacts the pool
+#define LOCK_COMPACT_HOLES (LOCKCOUNT/16)
+
+enum LockCollectState
+{
+    LockCollectIdle,
+    LockCollectMarking,
+    LockCollectSweeping,
+    LockCollectCompacting,
+};
+
+class LockCollector
+{
+    public:
+        void Init(VoiceData *_voices);
+        void Begin(bool allowCompaction);
+        // does one step, returns true while there is work left
+        bool Update();
+        bool IsCollecting();
+        // blocking, finds the lost locks without changing the pool
+        uint16_t CountLost();
+        // results of the last collection
+        uint16_t GetRecovered() { return recovered; }
+        uint16_t GetMoved() { return moved; }
+    private:
+        void Compact();
+        VoiceData *voices;
+        LockCollectState state = LockCollectIdle;
+        bool compact;
+        uint8_t nextVoice;
+        uint16_t recovered = 0;
+        uint16_t moved = 0;
+};
+
+#endif // LOCK_COLLECTOR_H_
@@ -1,6 +1,7 @@
 #include "midi.h"
 #include "hardware/irq.h"
 #include "hardware/dma.h"
+#include "hardware/sync.h"
 #include <stdio.h>
 #include <string.h>
 #include "tusb.h"
@@ -21,85 +22,231 @@ void midi_task(void)
   // The MIDI interface always creates input and output port/jack descriptors
   // regardless of these being used or not. Therefore incoming traffic should be read
   // (possibly just discarded) to avoid the sender blocking in IO
-  uint8_t c[1];
-  while ( tud_midi_available() )
-  {
-    tud_midi_stream_read(c, 1);
-    midi->ProcessMessage(*c, 1);
-  }
+  midi->ReadUsb();
 }
 
 
 void on_uart_rx() {
-    while (uart_is_readable(UART_ID)) {
-        midi->ProcessMessage(uart_getc(UART_ID), 0);
+    uint8_t data[32];
+    uint16_t length = 0;
+    while (uart_is_readable(UART_ID) && length < sizeof(data)) {
+        data[length++] = uart_getc(UART_ID);
     }
+    midi->ProcessMessages(data, length, 0);
 }
 
-void Midi::ProcessMessage(char c, uint8_t processor)
+// data bytes that follow a status byte, the ones with none also stop any data being read (sysex)
+static int8_t DataLength(uint8_t status)
 {
-    if(processor > 1) return;
-    if((c & 0x80) > 0)
+    switch(status & 0xf0)
     {
-        // clear the data buffer
-        inputProcessors[processor].dataByteCounter = 0;
-        inputProcessors[processor].lastCommand = c;
+        case 0xc0:
+        case 0xd0:
+            return 1;
+        case 0xf0:
+            break;
+        default:
+            return 2;
+    }
+    switch(status)
+    {
+        case 0xf1:
+        case 0xf3:
+            return 1;
+        case 0xf2:
+            return 2;
     }
-    else if(inputProcessors[processor].dataByteCounter < 4)
+    return 0;
+}
+
+// the messages that make it into the event queues
+static bool IsHandled(uint8_t status)
+{
+    uint8_t type = status & 0xf0;
+    return type == 0x80 || type == 0x90 || type == 0xb0 || status == 0xf2
+        || status == 0xf8 || status == 0xfa || status == 0xfb || status == 0xfc;
+}
+
+void Midi::ProcessMessage(char c, uint8_t processor)
+{
+    if(processor > 1) return;
+    InputProcessor &input = inputProcessors[processor];
+    uint8_t byte = c;
+    // realtime messages can come in the middle of other messages and don't change the running status
+    if(byte >= 0xf8)
     {
-        inputProcessors[processor].dataBuffer[inputProcessors[processor].dataByteCounter++] = c&0x7f;
+        if(IsHandled(byte))
+            PushEvent(processor, byte, 0, 0);
+        return;
     }
-    if(c == 0xf8 && OnSync != NULL)
+    if((byte & 0x80) > 0)
     {
-        OnSync();
+        // clear the data buffer
+        input.lastCommand = byte;
+        input.dataByteCounter = DataLength(byte) > 0 ? 0 : -1;
+        return;
     }
-    if(c == 0xfa && OnStart != NULL)
+    if(input.dataByteCounter < 0)
+        return;
+    input.dataBuffer[input.dataByteCounter++] = byte;
+    if(input.dataByteCounter < DataLength(input.lastCommand))
+        return;
+    // running status, the next data bytes are another message of the same kind
+    input.dataByteCounter = 0;
+    if(IsHandled(input.lastCommand))
+        PushEvent(processor, input.lastCommand, input.dataBuffer[0], input.dataBuffer[1]);
+    // system common messages don't have a running status
+    if((input.lastCommand & 0xf0) == 0xf0)
+        input.dataByteCounter = -1;
+}
+
+void __not_in_flash_func(Midi::ProcessMessages)(const uint8_t* data, uint16_t length, uint8_t processor)
+{
+    for(uint16_t i=0;i<length;i++)
+        ProcessMessage(data[i], processor);
+}
+
+void Midi::ProcessPacket(const uint8_t packet[4])
+{
+    uint8_t status = packet[1];
+    switch(packet[0] & 0x0f)
     {
-        OnStart();
+        case 0x2: // two byte system common
+        case 0x3: // three byte system common
+        case 0x5: // single byte system common
+        case 0xf: // single byte, realtime
+        case 0x8: case 0x9: case 0xa: case 0xb: case 0xc: case 0xd: case 0xe: // channel messages
+            if(IsHandled(status))
+                PushEvent(1, status, packet[2], packet[3]);
+            break;
+        default: // sysex and reserved codes
+            break;
     }
-    if(c == 0xfb && OnContinue != NULL)
+}
+
+uint8_t Midi::EventQueueFree(uint8_t processor)
+{
+    MidiEventQueue &queue = inputQueues[processor];
+    return MIDI_EVENT_QUEUE_LENGTH - (uint8_t)(queue.head-queue.tail);
+}
+
+void Midi::ReadUsb()
+{
+    uint8_t packet[4];
+    uint16_t count = 0;
+    // packets left in the usb fifo aren't lost, the host just waits, so stop when the queue is full
+    while(count < MIDI_USB_PACKETS_PER_TASK && EventQueueFree(1) > 0 && tud_midi_packet_read(packet))
     {
-        OnContinue();
+        ProcessPacket(packet);
+        count++;
     }
-    if(c == 0xfc && OnStop != NULL)
+    if(count == 0)
+        return;
+    usbStats.packets += count;
+    usbStats.reads++;
+    if(count > usbStats.mostPerRead)
+        usbStats.mostPerRead = count;
+    if(tud_midi_available())
+        usbStats.limitedReads++;
+}
+
+void __not_in_flash_func(Midi::PushEvent)(uint8_t processor, uint8_t status, uint8_t data0, uint8_t data1)
+{
+    MidiEventQueue &queue = inputQueues[processor];
+    uint8_t head = queue.head;
+    // full, the consumer is stuck, drop it rather than block an interrupt
+    if((uint8_t)(head-queue.tail) >= MIDI_EVENT_QUEUE_LENGTH)
+        return;
+    MidiEvent &event = queue.events[head&(MIDI_EVENT_QUEUE_LENGTH-1)];
+    event.time = time_us_32();
+    event.status = status;
+    event.data[0] = data0;
+    event.data[1] = data1;
+    // the event has to be written before the consumer can see it
+    __dmb();
+    queue.head = head+1;
+}
+
+bool Midi::PeekEvent(MidiEvent &event)
+{
+    // the oldest event of either input
+    bool found = false;
+    for(int i=0;i<2;i++)
     {
-        OnStop();
+        MidiEventQueue &queue = inputQueues[i];
+        if(queue.head == queue.tail)
+            continue;
+        __dmb();
+        MidiEvent &next = queue.events[queue.tail&(MIDI_EVENT_QUEUE_LENGTH-1)];
+        if(!found || (int32_t)(next.time-event.time) < 0)
+        {
+            event = next;
+            peekedQueue = i;
+            found = true;
+        }
     }
-    if(inputProcessors[processor].lastCommand == 0xf2 && inputProcessors[processor].dataByteCounter == 2 && OnPosition != NULL) // song position pointer
+    return found;
+}
+
+void Midi::PopEvent()
+{
+    MidiEventQueue &queue = inputQueues[peekedQueue];
+    // done reading the event before the producer can reuse it
+    __dmb();
+    queue.tail = queue.tail+1;
+}
+
+void Midi::Dispatch(const MidiEvent &event)
+{
+    switch(event.status)
     {
-        OnPosition(inputProcessors[processor].dataBuffer[0] + inputProcessors[processor].dataBuffer[1]);
+        case 0xf8:
+            if(OnSync != NULL)
+                OnSync();
+            return;
+        case 0xfa:
+            if(OnStart != NULL)
+                OnStart();
+            return;
+        case 0xfb:
+            if(OnContinue != NULL)
+                OnContinue();
+            return;
+        case 0xfc:
+            if(OnStop != NULL)
+                OnStop();
+            return;
+        case 0xf2: // song position pointer, 14 bits in 16th notes
+            if(OnPosition != NULL)
+                OnPosition(event.data[0]|(event.data[1]<<7));
+            return;
     }
-    // not a system common message (transport / tick)
-    if(inputProcessors[processor].lastCommand & (0xf0 == 0))
+    uint8_t channel = event.status & 0xf;
+    switch(event.status & 0xf0)
     {
-        uint8_t channel = inputProcessors[processor].lastCommand & 0xf;
-        // note on
-        if(inputProcessors[processor].lastCommand & 0x90 > 0 && inputProcessors[processor].dataByteCounter == 2)
-        {
-            // actually a note off
-            if(inputProcessors[processor].dataBuffer[1] == 0 && OnNoteOff != NULL)
+        case 0x90:
+            // velocity 0 is actually a note off
+            if(event.data[1] > 0)
             {
-                OnNoteOff(channel, inputProcessors[processor].dataBuffer[0], inputProcessors[processor].dataBuffer[1]);
+                if(OnNoteOn != NULL)
+                    OnNoteOn(channel, event.data[0], event.data[1]);
+                return;
             }
-            else if(OnNoteOn != NULL)
+            // fall through
+        case 0x80:
+            if(OnNoteOff != NULL)
+                OnNoteOff(channel, event.data[0], event.data[1]);
+            return;
+        case 0xb0:
+            // filter out repeated cc changes, except the 14 bit pairs and nrpns, those repeat when the other half changes
+            if(event.data[0] < 64 || (event.data[0] >= 98 && event.data[0] <= 101))
+                lastCCValue[event.data[0]] = 0xff;
+            if(OnCCChanged != NULL && (lastCCValue[event.data[0]] == 0xff || lastCCValue[event.data[0]] != event.data[1]))
             {
-                OnNoteOn(channel, inputProcessors[processor].dataBuffer[0], inputProcessors[processor].dataBuffer[1]);
+                OnCCChanged(event.data[0], event.data[1]);
+                lastCCValue[event.data[0]] = event.data[1];
             }
-        }
-        if((inputProcessors[processor].lastCommand & 0x80) > 0 && inputProcessors[processor].dataByteCounter == 2 && OnNoteOff != NULL)
-        {
-            OnNoteOff(channel, inputProcessors[processor].dataBuffer[0], inputProcessors[processor].dataBuffer[1]);
-        }
-        // control change
-        if((inputProcessors[processor].lastCommand & 0xb0) > 0 && inputProcessors[processor].dataByteCounter == 2 && OnCCChanged != NULL)
-        {
-            // filter out repeated cc changes
-            if(lastCCValue[inputProcessors[processor].dataBuffer[0]] == 0xff || lastCCValue[inputProcessors[processor].dataBuffer[0]] != inputProcessors[processor].dataBuffer[1])
-            {
-                OnCCChanged(inputProcessors[processor].dataBuffer[0], inputProcessors[processor].dataBuffer[1]);
-                lastCCValue[inputProcessors[processor].dataBuffer[0]] = inputProcessors[processor].dataBuffer[1];
-            }
-        }
+            return;
     }
 }
 
@@ -125,7 +272,9 @@ void Midi::Init()
 
     // Now enable the UART to send interrupts - RX only
     uart_set_irq_enables(UART_ID, true, false);
-    TxIndex = 0;
+    txWrite = txSent = txSending = 0;
+    txRunningStatus = 0;
+    outLength = 0;
     //
     DmaChannelTX = dma_claim_unused_channel(true);
 
@@ -133,7 +282,7 @@ void Midi::Init()
     channel_config_set_transfer_data_size(&txConfig, DMA_SIZE_8);
     channel_config_set_read_increment(&txConfig, true);
     channel_config_set_write_increment(&txConfig, false);
-    channel_config_set_ring(&txConfig, false, MIDI_BUF_LENGTH_POW);
+    channel_config_set_ring(&txConfig, false, MIDI_TX_RING_POW);
     channel_config_set_dreq(&txConfig, DREQ_UART1_TX);
     dma_channel_set_config(DmaChannelTX, &txConfig, false);
     dma_channel_set_write_addr(DmaChannelTX, &uart1_hw->dr, false);
@@ -142,38 +291,80 @@ void Midi::Init()
 
 uint16_t Midi::Write(const uint8_t* data, uint16_t length)
 {
-    tud_midi_stream_write(0, data, length);
-
     if (!initialized || length == 0) {
         return 0;
     }
-    // copy the data into the buffer if possible
-    uint8_t* start = &TxBuffer[TxIndex + MIDI_BUF_LENGTH*pingPong];
-    // truncate copy amount to fit into buffer
-    length = TxIndex + length > MIDI_BUF_LENGTH - 1
-        ? MIDI_BUF_LENGTH - 1 - TxIndex
-        : length;
-    memcpy(start, data,
-            length);
-    TxIndex += length;
-    // attempt to flush immediately
-    Flush();
+    // half a message is worse than none
+    if(outLength + length > MIDI_OUT_LENGTH)
+    {
+        droppedBytes += length;
+        return 0;
+    }
+    memcpy(&outBuffer[outLength], data, length);
+    outLength += length;
     return length;
 }
 
-void Midi::Flush()
+uint16_t Midi::TxFree()
+{
+    // the bytes the dma is still reading can't be written over
+    if(!dma_channel_is_busy(DmaChannelTX))
+        txSending = txSent;
+    return MIDI_TX_RING_LENGTH - (uint16_t)(txWrite - txSending);
+}
+
+void Midi::TxPush(uint8_t byte)
+{
+    TxBuffer[txWrite&(MIDI_TX_RING_LENGTH-1)] = byte;
+    txWrite++;
+}
+
+void __not_in_flash_func(Midi::Flush)()
 {
-    if(!initialized || dma_channel_is_busy(DmaChannelTX))
+    if(!initialized)
         return;
-    // Size check
-    if (TxIndex == 0)
+    if(outLength > 0)
     {
-        return;
+        // one transfer for the whole block
+        if(tud_mounted())
+        {
+            uint32_t written = tud_midi_stream_write(0, outBuffer, outLength);
+            droppedBytes += outLength - written;
+        }
+        uint16_t free = TxFree();
+        uint16_t i = 0;
+        while(i < outLength)
+        {
+            uint8_t status = outBuffer[i];
+            uint8_t length = 1 + ((status & 0x80) > 0 ? DataLength(status) : 0);
+            // realtime bytes can go in the middle of running status, system common ends it
+            bool realtime = status >= 0xf8;
+            bool running = !realtime && status >= 0x80 && status < 0xf0 && status == txRunningStatus;
+            uint8_t size = running ? length - 1 : length;
+            if(size > free)
+            {
+                droppedBytes += length;
+                // the receiver might have missed the status, send it again next time
+                if(!realtime)
+                    txRunningStatus = 0;
+                i += length;
+                continue;
+            }
+            if(!realtime)
+                txRunningStatus = status < 0xf0 ? status : 0;
+            for(uint8_t b=running?1:0;b<length;b++)
+                TxPush(outBuffer[i+b]);
+            free -= size;
+            i += length;
+        }
+        outLength = 0;
     }
-    uint8_t* start = &TxBuffer[MIDI_BUF_LENGTH*pingPong];
-    dma_channel_transfer_from_buffer_now(DmaChannelTX, start, TxIndex);
-    pingPong = (pingPong+1)%2;
-    TxIndex = 0;
+    // anything that didn't make it into the last transfer goes out once it is done
+    if(txSent == txWrite || dma_channel_is_busy(DmaChannelTX))
+        return;
+    txSending = txSent;
+    dma_channel_transfer_from_buffer_now(DmaChannelTX, &TxBuffer[txSent&(MIDI_TX_RING_LENGTH-1)], (uint16_t)(txWrite-txSent));
+    txSent = txWrite;
 }
 
 void Midi::NoteOn(uint8_t channel, uint8_t pitch, uint8_t velocity)
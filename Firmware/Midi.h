@@ -3,11 +3,41 @@
 #include "hardware/uart.h"
 #include "pico/stdlib.h"
 
-#define MIDI_BUF_LENGTH_POW 5
-#define MIDI_BUF_LENGTH 1 << MIDI_BUF_LENGTH_POW
+// messages queued up over a block, sent out together by Flush
+#define MIDI_OUT_LENGTH 128
+// the uart dma reads out of this ring, it has to be aligned to its size
+#define MIDI_TX_RING_POW 8
+#define MIDI_TX_RING_LENGTH (1 << MIDI_TX_RING_POW)
 
 void midi_task();
 
+#define MIDI_EVENT_QUEUE_LENGTH_POW 6
+#define MIDI_EVENT_QUEUE_LENGTH (1 << MIDI_EVENT_QUEUE_LENGTH_POW)
+
+// a parsed message, time is time_us_32() when its last byte came in
+typedef struct {
+    uint32_t time;
+    uint8_t status;
+    uint8_t data[2];
+} MidiEvent;
+
+// usb packets handled per midi_task, so a busy daw can't hold up the main loop
+#define MIDI_USB_PACKETS_PER_TASK 32
+
+typedef struct {
+    uint32_t packets = 0;
+    uint32_t reads = 0; // midi_task calls that found something
+    uint32_t limitedReads = 0; // ones that stopped with packets still waiting
+    uint16_t mostPerRead = 0;
+} MidiInputStats;
+
+// single producer, single consumer. each input has its own, so the uart interrupt and the usb task never share one
+typedef struct {
+    MidiEvent events[MIDI_EVENT_QUEUE_LENGTH];
+    volatile uint8_t head = 0; // only written by the input
+    volatile uint8_t tail = 0; // only written by whoever handles the events
+} MidiEventQueue;
+
 typedef struct {
     int8_t dataByteCounter = -1;
     char lastCommand;
@@ -23,8 +53,12 @@ class Midi
         void TimingClock();
         void NoteOn(uint8_t channel, uint8_t pitch, uint8_t velocity);
         void NoteOff(uint8_t channel, uint8_t pitch);
+        // queues a whole message, it is dropped if it doesn't fit
         uint16_t Write(const uint8_t* data, uint16_t length);
+        // sends everything queued since the last flush, once per block
         void Flush();
+        // bytes that were thrown away because a buffer was full
+        uint32_t GetDroppedBytes() { return droppedBytes; }
         void (*OnSync)() = NULL; // 0xf8
         void (*OnStart)() = NULL; // 0xfa
         void (*OnContinue)() = NULL; // 0xfb
@@ -33,15 +67,40 @@ class Midi
         void (*OnNoteOn)(uint8_t channel, uint8_t note, uint8_t velocity) = NULL; // 0x9x, 2 data bytes
         void (*OnNoteOff)(uint8_t channel, uint8_t note, uint8_t velocity) = NULL; // 0x8x, 2 data bytes
         void(*OnCCChanged)(uint8_t cc, uint8_t newValue) = NULL; // 0xBx, 2 data bytes
+        // parses the incoming bytes into the event queue of that input, safe to call from an interrupt
         void ProcessMessage(char msg, uint8_t processor);
+        void ProcessMessages(const uint8_t* data, uint16_t length, uint8_t processor);
+        // a usb midi event packet, the cable number and code index say what is in it so there is nothing to parse
+        void ProcessPacket(const uint8_t packet[4]);
+        // reads the waiting usb packets, at most MIDI_USB_PACKETS_PER_TASK
+        void ReadUsb();
+        const MidiInputStats& GetUsbStats() { return usbStats; }
+        // the oldest event that came in, PopEvent removes it once it has been handled
+        bool PeekEvent(MidiEvent &event);
+        void PopEvent();
+        // calls the callback for the event
+        void Dispatch(const MidiEvent &event);
     private:
+        void PushEvent(uint8_t processor, uint8_t status, uint8_t data0, uint8_t data1);
+        uint8_t EventQueueFree(uint8_t processor);
+        uint16_t TxFree();
+        void TxPush(uint8_t byte);
+        MidiEventQueue inputQueues[2];
+        uint8_t peekedQueue = 0;
         uint8_t lastCCValue[128]; // used for filtering out values so we don't send them all the time
         bool initialized = false;
-        uint8_t pingPong = 0; // what half of the buffer we are sending
-        uint8_t TxBuffer[MIDI_BUF_LENGTH*2];
-        uint16_t TxIndex;
+        uint8_t outBuffer[MIDI_OUT_LENGTH]; // full messages, usb midi needs the status on each of them
+        uint16_t outLength = 0;
+        uint8_t TxBuffer[MIDI_TX_RING_LENGTH] __attribute__((aligned(MIDI_TX_RING_LENGTH)));
+        // free running, masked when used
+        uint16_t txWrite = 0; // next byte to be queued
+        uint16_t txSent = 0; // first byte the dma hasn't been given yet
+        uint16_t txSending = 0; // first byte of the transfer the dma is on
+        uint8_t txRunningStatus = 0;
+        uint32_t droppedBytes = 0;
         uint16_t DmaChannelTX;
         InputProcessor inputProcessors[2];
+        MidiInputStats usbStats;
 };
 
 extern Midi *midi; // uart callbacks go here
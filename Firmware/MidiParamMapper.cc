@@ -5,6 +5,17 @@ MidiParamMapper::MidiParamMapper()
     for(int i=0;i<128;i++)
     {
         paramMap[i].voice = 0xff;
+        paramMap[i].rampRemaining = 0;
+    }
+    for(int i=0;i<MIDI_NRPN_MAPS;i++)
+    {
+        nrpnMap[i].number = MIDI_NRPN_NONE;
+        nrpnMap[i].map.voice = 0xff;
+        nrpnMap[i].map.rampRemaining = 0;
+    }
+    for(int i=0;i<32;i++)
+    {
+        lastMsb[i] = 0;
     }
 }
 
@@ -15,14 +26,173 @@ void MidiParamMapper::SetCCTarget(uint8_t cc, uint8_t voice, uint8_t param, uint
     paramMap[cc].voice = voice;
     paramMap[cc].param = param;
     paramMap[cc].keyTarget = keyTarget;
+    paramMap[cc].rampRemaining = 0;
+}
+
+MidiNrpnMap* MidiParamMapper::FindNrpn(uint16_t number)
+{
+    for(int i=0;i<MIDI_NRPN_MAPS;i++)
+    {
+        if(nrpnMap[i].number == number)
+            return &nrpnMap[i];
+    }
+    return NULL;
+}
+
+void MidiParamMapper::Learn(uint8_t cc, uint8_t voice, uint8_t param, uint8_t keyTarget)
+{
+    assert(cc < 128);
+    assert(voice < 16);
+    // the selection messages come first, the data entry after them is what gets mapped
+    if(cc == 98 || cc == 99 || cc == 100 || cc == 101)
+        return;
+    if((cc == 6 || cc == 38) && selectedNrpn != MIDI_NRPN_NONE)
+    {
+        MidiNrpnMap *nrpn = FindNrpn(selectedNrpn);
+        if(nrpn == NULL)
+        {
+            // reuse the oldest one
+            nrpn = &nrpnMap[nextNrpnMap];
+            nextNrpnMap = (nextNrpnMap+1)%MIDI_NRPN_MAPS;
+            nrpn->number = selectedNrpn;
+        }
+        nrpn->map.voice = voice;
+        nrpn->map.param = param;
+        nrpn->map.keyTarget = keyTarget;
+        nrpn->map.rampRemaining = 0;
+        return;
+    }
+    // the lsb of a 14 bit controller that was just learned
+    if(cc >= 32 && cc < 64 && paramMap[cc-32].voice == voice && paramMap[cc-32].param == param)
+        return;
+    SetCCTarget(cc, voice, param, keyTarget);
+}
+
+bool MidiParamMapper::UpdateNrpnSelection(uint8_t cc, uint8_t newValue)
+{
+    switch(cc)
+    {
+        case 99:
+            nrpnMsb = newValue;
+            break;
+        case 98:
+            nrpnLsb = newValue;
+            break;
+        case 101:
+        case 100:
+            // an rpn takes over data entry, none of those are mapped
+            nrpnMsb = nrpnLsb = 0x7f;
+            break;
+        default:
+            return false;
+    }
+    // 127/127 is the null parameter, it turns data entry off
+    selectedNrpn = nrpnMsb == 0x7f && nrpnLsb == 0x7f ? MIDI_NRPN_NONE : (nrpnMsb<<7)|nrpnLsb;
+    return true;
+}
+
+static bool IsStepped(uint8_t param)
+{
+    // targets, modes and lengths, the values in between mean something else
+    switch(param)
+    {
+        case Env1Target:
+        case Env2Target:
+        case Lfo1Target:
+        case Length:
+        case Rate:
+        case ConditionMode:
+        case ConditionData:
+            return true;
+    }
+    return param >= 46;
+}
+
+void MidiParamMapper::SetTarget(MidiParamMap &map, VoiceData voiceData[], uint16_t target, uint8_t currentPattern)
+{
+    if(map.voice >= 16)
+        return;
+    uint8_t& current = voiceData[map.voice].GetParam(map.param, map.keyTarget, currentPattern);
+    // start from the voice, it might have been changed from the knobs since the last ramp
+    if(map.rampRemaining == 0 || (map.value>>8) != current)
+        map.value = current<<8;
+    map.target = target;
+    if(IsStepped(map.param))
+    {
+        map.value = target;
+        map.increment = 0;
+        map.rampRemaining = 1;
+        return;
+    }
+    map.increment = ((int32_t)target-map.value)/MIDI_CC_RAMP_BLOCKS;
+    map.rampRemaining = MIDI_CC_RAMP_BLOCKS;
 }
 
 void MidiParamMapper::UpdateCC(VoiceData voiceData[], uint8_t cc, uint8_t newValue, uint8_t currentPattern)
 {
     assert(cc < 128);
+    // newValue is the 7 bit value doubled
+    uint8_t value = newValue>>1;
+    if(UpdateNrpnSelection(cc, value))
+        return;
+    if((cc == 6 || cc == 38) && selectedNrpn != MIDI_NRPN_NONE)
+    {
+        MidiNrpnMap *nrpn = FindNrpn(selectedNrpn);
+        uint16_t target;
+        if(cc == 6)
+        {
+            dataMsb = value;
+            target = value<<9;
+        }
+        else
+        {
+            target = (dataMsb<<9)|(value<<2);
+        }
+        if(nrpn != NULL)
+            SetTarget(nrpn->map, voiceData, target, currentPattern);
+        return;
+    }
     if(paramMap[cc].voice < 16)
     {
-        uint8_t& current_a = voiceData[paramMap[cc].voice].GetParam(paramMap[cc].param, paramMap[cc].keyTarget, currentPattern);
-        current_a = newValue;
+        if(cc < 32)
+            lastMsb[cc] = value;
+        SetTarget(paramMap[cc], voiceData, value<<9, currentPattern);
+        return;
+    }
+    // the lsb of a 14 bit controller
+    if(cc >= 32 && cc < 64 && paramMap[cc-32].voice < 16)
+        SetTarget(paramMap[cc-32], voiceData, (lastMsb[cc-32]<<9)|(value<<2), currentPattern);
+}
+
+static bool __not_in_flash_func(StepRamp)(MidiParamMap &map, VoiceData voiceData[], uint8_t currentPattern)
+{
+    if(map.rampRemaining == 0 || map.voice >= 16)
+        return false;
+    if(--map.rampRemaining == 0)
+        map.value = map.target;
+    else
+        map.value += map.increment;
+    uint8_t& current = voiceData[map.voice].GetParam(map.param, map.keyTarget, currentPattern);
+    uint8_t next = map.value>>8;
+    if(current == next)
+        return false;
+    voiceData[map.voice].MarkParamDirty(map.param, currentPattern);
+    current = next;
+    return true;
+}
+
+uint16_t __not_in_flash_func(MidiParamMapper::Update)(VoiceData voiceData[], uint8_t currentPattern)
+{
+    uint16_t changed = 0;
+    for(int i=0;i<128;i++)
+    {
+        if(StepRamp(paramMap[i], voiceData, currentPattern))
+            changed |= 1<<paramMap[i].voice;
+    }
+    for(int i=0;i<MIDI_NRPN_MAPS;i++)
+    {
+        if(StepRamp(nrpnMap[i].map, voiceData, currentPattern))
+            changed |= 1<<nrpnMap[i].map.voice;
     }
+    return changed;
 }
@@ -4,19 +4,58 @@
 #include "pico/stdlib.h"
 #include "voice_data.h"
 
+// blocks a cc change is spread over, 8 is 16ms
+#define MIDI_CC_RAMP_BLOCKS 8
+// nrpn numbers that can be mapped at once
+#define MIDI_NRPN_MAPS 16
+#define MIDI_NRPN_NONE 0xffff
+
 struct MidiParamMap
 {
     uint8_t voice;
     uint8_t param;
     uint8_t keyTarget; // for parameters that have per key values (i.e. sample loop points)
+    uint8_t rampRemaining; // blocks left before value reaches target
+    uint16_t value; // where the parameter is, the top 8 bits go into the voice
+    uint16_t target;
+    int32_t increment;
+};
+
+struct MidiNrpnMap
+{
+    uint16_t number;
+    MidiParamMap map;
 };
 
+/*
+cc changes don't go straight into the voices. a message only sets the target
+of its mapping, so a burst of them in one block costs the same as one. Update
+runs once a block and ramps the mapped parameters toward their targets.
+
+cc 0-31 pair with 32-63 as 14 bit controllers, the lsb refines the msb that
+came before it. nrpns are selected with 99/98 and set with data entry 6/38.
+the voices only keep 8 bits, so that is the most a 14 bit value gets to.
+*/
 class MidiParamMapper
 {
 public:
     MidiParamMapper();
     void UpdateCC(VoiceData voiceData[], uint8_t cc, uint8_t newValue, uint8_t currentPattern);
     void SetCCTarget(uint8_t cc, uint8_t voice, uint8_t param, uint8_t keyTarget);
+    // maps whatever the cc is part of, the nrpn for data entry or the msb for an lsb
+    void Learn(uint8_t cc, uint8_t voice, uint8_t param, uint8_t keyTarget);
+    // moves the parameters one block along their ramps, returns a bit per voice that changed
+    uint16_t Update(VoiceData voiceData[], uint8_t currentPattern);
 private:
+    bool UpdateNrpnSelection(uint8_t cc, uint8_t newValue);
+    void SetTarget(MidiParamMap &map, VoiceData voiceData[], uint16_t target, uint8_t currentPattern);
+    MidiNrpnMap* FindNrpn(uint16_t number);
     MidiParamMap paramMap[128];
-};
\ No newline at end of file
+    MidiNrpnMap nrpnMap[MIDI_NRPN_MAPS];
+    uint8_t nextNrpnMap = 0;
+    uint8_t lastMsb[32]; // for putting 14 bit ccs together
+    uint8_t nrpnMsb = 0x7f;
+    uint8_t nrpnLsb = 0x7f;
+    uint8_t dataMsb = 0;
+    uint16_t selectedNrpn = MIDI_NRPN_NONE;
+};
@@ -4,22 +4,25 @@
 
 bool ParamLockPoolInternal_encode_locks(pb_ostream_t *ostream, const pb_field_t *field, void * const *arg)
 {
-    ParamLock* lockPool = *(ParamLock**)arg;
+    ParamLockPool* lockPool = *(ParamLockPool**)arg;
 
-    // encode all locks
-    for (int i = 0; i < LOCKCOUNT; i++)
+    // encode the requested range, or only the ones that changed for incremental saves
+    for (int i = lockPool->encodeFirst; i < lockPool->encodeFirst+lockPool->encodeCount; i++)
     {
+        if(lockPool->encodeDirtyOnly && !lockPool->IsDirty(i))
+            continue;
         if (!pb_encode_tag_for_field(ostream, field))
         {
             const char * error = PB_GET_ERROR(ostream);
             return false;
         }
         ParamLockPoolInternal_ParamLock lock = ParamLockPoolInternal_ParamLock_init_zero;
+        ParamLock *poolLock = lockPool->GetLock(i);
 
-        lock.next = lockPool[i].next;
-        lock.step = lockPool[i].step;
-        lock.param = lockPool[i].param;
-        lock.value = lockPool[i].value;
+        lock.next = ParamLockPool::EncodePosition(lockPool->GetNext(poolLock));
+        lock.step = poolLock->step;
+        lock.param = poolLock->param;
+        lock.value = poolLock->value;
         lock.index = i;
         if (!pb_encode_submessage(ostream, ParamLockPoolInternal_ParamLock_fields, &lock))
         {
@@ -33,12 +36,16 @@ bool ParamLockPoolInternal_encode_locks(pb_ostream_t *ostream, const pb_field_t
 int decodeCount = 0;
 bool ParamLockPoolInternal_decode_locks(pb_istream_t *stream, const pb_field_iter_t *field, void **arg)
 {
-    ParamLock* lockPool = (*(ParamLock**)arg);
+    ParamLockPool* lockPool = *(ParamLockPool**)arg;
     ParamLockPoolInternal_ParamLock msgLock = ParamLockPoolInternal_ParamLock_init_zero;
     if (!pb_decode(stream, ParamLockPoolInternal_ParamLock_fields, &msgLock))
         return false;
-    ParamLock *lock = lockPool+msgLock.index;
-    lock->next = msgLock.next;
+    if(msgLock.index >= LOCKCOUNT)
+        return true;
+    if(msgLock.index >= LEGACY_LOCKCOUNT || msgLock.next > LEGACY_LOCKCOUNT)
+        lockPool->decodedExtendedPool = true;
+    ParamLock *lock = lockPool->GetLock(msgLock.index);
+    lockPool->SetNext(lock, ParamLockPool::DecodePosition(msgLock.next));
     lock->step = msgLock.step;
     lock->param = msgLock.param;
     lock->value = msgLock.value;
@@ -53,27 +60,108 @@ ParamLockPool::ParamLockPool()
 void ParamLockPool::Init()
 {
     freeLocks = 0;
+    decodedExtendedPool = false;
+    marking = false;
+    compactBoundary = LOCKCOUNT;
     for(int i=0;i<LOCKCOUNT;i++)
     {
-        locks[i].next = i+1;
+        SetNext(&locks[i], i+1);
+    }
+    // a fresh pool hasn't been written anywhere yet
+    memset(dirtyLocks, 0xff, sizeof(dirtyLocks));
+    encodeDirtyOnly = false;
+}
+void ParamLockPool::MarkDirty(ParamLock *lock)
+{
+    uint16_t position = GetLockPosition(lock);
+    if(!IsValidLock(position))
+        return;
+    if(beforeWrite)
+        beforeWrite(position);
+    dirtyLocks[position>>5] |= 1<<(position&0x1f);
+}
+bool ParamLockPool::IsDirty(uint16_t position)
+{
+    return (dirtyLocks[position>>5] >> (position&0x1f)) & 1;
+}
+// ranges are expected to be multiples of 32 locks
+bool ParamLockPool::HasDirtyLocks(uint16_t first, uint16_t count)
+{
+    for(int i=first>>5;i<(first+count)>>5;i++)
+    {
+        if(dirtyLocks[i])
+            return true;
     }
+    return false;
+}
+void ParamLockPool::ClearDirty(uint16_t first, uint16_t count)
+{
+    memset(dirtyLocks+(first>>5), 0, (count>>5)*sizeof(uint32_t));
 }
-void ParamLockPool::Serialize(pb_ostream_t *s)
+void ParamLockPool::Serialize(pb_ostream_t *s, bool dirtyOnly)
+{
+    Serialize(s, freeLocks, 0, LOCKCOUNT, dirtyOnly);
+}
+void ParamLockPool::Serialize(pb_ostream_t *s, uint16_t freeLocksToWrite, uint16_t first, uint16_t count, bool dirtyOnly)
 {
     ParamLockPoolInternal lockPoolEncoder = ParamLockPoolInternal_init_zero;
-    lockPoolEncoder.freeLocks = freeLocks;
+    lockPoolEncoder.freeLocks = EncodePosition(freeLocksToWrite);
     lockPoolEncoder.locks.funcs.encode = &ParamLockPoolInternal_encode_locks;
-    lockPoolEncoder.locks.arg = locks;
+    lockPoolEncoder.locks.arg = this;
+    encodeDirtyOnly = dirtyOnly;
+    encodeFirst = first;
+    encodeCount = count;
     pb_encode_ex(s, ParamLockPoolInternal_fields, &lockPoolEncoder, PB_ENCODE_DELIMITED);
+    encodeDirtyOnly = false;
 }
 
 void ParamLockPool::Deserialize(pb_istream_t *s)
 {
     ParamLockPoolInternal lockPoolDecoder = ParamLockPoolInternal_init_zero;
     lockPoolDecoder.locks.funcs.decode = &ParamLockPoolInternal_decode_locks;
-    lockPoolDecoder.locks.arg = locks;
+    lockPoolDecoder.locks.arg = this;
     pb_decode_ex(s, ParamLockPoolInternal_fields, &lockPoolDecoder, PB_ENCODE_DELIMITED);
-    freeLocks = lockPoolDecoder.freeLocks;
+    if(lockPoolDecoder.freeLocks > LEGACY_LOCKCOUNT)
+        decodedExtendedPool = true;
+    freeLocks = DecodePosition(lockPoolDecoder.freeLocks);
+}
+
+uint32_t ParamLockPool::EncodePosition(uint16_t position)
+{
+    if(position >= LOCKCOUNT)
+        return LEGACY_LOCKCOUNT;
+    return position < LEGACY_LOCKCOUNT ? position : position+1;
+}
+
+uint16_t ParamLockPool::DecodePosition(uint32_t position)
+{
+    if(position == LEGACY_LOCKCOUNT || position > LOCKCOUNT)
+        return LOCKCOUNT;
+    return position < LEGACY_LOCKCOUNT ? position : position-1;
+}
+
+void ParamLockPool::ExtendLegacyPool()
+{
+    if(decodedExtendedPool)
+        return;
+    // the locks past the old pool are untouched since Init, so they already link up to the end
+    decodedExtendedPool = true;
+    if(!IsValidLock(freeLocks))
+    {
+        freeLocks = LEGACY_LOCKCOUNT;
+        // nothing else changed, this makes the next save write the new free list head
+        MarkDirty(GetLock(LEGACY_LOCKCOUNT));
+        return;
+    }
+    ParamLock *lock = GetLock(freeLocks);
+    for(int i=0;i<LOCKCOUNT && IsValidLock(GetNext(lock));i++)
+    {
+        lock = GetLock(GetNext(lock));
+    }
+    if(GetLockPosition(lock) >= LEGACY_LOCKCOUNT)
+        return;
+    MarkDirty(lock);
+    SetNext(lock, LEGACY_LOCKCOUNT);
 }
 
 bool ParamLockPool::GetFreeParamLock(ParamLock **lock)
@@ -81,7 +169,10 @@ bool ParamLockPool::GetFreeParamLock(ParamLock **lock)
     if(IsValidLock(freeLocks))
     {
         *lock = GetLock(freeLocks);
-        freeLocks = (*lock)->next;
+        freeLocks = GetNext(*lock);
+        MarkDirty(*lock);
+        if(marking)
+            SetMark(GetLockPosition(*lock));
         return true;
     }
     return false;
@@ -94,9 +185,9 @@ uint16_t ParamLockPool::FreeLockCount()
     while(IsValidLock(lock))
     {
         count++;
-        if(lock == GetLock(lock->next))
+        if(lock == GetLock(GetNext(lock)))
             return count;
-        lock = GetLock(lock->next);
+        lock = GetLock(GetNext(lock));
     }
     return count;
 }
@@ -108,23 +199,171 @@ bool ParamLockPool::IsFreeLock(ParamLock *searchLock)
     {
         if(lock == searchLock)
             return true;
-        lock = GetLock(lock->next);
+        lock = GetLock(GetNext(lock));
     }
     return false;
 }
 
 void ParamLockPool::ReturnLockToPool(ParamLock *lock)
 {
+    MarkDirty(lock);
+    if(marking)
+        ClearMark(GetLockPosition(lock));
     if(!IsValidLock(freeLocks))
     {
-        lock->next = LOCKCOUNT;
+        SetNext(lock, LOCKCOUNT);
         freeLocks = GetLockPosition(lock);
         return;
     }
-    lock->next = freeLocks;
+    SetNext(lock, freeLocks);
     freeLocks = GetLockPosition(lock);
 }
 
+void ParamLockPool::BeginMarking()
+{
+    memset(marks, 0, sizeof(marks));
+    marking = true;
+}
+
+void ParamLockPool::MarkList(uint16_t head)
+{
+    // locks handed out while marking are already marked, so keep going past them.
+    // the count stops a list that loops back on itself
+    for(int i=0;i<LOCKCOUNT && IsValidLock(head);i++)
+    {
+        SetMark(head);
+        head = GetNext(GetLock(head));
+    }
+}
+
+uint16_t ParamLockPool::CountLost()
+{
+    MarkList(freeLocks);
+    uint16_t lost = 0;
+    for(int i=0;i<LOCKCOUNT;i++)
+    {
+        if(!IsMarked(i))
+            lost++;
+    }
+    return lost;
+}
+
+uint16_t ParamLockPool::Sweep()
+{
+    uint16_t unmarked = 0;
+    for(int i=0;i<LOCKCOUNT;i++)
+    {
+        if(!IsMarked(i))
+            unmarked++;
+    }
+    uint16_t wasFree = 0;
+    uint16_t position = freeLocks;
+    for(int i=0;i<LOCKCOUNT && IsValidLock(position);i++)
+    {
+        if(!IsMarked(position))
+            wasFree++;
+        position = GetNext(GetLock(position));
+    }
+    RebuildFreeList(0);
+    return unmarked > wasFree ? unmarked-wasFree : 0;
+}
+
+void ParamLockPool::RebuildFreeList(uint16_t first)
+{
+    // in order, so new locks come from the start of the pool
+    uint16_t head = LOCKCOUNT;
+    for(int i=LOCKCOUNT-1;i>=first;i--)
+    {
+        if(IsMarked(i))
+            continue;
+        ParamLock *lock = GetLock(i);
+        if(GetNext(lock) != head)
+        {
+            MarkDirty(lock);
+            SetNext(lock, head);
+        }
+        head = i;
+    }
+    if(freeLocks != head)
+    {
+        freeLocks = head;
+        // the head is saved with every lock record, make sure one gets written
+        if(IsValidLock(head))
+            MarkDirty(GetLock(head));
+    }
+}
+
+uint16_t ParamLockPool::CountHoles()
+{
+    int last = LOCKCOUNT-1;
+    while(last >= 0 && !IsMarked(last))
+        last--;
+    uint16_t holes = 0;
+    for(int i=0;i<last;i++)
+    {
+        if(!IsMarked(i))
+            holes++;
+    }
+    return holes;
+}
+
+uint16_t ParamLockPool::Compact()
+{
+    // two fingers, the lowest hole takes the highest live lock
+    uint16_t moved = 0;
+    int low = 0;
+    int high = LOCKCOUNT-1;
+    while(true)
+    {
+        while(low < high && IsMarked(low))
+            low++;
+        while(low < high && !IsMarked(high))
+            high--;
+        if(low >= high)
+            break;
+        ParamLock *from = GetLock(high);
+        ParamLock *to = GetLock(low);
+        MarkDirty(to);
+        MarkDirty(from);
+        to->step = from->step;
+        to->param = from->param;
+        to->value = from->value;
+        SetNext(to, GetNext(from));
+        SetNext(from, low);
+        SetMark(low);
+        ClearMark(high);
+        moved++;
+    }
+    compactBoundary = 0;
+    while(compactBoundary < LOCKCOUNT && IsMarked(compactBoundary))
+        compactBoundary++;
+    // moved locks can point at other moved locks
+    for(int i=0;i<compactBoundary;i++)
+    {
+        ParamLock *lock = GetLock(i);
+        uint16_t next = GetNext(lock);
+        if(IsValidLock(next) && next >= compactBoundary)
+        {
+            MarkDirty(lock);
+            SetNext(lock, GetNext(GetLock(next)));
+        }
+    }
+    return moved;
+}
+
+uint16_t ParamLockPool::Forward(uint16_t position)
+{
+    if(IsValidLock(position) && position >= compactBoundary)
+        return GetNext(GetLock(position));
+    return position;
+}
+
+void ParamLockPool::FinishCompact()
+{
+    RebuildFreeList(compactBoundary);
+    compactBoundary = LOCKCOUNT;
+}
+
 uint16_t ParamLockPool::GetLockPosition(ParamLock *lock)
 {
     uint16_t res = lock-locks;
@@ -155,12 +394,12 @@ void ParamLockPoolTest::RunTest()
     uint16_t patternLocks = ParamLockPool::InvalidLockPosition();
     ParamLock *lock;
 
-    assert(lockPool.FreeLockCount() == 4096);
+    assert(lockPool.FreeLockCount() == LOCKCOUNT);
     // get a lock
     lockPool.GetFreeParamLock(&lock);
-    assert(lockPool.FreeLockCount() == 4095);
+    assert(lockPool.FreeLockCount() == LOCKCOUNT-1);
     lockPool.ReturnLockToPool(lock);
-    assert(lockPool.FreeLockCount() == 4096);
+    assert(lockPool.FreeLockCount() == LOCKCOUNT);
      
     // return it
     // attempt to exhaust the lockpool
@@ -168,9 +407,9 @@ void ParamLockPoolTest::RunTest()
     while(lockPool.GetFreeParamLock(&lock))
     {
         lock->param = 0;
-        lock->step = lockpoolCount;
+        lock->step = lockpoolCount&0x3f;
         lock->value = 0;
-        lock->next = patternLocks;
+        lockPool.SetNext(lock, patternLocks);
         patternLocks = lockPool.GetLockPosition(lock);
         lockpoolCount++;
     }
@@ -2,16 +2,20 @@
 #include <stdio.h>
 #include <string.h>
 #include "ParamLockPoolInternal.pb.h"
-#define LOCKCOUNT 16*256
+#define LOCKCOUNT (24*256)
+// the pool size before locks were packed into 4 bytes, files written back then end their lists with this
+#define LEGACY_LOCKCOUNT (16*256)
 #include <pb_encode.h>
 #include <pb_decode.h>
 
+// packed into 4 bytes. positions need 13 bits, the low 12 bits of the next lock are
+// kept here and the pool keeps the top bit, use GetNext and SetNext for the link
 struct ParamLock
 {
-    uint8_t step;
-    uint8_t param;
-    uint8_t value;
-    uint16_t next;
+    uint32_t step : 6;
+    uint32_t param : 6;
+    uint32_t value : 8;
+    uint32_t nextLow : 12;
 };
 
 bool ParamLockPoolInternal_encode_locks(pb_ostream_t *ostream, const pb_field_t *field, void * const *arg);
@@ -30,14 +34,82 @@ class ParamLockPool
         bool IsValidLock(ParamLock *lock);
         bool IsValidLock(uint16_t lockPosition);
         uint16_t FreeLockCount();
+        uint16_t GetNext(ParamLock *lock)
+        {
+            uint16_t position = lock-locks;
+            return lock->nextLow | (((nextHigh[position>>5]>>(position&0x1f))&1)<<12);
+        }
+        void SetNext(ParamLock *lock, uint16_t next)
+        {
+            uint16_t position = lock-locks;
+            lock->nextLow = next;
+            if(next>>12)
+                nextHigh[position>>5] |= 1<<(position&0x1f);
+            else
+                nextHigh[position>>5] &= ~(1<<(position&0x1f));
+        }
 
-        void Serialize(pb_ostream_t *s);
+        // dirty tracking for incremental saves, a lock is dirty if any of its fields
+        // (including its position in the free list) changed since the last save
+        void MarkDirty(ParamLock *lock);
+        bool IsDirty(uint16_t position);
+        bool HasDirtyLocks(uint16_t first = 0, uint16_t count = LOCKCOUNT);
+        void ClearDirty(uint16_t first = 0, uint16_t count = LOCKCOUNT);
+        // called before a lock is changed, lets a save that is in progress write out the old value first
+        void (*beforeWrite)(uint16_t position) = NULL;
+
+        uint16_t GetFreeLocks() { return freeLocks; }
+        void Serialize(pb_ostream_t *s, bool dirtyOnly = false);
+        // writes a range of the pool, freeLocks is passed in so a save can use the value from when it started
+        void Serialize(pb_ostream_t *s, uint16_t freeLocksToWrite, uint16_t first, uint16_t count, bool dirtyOnly);
         void Deserialize(pb_istream_t *s);
+        // call once a song has been loaded, songs saved with the smaller pool get the new locks added to their free list
+        void ExtendLegacyPool();
+
+        // mark and sweep, LockCollector walks the lock lists. locks handed out while
+        // marking count as marked and returned ones as unmarked, so the lists can
+        // be edited between MarkList calls
+        void BeginMarking();
+        void EndMarking() { marking = false; }
+        bool IsMarking() { return marking; }
+        void MarkList(uint16_t head);
+        // unmarked locks that aren't on the free list, marks the free list as it goes
+        uint16_t CountLost();
+        // puts every unmarked lock on the free list, returns how many of them had been lost.
+        // marking stays on, so the marks still match the pool for Compact
+        uint16_t Sweep();
+        // moves the live locks after a Sweep down into the holes below them, returns how many moved.
+        // until FinishCompact the old positions lead to the new ones through Forward
+        uint16_t Compact();
+        uint16_t Forward(uint16_t position);
+        void FinishCompact();
+        // how many free locks sit below the last live lock after a Sweep
+        uint16_t CountHoles();
 
         static uint16_t InvalidLockPosition() { return LOCKCOUNT; }
+        // LEGACY_LOCKCOUNT is still the end of a list in files, later positions are written one higher
+        static uint32_t EncodePosition(uint16_t position);
+        static uint16_t DecodePosition(uint32_t position);
     private:
+        friend bool ParamLockPoolInternal_encode_locks(pb_ostream_t *ostream, const pb_field_t *field, void * const *arg);
+        friend bool ParamLockPoolInternal_decode_locks(pb_istream_t *stream, const pb_field_iter_t *field, void **arg);
         ParamLock locks[LOCKCOUNT];
+        uint32_t nextHigh[LOCKCOUNT/32];
         uint16_t freeLocks;
+        // set when a load has seen anything past LEGACY_LOCKCOUNT
+        bool decodedExtendedPool;
+        uint32_t marks[LOCKCOUNT/32];
+        bool marking;
+        uint16_t compactBoundary;
+        bool IsMarked(uint16_t position) { return (marks[position>>5] >> (position&0x1f)) & 1; }
+        void SetMark(uint16_t position) { marks[position>>5] |= 1<<(position&0x1f); }
+        void ClearMark(uint16_t position) { marks[position>>5] &= ~(1<<(position&0x1f)); }
+        // rebuilds the free list from the unmarked locks from first on, in order
+        void RebuildFreeList(uint16_t first);
+        uint32_t dirtyLocks[LOCKCOUNT/32];
+        bool encodeDirtyOnly;
+        uint16_t encodeFirst;
+        uint16_t encodeCount;
 };
 
 class ParamLockPoolTest
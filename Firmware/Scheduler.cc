@@ -0,0 +1,99 @@
+#include "Scheduler.h"
+#include <string.h>
+
+void Scheduler::Init()
+{
+    memset(tasks, 0, sizeof(tasks));
+    taskCount = 0;
+}
+
+int Scheduler::AddTask(const char *name, SchedulerTaskFunc func, uint32_t period, uint32_t deadline)
+{
+    if(taskCount == SCHEDULER_MAX_TASKS)
+    {
+        printf("scheduler has no room for %s\n", name);
+        return SCHEDULER_NO_TASK;
+    }
+    SchedulerTask &task = tasks[taskCount];
+    task.name = name;
+    task.func = func;
+    task.period = period;
+    task.deadline = deadline;
+    task.due = time_us_32()+period;
+    return taskCount++;
+}
+
+void __not_in_flash_func(Scheduler::MakeReady)(int task)
+{
+    if(task == SCHEDULER_NO_TASK || tasks[task].ready)
+        return;
+    tasks[task].due = time_us_32();
+    tasks[task].ready = true;
+}
+
+bool __not_in_flash_func(Scheduler::RunOnce)()
+{
+    uint32_t now = time_us_32();
+    for(int i=0;i<taskCount;i++)
+    {
+        SchedulerTask &task = tasks[i];
+        if(task.ready || task.yielded || (task.period && (int32_t)(now-task.due) >= 0))
+        {
+            Run(task, now);
+            return true;
+        }
+    }
+    return false;
+}
+
+void __not_in_flash_func(Scheduler::Run)(SchedulerTask &task, uint32_t now)
+{
+    // the slices after a yield carry on the same run, only the first one was waited for
+    if(!task.yielded)
+    {
+        uint32_t latency = now-task.due;
+        task.starts++;
+        task.latencyTotal += latency;
+        if(latency > task.latencyMax)
+            task.latencyMax = latency;
+        if(task.deadline && latency > task.deadline)
+            task.missedDeadlines++;
+    }
+    // cleared first, so a MakeReady while it runs isn't lost
+    task.ready = false;
+    task.yielded = task.func();
+    uint32_t runTime = time_us_32()-now;
+    task.runs++;
+    task.runTimeTotal += runTime;
+    if(runTime > task.runTimeMax)
+        task.runTimeMax = runTime;
+    if(task.yielded || !task.period)
+        return;
+    task.due += task.period;
+    // a task that fell behind starts again from now rather than running back to back to catch up
+    if((int32_t)(now-task.due) >= 0)
+        task.due = now+task.period;
+}
+
+void Scheduler::PrintStats(int task)
+{
+    SchedulerTask &t = tasks[task];
+    printf("%s %i/%ius %i/%ius %i\n",
+        t.name, t.runs ? (uint32_t)(t.runTimeTotal/t.runs) : 0, t.runTimeMax,
+        t.starts ? (uint32_t)(t.latencyTotal/t.starts) : 0, t.latencyMax, t.missedDeadlines);
+}
+
+void Scheduler::ResetStats()
+{
+    for(int i=0;i<taskCount;i++)
+    {
+        SchedulerTask &task = tasks[i];
+        task.runs = 0;
+        task.runTimeMax = 0;
+        task.runTimeTotal = 0;
+        task.starts = 0;
+        task.latencyMax = 0;
+        task.latencyTotal = 0;
+        task.missedDeadlines = 0;
+    }
+}
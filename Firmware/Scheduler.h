@@ -0,0 +1,74 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "pico/stdlib.h"
+
+/*
+
+scheduler
+---------
+the main loop is a list of tasks in priority order. each pass runs the
+first task that is ready, so after any task the audio gets looked at
+again first. how late something can be is bounded by the longest single
+run of a task below it, which is what the stats are for.
+
+a task is ready when its period comes round, or when something calls
+MakeReady (the audio dma handlers do that, so it can be from an
+interrupt). a task that returns true has yielded with more to do, it stays
+ready and carries on after anything more urgent has had a go.
+
+latency is from when the task became due to when it started, runtime is
+each run on its own, so a task that yields shows up as its slices.
+
+*/
+
+#define SCHEDULER_MAX_TASKS 8
+#define SCHEDULER_NO_TASK -1
+
+// true if the task yielded and wants to carry on
+typedef bool (*SchedulerTaskFunc)();
+
+struct SchedulerTask
+{
+    const char *name;
+    SchedulerTaskFunc func;
+    // us between runs, 0 for tasks that only run from MakeReady
+    uint32_t period;
+    // us it should start within, 0 if it doesn't matter
+    uint32_t deadline;
+    uint32_t due;
+    volatile bool ready;
+    bool yielded;
+    uint32_t runs;
+    uint32_t runTimeMax;
+    uint64_t runTimeTotal;
+    uint32_t starts;
+    uint32_t latencyMax;
+    uint64_t latencyTotal;
+    uint32_t missedDeadlines;
+};
+
+class Scheduler
+{
+    public:
+        void Init();
+        // tasks get their priority from the order they are added, the first is the most urgent
+        int AddTask(const char *name, SchedulerTaskFunc func, uint32_t period, uint32_t deadline = 0);
+        void MakeReady(int task);
+        // runs the most urgent task that is ready, false if there was nothing to do
+        bool RunOnce();
+        // one short line for one task, so it mostly fits in the uart fifo rather than blocking on it
+        void PrintStats(int task);
+        // starts the max and average over
+        void ResetStats();
+        const SchedulerTask &GetTask(int task) { return tasks[task]; }
+        int GetTaskCount() { return taskCount; }
+    private:
+        void Run(SchedulerTask &task, uint32_t now);
+        SchedulerTask tasks[SCHEDULER_MAX_TASKS];
+        uint8_t taskCount;
+};
+
+#endif // SCHEDULER_H_
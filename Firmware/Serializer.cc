@@ -4,16 +4,92 @@
 void Serializer::Init(uint16_t id)
 {
     writePosition = 0;
+    readPosition = 0;
     flashPosition = 0;
+    readPageLoaded = false;
+    crcActive = false;
+    pageQueue = NULL;
+    pageQueueCount = 0;
+    spill = true;
+    overflowed = false;
     ffs_open(GetFilesystem(), &writeFile, id);
     memset(data, 0, 256);
 }
+void Serializer::LoadReadPage(uint32_t page)
+{
+    if(readPageLoaded && readPage == page)
+        return;
+    if(page < writeFile.filesize)
+    {
+        ffs_seek(GetFilesystem(), &writeFile, page);
+        ffs_read(GetFilesystem(), &writeFile, data, 256);
+    }
+    else
+    {
+        memset(data, 0, 256);
+    }
+    readPage = page;
+    readPageLoaded = true;
+}
 uint8_t Serializer::GetNextValue()
 {
-    uint8_t res;
-    ffs_read(GetFilesystem(), &writeFile, &res, 1);
+    LoadReadPage(readPosition&~0xff);
+    return data[(readPosition++)&0xff];
+}
+bool Serializer::IsAtEnd()
+{
+    return readPosition >= writeFile.filesize;
+}
+uint32_t Serializer::RemainingBytes()
+{
+    return IsAtEnd()?0:writeFile.filesize-readPosition;
+}
+uint32_t Serializer::GetReadPosition()
+{
+    return readPosition;
+}
+uint32_t Serializer::GetWritePosition()
+{
+    return writeFile.filesize+pageQueueCount*256+writePosition;
+}
+void Serializer::SeekTo(uint32_t position)
+{
+    readPosition = position;
+}
+void Serializer::Skip(uint32_t length)
+{
+    readPosition += length;
+}
+void Serializer::SkipToNextPage()
+{
+    readPosition = (readPosition+255)&~0xff;
+}
+uint32_t Serializer::CalculateCrc(uint32_t start, uint32_t length, uint32_t crc)
+{
+    uint32_t res = crc;
+    while(length > 0)
+    {
+        LoadReadPage(start&~0xff);
+        uint32_t offset = start&0xff;
+        uint32_t chunk = (256-offset < length)?256-offset:length;
+        res = crc32_update(res, data+offset, chunk);
+        start += chunk;
+        length -= chunk;
+    }
     return res;
 }
+void Serializer::BeginCrc()
+{
+    crc = CRC32_INIT;
+    crcStart = writePosition;
+    crcActive = true;
+}
+uint32_t Serializer::EndCrc()
+{
+    crc = crc32_update(crc, data+crcStart, writePosition-crcStart);
+    crcActive = false;
+    return crc;
+}
 void Serializer::AddData(uint8_t val)
 {
     data[writePosition++] = val;
@@ -26,7 +102,12 @@ void Serializer::AddData(uint8_t val)
 
 void Serializer::Finish() 
 {
-    FlushToFlash();
+    // don't write an empty page if the data landed exactly on a page boundary
+    if(writePosition > 0)
+    {
+        writePosition = 0;
+        FlushToFlash();
+    }
 }
 
 void Serializer::Erase()
@@ -36,9 +117,86 @@ void Serializer::Erase()
 
 void Serializer::FlushToFlash()
 {
-    if(ffs_append(GetFilesystem(), &writeFile, data, 256) < 0)
+    if(crcActive)
+    {
+        // only called for full pages while the crc is running
+        crc = crc32_update(crc, data+crcStart, 256-crcStart);
+        crcStart = 0;
+    }
+    if(pageQueue)
+    {
+        if(pageQueueCount == pageQueueSize)
+        {
+            if(!spill)
+            {
+                overflowed = true;
+                memset(data, 0, 256);
+                return;
+            }
+            WriteQueuedPage();
+        }
+        memcpy(pageQueue[(pageQueueStart+pageQueueCount)%pageQueueSize], data, 256);
+        pageQueueCount++;
+    }
+    else if(ffs_append(GetFilesystem(), &writeFile, data, 256) < 0)
     {
         printf("flush to flash failed\n");
     }
     memset(data, 0, 256);
-}
\ No newline at end of file
+}
+void Serializer::SetPageQueue(uint8_t (*pages)[256], uint8_t count)
+{
+    pageQueue = pages;
+    pageQueueSize = count;
+    pageQueueStart = 0;
+    pageQueueCount = 0;
+}
+void Serializer::SetSpill(bool allowed)
+{
+    spill = allowed;
+}
+bool Serializer::Overflowed()
+{
+    return overflowed;
+}
+void Serializer::DropQueuedPages()
+{
+    pageQueueCount = 0;
+    writePosition = 0;
+    crcActive = false;
+    memset(data, 0, 256);
+}
+uint8_t Serializer::QueuedPages()
+{
+    return pageQueueCount;
+}
+void Serializer::WriteQueuedPage()
+{
+    if(pageQueueCount == 0)
+        return;
+    if(ffs_append(GetFilesystem(), &writeFile, pageQueue[pageQueueStart], 256) < 0)
+    {
+        printf("flush to flash failed\n");
+    }
+    pageQueueStart = (pageQueueStart+1)%pageQueueSize;
+    pageQueueCount--;
+}
+bool serialize_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    Serializer *s = (Serializer*) stream->state;
+    for (size_t i = 0; i < count; i++)
+    {
+        s->AddData(buf[i]);
+    }
+    return true;
+}
+
+bool deserialize_callback(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    Serializer *s = (Serializer*) stream->state;
+    for (size_t i = 0; i < count; i++)
+    {
+        buf[i] = s->GetNextValue();
+    }
+    return true;
+}
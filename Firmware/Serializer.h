@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include <string.h>
 #include "filesystem.h"
+#include "crc.h"
+#include <pb_encode.h>
+#include <pb_decode.h>
 
 class Serializer
 {
@@ -12,13 +15,55 @@ class Serializer
         void    AddData(uint8_t val);
         void    Finish();
         uint8_t GetNextValue();
+        bool    IsAtEnd();
+        uint32_t RemainingBytes();
+        uint32_t GetReadPosition();
+        // offset in the file of the next byte added
+        uint32_t GetWritePosition();
+        void    SeekTo(uint32_t position);
+        void    Skip(uint32_t length);
+        // moves the read position to the start of the next 256 byte page
+        void    SkipToNextPage();
+        // crc of data that is already in the file, doesn't move the read position
+        // pass in the result of the previous call to continue over the next range
+        uint32_t CalculateCrc(uint32_t start, uint32_t length, uint32_t crc = CRC32_INIT);
+        // running crc over everything added between BeginCrc and EndCrc
+        void    BeginCrc();
+        uint32_t EndCrc();
         void    Erase();
+        // with a page queue, full pages wait in ram until WriteQueuedPage puts them in flash
+        // if the queue overflows the oldest page is written straight away
+        void    SetPageQueue(uint8_t (*pages)[256], uint8_t count);
+        uint8_t QueuedPages();
+        void    WriteQueuedPage();
+        // with spilling off an overflowing page is dropped instead of going to flash, Overflowed says if that happened
+        void    SetSpill(bool allowed);
+        bool    Overflowed();
+        // forgets the queued pages and the partial one, nothing more goes to flash
+        void    DropQueuedPages();
         ffs_file writeFile;
     private:
         void    FlushToFlash();
+        void    LoadReadPage(uint32_t page);
         uint32_t writePosition;
         uint32_t readPosition;
         uint32_t flashPosition;
+        // reads go through data a page at a time, a serializer is either reading or writing
+        uint32_t readPage;
+        bool readPageLoaded;
+        uint32_t crc;
+        uint32_t crcStart;
+        bool crcActive;
+        uint8_t (*pageQueue)[256];
+        uint8_t pageQueueSize;
+        uint8_t pageQueueStart;
+        uint8_t pageQueueCount;
+        bool spill;
+        bool overflowed;
         uint8_t data[256];
         bool needsSectorErase;
-};
\ No newline at end of file
+};
+
+// nanopb stream callbacks, the stream state must point at a Serializer
+bool serialize_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count);
+bool deserialize_callback(pb_istream_t *stream, uint8_t *buf, size_t count);
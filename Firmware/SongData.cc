@@ -1,5 +1,7 @@
 #include "SongData.h"
-#include "m6x118pt7b.h"
+#include "UiDisplayList.h"
+
+void (*SongData::beforeWrite)(SongData *song) = NULL;
 
 SyncMode SongData::GetSyncOutMode(){
     uint8_t bareSyncMode = ((((uint16_t)internalData.syncOut)*6) >> 8);
@@ -93,6 +95,8 @@ uint8_t SongData::GetPlayingPattern()
 }
 void    SongData::SetPlayingPattern(uint8_t playingPattern)
 {
+    if(internalData.playingPattern != playingPattern)
+        MarkDirty();
     internalData.playingPattern = playingPattern;
 }
 
@@ -107,6 +111,8 @@ void SongData::StorePatternChain(int *patternChain)
 {
     for(int i=0;i<16;i++)
     {
+        if(internalData.patternChain[i] != patternChain[i])
+            MarkDirty();
         internalData.patternChain[i] = patternChain[i];
     }
 }
@@ -117,6 +123,8 @@ uint8_t SongData::GetPatternChainLength()
 }
 void    SongData::SetPatternChainLength(uint8_t patternChainLength)
 {
+    if(internalData.patternChainLength != patternChainLength)
+        MarkDirty();
     internalData.patternChainLength = patternChainLength;
 }
 
@@ -188,9 +196,9 @@ const char *scaleStrings[9] = {
 "Locr"
 };
 
-void SongData::DrawParamString(uint8_t param, uint8_t pattern, char *str, int8_t octave)
+void SongData::DrawParamString(uint8_t param, uint8_t pattern, char *str, int8_t octave, int16_t clockJitter)
 {
-    ssd1306_t* disp = GetDisplay();
+    UiDisplayList *ui = GetDisplayList();
     const uint8_t width = 36;
     const uint8_t column4 = 128-width;
     bool lockA = false, lockB = false;
@@ -209,7 +217,12 @@ void SongData::DrawParamString(uint8_t param, uint8_t pattern, char *str, int8_t
             break;
         case 19:
             sprintf(strA, "bpm");
-            if(GetSyncInMode()!=SyncModeNone)
+            if(GetSyncInMode()!=SyncModeNone && clockJitter >= 0)
+            {
+                sprintf(strA, "lock");
+                sprintf(pA, "%i.%ims", clockJitter/10, clockJitter%10);
+            }
+            else if(GetSyncInMode()!=SyncModeNone)
             {
                 sprintf(pA, "sync");
             }
@@ -247,11 +260,11 @@ void SongData::DrawParamString(uint8_t param, uint8_t pattern, char *str, int8_t
             break;
     }
     
-    ssd1306_draw_string_gfxfont(disp, column4+3, 12, str+32, true, 1, 1, &m6x118pt7b);
-    ssd1306_draw_string_gfxfont(disp, column4+3, 17+12, str+48, true, 1, 1, &m6x118pt7b);
+    ui->DrawString(column4+3, 12, str+32, true);
+    ui->DrawString(column4+3, 17+12, str+48, true);
     
-    ssd1306_draw_string_gfxfont(disp, column4-33, 12, str, true, 1, 1, &m6x118pt7b);    
-    ssd1306_draw_string_gfxfont(disp, column4-33, 17+12, str+16, true, 1, 1, &m6x118pt7b);
+    ui->DrawString(column4-33, 12, str, true);    
+    ui->DrawString(column4-33, 17+12, str+16, true);
 }
 
 void SongData::Serialize(pb_ostream_t *s)
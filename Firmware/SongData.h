@@ -26,6 +26,7 @@ class SongData
         }
         void InitDefaults()
         {
+            internalData = SongDataInternal_init_default;
             for (size_t i = 0; i < 16; i++)
             {
                 internalData.changeLength[i] = 15*4; // need to up this to fit into 0xff
@@ -39,6 +40,7 @@ class SongData
             internalData.delayFeedback  = 0x7f;
             internalData.delayTime      = 0x7f;
             internalData.hpVol          = 44;
+            dirty = true;
         }
         uint8_t GetLength(uint8_t pattern)
         {
@@ -72,14 +74,34 @@ class SongData
 
         SyncMode GetSyncOutMode();
         SyncMode GetSyncInMode();
-        void DrawParamString(uint8_t param, uint8_t pattern, char *str, int8_t octave);
+        // clockJitter is in tenths of a ms while the external clock is locked, -1 when it isn't
+        void DrawParamString(uint8_t param, uint8_t pattern, char *str, int8_t octave, int16_t clockJitter);
         uint8_t& GetParam(uint8_t param, uint8_t pattern);
 
         void Serialize(pb_ostream_t *s);
         void Deserialize(pb_istream_t *s);
 
+        // writes through GetParam need to mark the song as dirty themselves
+        void MarkDirty()
+        {
+            if(beforeWrite)
+                beforeWrite(this);
+            dirty = true;
+        }
+        bool IsDirty()
+        {
+            return dirty;
+        }
+        void ClearDirty()
+        {
+            dirty = false;
+        }
+        // called before the song is changed, lets a save that is in progress write out the old state first
+        static void (*beforeWrite)(SongData *song);
+
     private:
         SongDataInternal internalData;
+        bool dirty = true;
         uint8_t nothing; // used for returning a reference when we don't want it to do anything
 };
 
@@ -0,0 +1,802 @@
+#include "SongFile.h"
+
+void SongFile::Init(SongData *_songData, VoiceData *_voices)
+{
+    songData = _songData;
+    voices = _voices;
+    needsCompaction = false;
+    reclaimCount = 0;
+    saveState = SongSaveIdle;
+    SongData::beforeWrite = &BeforeSongWrite;
+    VoiceData::beforeWrite = &BeforeVoiceWrite;
+    VoiceData::beforePatternWrite = &BeforePatternWrite;
+    VoiceData::lockPool.beforeWrite = &BeforeLockWrite;
+    unloadedPatterns = 0;
+    preparing = false;
+}
+
+bool SongFile::NeedsSave()
+{
+    if(needsCompaction || songData->IsDirty() || VoiceData::lockPool.HasDirtyLocks())
+        return true;
+    for(int i=0;i<16;i++)
+    {
+        if(voices[i].IsDirty() || voices[i].HasDirtyPatterns())
+            return true;
+    }
+    return false;
+}
+
+bool SongFile::IsDirtyItem(uint16_t item)
+{
+    if(item == 0)
+        return songData->IsDirty();
+    if(item < SONG_SAVE_ITEM_PATTERN)
+        return voices[item-SONG_SAVE_ITEM_VOICE].IsDirty();
+    if(item < SONG_SAVE_ITEM_LOCKS)
+        return voices[(item-SONG_SAVE_ITEM_PATTERN)>>4].IsPatternDirty((item-SONG_SAVE_ITEM_PATTERN)&0xf);
+    return VoiceData::lockPool.HasDirtyLocks((item-SONG_SAVE_ITEM_LOCKS)*SONG_FILE_LOCKS_PER_RECORD, SONG_FILE_LOCKS_PER_RECORD);
+}
+
+void SongFile::WriteRecord(pb_ostream_t *s, uint8_t type, uint8_t index)
+{
+    uint8_t header[2] = {type, index};
+    pb_write(s, header, 2);
+}
+
+bool SongFile::BeginSave(uint16_t fileId, bool allowCompaction)
+{
+    if(saveState != SongSaveIdle)
+        return false;
+    // patterns that were never decoded would be written out empty
+    FinishLoading();
+    ffs_file file;
+    ffs_open(GetFilesystem(), &file, fileId);
+    bool compact = !file.initialized || needsCompaction || (allowCompaction && ffs_file_size(GetFilesystem(), &file) >= SONG_FILE_COMPACT_SIZE);
+    // old format files can't be appended to, wait for a save that is allowed to erase
+    if(compact && file.initialized && !allowCompaction)
+        return false;
+    if(!compact && !NeedsSave())
+        return false;
+    // full saves go into the other slot, the live file stays untouched until the new one is committed
+    saveFileId = fileId;
+    saveTargetId = fileId;
+    if(compact && file.initialized)
+    {
+        saveTargetId = fileId ^ SONG_SLOT_FLAG;
+        // anything still in there is from a save that was never committed
+        EraseNow(saveTargetId);
+    }
+    saveCompact = compact;
+    // everything that goes into this save, the hooks clear items as they get encoded
+    memset(pendingItems, 0, sizeof(pendingItems));
+    itemCount = 0;
+    for(uint16_t item=0;item<SONG_SAVE_ITEM_COUNT;item++)
+    {
+        if(compact || IsDirtyItem(item))
+        {
+            pendingItems[item>>5] |= 1<<(item&0x1f);
+            itemCount++;
+        }
+    }
+    nextItem = 0;
+    pendingItemCount = itemCount;
+    saveFreeLocks = VoiceData::lockPool.GetFreeLocks();
+    // from here on an edit doesn't count as needing a full save
+    needsCompaction = false;
+
+    saveSerializer.Init(saveTargetId);
+    saveSerializer.SetPageQueue(saveQueue, SONG_SAVE_QUEUE_PAGES);
+    segmentStart = saveSerializer.writeFile.filesize;
+    saveSerializer.BeginCrc();
+    activeSave = this;
+    saveState = SongSaveEncoding;
+    return true;
+}
+
+SongSaveResult SongFile::UpdateSave()
+{
+    switch(saveState)
+    {
+        case SongSaveIdle:
+            return SongSaveResultIdle;
+        case SongSaveEncoding:
+            if(pendingItemCount != 0)
+            {
+                if(saveSerializer.QueuedPages() <= SONG_SAVE_QUEUE_PAGES-SONG_SAVE_RECORD_PAGES-SONG_SAVE_HOOK_PAGES)
+                {
+                    // items go out in order, the hooks may already have taken some of them
+                    while(!IsPendingItem(nextItem))
+                        nextItem++;
+                    EncodeItem(nextItem);
+                }
+                else
+                {
+                    saveSerializer.WriteQueuedPage();
+                }
+                return SongSaveResultBusy;
+            }
+            FinishSegment();
+            return SongSaveResultBusy;
+        case SongSaveFlushing:
+            if(saveSerializer.QueuedPages() > 0)
+            {
+                saveSerializer.WriteQueuedPage();
+                return SongSaveResultBusy;
+            }
+            // read back what actually landed on flash
+            saveSerializer.Init(saveTargetId);
+            verifyPosition = segmentStart;
+            verifyCrc = CRC32_INIT;
+            saveState = SongSaveVerifying;
+            return SongSaveResultBusy;
+        case SongSaveVerifying:
+        {
+            uint32_t length = segmentStart+segmentLength-verifyPosition;
+            if(length > SONG_SAVE_VERIFY_PAGES*256)
+                length = SONG_SAVE_VERIFY_PAGES*256;
+            verifyCrc = saveSerializer.CalculateCrc(verifyPosition, length, verifyCrc);
+            verifyPosition += length;
+            if(verifyPosition < segmentStart+segmentLength)
+                return SongSaveResultBusy;
+            saveState = SongSaveIdle;
+            if(verifyCrc != segmentCrc)
+            {
+                printf("song file %x failed verification\n", saveTargetId);
+                // the segment gets skipped on load, so write everything into a fresh slot next time.
+                // a snapshot of a song that has been switched away from gets that when it's loaded again
+                if(loadedIndex->fileId == saveFileId)
+                    needsCompaction = true;
+                if(saveTargetId != saveFileId)
+                {
+                    Reclaim(saveTargetId);
+                }
+                savedFileId = saveFileId;
+                return SongSaveResultDone;
+            }
+            printf("saved song file %x %s, size %i\n", saveTargetId, saveCompact?"full":"incremental", saveSerializer.writeFile.filesize);
+            savedFileId = saveTargetId;
+            return SongSaveResultDone;
+        }
+    }
+    return SongSaveResultIdle;
+}
+
+bool SongFile::IsSaving()
+{
+    return saveState != SongSaveIdle;
+}
+
+uint8_t SongFile::GetSaveProgress()
+{
+    if(saveState == SongSaveIdle || itemCount == 0)
+        return 0;
+    // encoding is most of the work, then the last queued pages and the verify read
+    uint32_t progress = ((itemCount-pendingItemCount)*192)/itemCount;
+    if(saveState == SongSaveFlushing)
+        progress = 192+(SONG_SAVE_QUEUE_PAGES-saveSerializer.QueuedPages())*32/SONG_SAVE_QUEUE_PAGES;
+    else if(saveState == SongSaveVerifying)
+        progress = 224+(verifyPosition-segmentStart)*31/segmentLength;
+    return progress;
+}
+
+uint16_t SongFile::SavedFileId()
+{
+    return savedFileId;
+}
+
+uint16_t SongFile::Save(uint16_t fileId, bool allowCompaction)
+{
+    savedFileId = fileId;
+    if(!BeginSave(fileId, allowCompaction))
+        return fileId;
+    while(UpdateSave() == SongSaveResultBusy);
+    return savedFileId;
+}
+
+bool SongFile::SaveSnapshot(uint16_t fileId)
+{
+    if(saveState != SongSaveIdle)
+        return false;
+    bool wasCompacting = needsCompaction;
+    if(!BeginSave(fileId, false))
+        return !NeedsSave();
+    // measure first, nothing gets cleared unless all of it fits. voice records reset
+    // the count after their header, so every record gets its header added on top
+    uint32_t size = 6;
+    for(uint16_t item=0;item<SONG_SAVE_ITEM_COUNT;item++)
+    {
+        if(!IsPendingItem(item))
+            continue;
+        pb_ostream_t sizingStream = PB_OSTREAM_SIZING;
+        WriteItem(&sizingStream, item);
+        size += sizingStream.bytes_written+2;
+    }
+    if(size > SONG_SAVE_QUEUE_PAGES*256)
+    {
+        printf("song snapshot needs %i bytes, too big\n", size);
+        // nothing reached flash, so this is as if the save never started
+        saveSerializer.DropQueuedPages();
+        activeSave = NULL;
+        saveState = SongSaveIdle;
+        needsCompaction = wasCompacting;
+        return false;
+    }
+    saveSerializer.SetSpill(false);
+    while(pendingItemCount != 0)
+    {
+        while(!IsPendingItem(nextItem))
+            nextItem++;
+        EncodeItem(nextItem);
+    }
+    FinishSegment();
+    saveSerializer.SetSpill(true);
+    if(saveSerializer.Overflowed())
+    {
+        AbortSave();
+        return false;
+    }
+    return true;
+}
+
+bool SongFile::IsPendingItem(uint16_t item)
+{
+    return (pendingItems[item>>5]>>(item&0x1f))&1;
+}
+
+void SongFile::EncodeItem(uint16_t item)
+{
+    pb_ostream_t serializerStream = {&serialize_callback, &saveSerializer, SIZE_MAX, 0};
+    WriteItem(&serializerStream, item);
+    if(item == 0)
+    {
+        songData->ClearDirty();
+    }
+    else if(item < SONG_SAVE_ITEM_PATTERN)
+    {
+        voices[item-SONG_SAVE_ITEM_VOICE].ClearDirty();
+    }
+    else if(item < SONG_SAVE_ITEM_LOCKS)
+    {
+        uint8_t index = item-SONG_SAVE_ITEM_PATTERN;
+        voices[index>>4].ClearPatternDirty(index&0xf);
+    }
+    else
+    {
+        uint8_t chunk = item-SONG_SAVE_ITEM_LOCKS;
+        VoiceData::lockPool.ClearDirty(chunk*SONG_FILE_LOCKS_PER_RECORD, SONG_FILE_LOCKS_PER_RECORD);
+    }
+    pendingItems[item>>5] &= ~(1<<(item&0x1f));
+    pendingItemCount--;
+}
+
+void SongFile::WriteItem(pb_ostream_t *s, uint16_t item)
+{
+    if(item == 0)
+    {
+        WriteRecord(s, SongRecordSongData, 0);
+        songData->Serialize(s);
+    }
+    else if(item < SONG_SAVE_ITEM_PATTERN)
+    {
+        uint8_t voice = item-SONG_SAVE_ITEM_VOICE;
+        WriteRecord(s, SongRecordVoiceData, voice);
+        voices[voice].Serialize(s);
+    }
+    else if(item < SONG_SAVE_ITEM_LOCKS)
+    {
+        uint8_t index = item-SONG_SAVE_ITEM_PATTERN;
+        WriteRecord(s, SongRecordPattern, index);
+        voices[index>>4].SerializePattern(s, index&0xf);
+    }
+    else
+    {
+        uint8_t chunk = item-SONG_SAVE_ITEM_LOCKS;
+        WriteRecord(s, SongRecordLockPool, chunk);
+        VoiceData::lockPool.Serialize(s, saveFreeLocks, chunk*SONG_FILE_LOCKS_PER_RECORD, SONG_FILE_LOCKS_PER_RECORD, !saveCompact);
+    }
+}
+
+// the commit record closes the segment, after this the save only writes out the queue
+void SongFile::FinishSegment()
+{
+    pb_ostream_t serializerStream = {&serialize_callback, &saveSerializer, SIZE_MAX, 0};
+    WriteRecord(&serializerStream, SongRecordCommit, 0);
+    segmentLength = saveSerializer.GetWritePosition()-segmentStart;
+    segmentCrc = saveSerializer.EndCrc();
+    uint8_t crcBytes[4] = {(uint8_t)segmentCrc, (uint8_t)(segmentCrc>>8), (uint8_t)(segmentCrc>>16), (uint8_t)(segmentCrc>>24)};
+    pb_write(&serializerStream, crcBytes, 4);
+    saveSerializer.Finish();
+    activeSave = NULL;
+    saveState = SongSaveFlushing;
+}
+
+// a hook never writes to flash, a record that doesn't fit in the queue ends the save instead
+void SongFile::EncodeBeforeWrite(uint16_t item)
+{
+    saveSerializer.SetSpill(false);
+    EncodeItem(item);
+    saveSerializer.SetSpill(true);
+    if(saveSerializer.Overflowed())
+        AbortSave();
+}
+
+void SongFile::AbortSave()
+{
+    printf("song save queue overflowed, the next save writes the whole song\n");
+    saveSerializer.DropQueuedPages();
+    activeSave = NULL;
+    saveState = SongSaveIdle;
+    // the records that did get encoded were cleared, so all of it has to go into the next save
+    needsCompaction = true;
+}
+
+SongFile *SongFile::activeSave = NULL;
+uint32_t SongFile::editCount = 0;
+SongFile *SongFile::loadingFile = NULL;
+
+// the edit paths call these before changing anything, so a record that is part of
+// the running save gets encoded with the state from before the edit
+void SongFile::BeforeSongWrite(SongData *song)
+{
+    editCount++;
+    if(activeSave && activeSave->IsPendingItem(0))
+        activeSave->EncodeBeforeWrite(0);
+}
+
+void SongFile::BeforeVoiceWrite(VoiceData *voice)
+{
+    editCount++;
+    if(!activeSave)
+        return;
+    int index = voice-activeSave->voices;
+    if(index < 0 || index >= 16)
+        return;
+    if(activeSave->IsPendingItem(SONG_SAVE_ITEM_VOICE+index))
+        activeSave->EncodeBeforeWrite(SONG_SAVE_ITEM_VOICE+index);
+}
+
+void SongFile::BeforePatternWrite(VoiceData *voice, uint8_t pattern)
+{
+    editCount++;
+    // the rest of the pattern has to be there before part of it gets edited
+    if(loadingFile)
+        loadingFile->LoadPattern(pattern);
+    if(!activeSave)
+        return;
+    int index = voice-activeSave->voices;
+    if(index < 0 || index >= 16)
+        return;
+    uint16_t item = SONG_SAVE_ITEM_PATTERN+index*16+pattern;
+    if(activeSave->IsPendingItem(item))
+        activeSave->EncodeBeforeWrite(item);
+}
+
+void SongFile::BeforeLockWrite(uint16_t position)
+{
+    editCount++;
+    if(!activeSave)
+        return;
+    uint16_t item = SONG_SAVE_ITEM_LOCKS+position/SONG_FILE_LOCKS_PER_RECORD;
+    if(activeSave->IsPendingItem(item))
+        activeSave->EncodeBeforeWrite(item);
+}
+
+bool SongFile::ScanSegment(Serializer *s, pb_istream_t *stream)
+{
+    uint32_t segmentStart = s->GetReadPosition();
+    while(s->RemainingBytes() >= 2)
+    {
+        uint8_t type = s->GetNextValue();
+        s->GetNextValue();
+        if(type == SongRecordCommit)
+        {
+            uint32_t length = s->GetReadPosition()-segmentStart;
+            if(s->RemainingBytes() < 4)
+                return false;
+            uint32_t storedCrc = 0;
+            for(int i=0;i<4;i++)
+            {
+                storedCrc |= s->GetNextValue()<<(i*8);
+            }
+            return s->CalculateCrc(segmentStart, length) == storedCrc;
+        }
+        if(type != SongRecordSongData && type != SongRecordVoiceData && type != SongRecordLockPool && type != SongRecordPattern)
+            return false;
+        // skip over the message without decoding it
+        stream->bytes_left = s->RemainingBytes();
+        uint32_t length;
+        if(!pb_decode_varint32(stream, &length) || length > s->RemainingBytes())
+            return false;
+        s->Skip(length);
+    }
+    return false;
+}
+
+bool SongFile::Load(uint16_t fileId, bool verify)
+{
+    BeginIndex(loadedIndex, fileId, verify);
+    if(!loadedIndex->exists)
+        return false;
+    while(UpdateIndex(loadedIndex));
+    ApplyIndex(loadedIndex);
+    printf("loaded filesize %i\n", loadedIndex->serializer.writeFile.filesize);
+    return true;
+}
+
+void SongFile::Prepare(uint16_t fileId)
+{
+    BeginIndex(preparedIndex, fileId, true);
+    preparing = true;
+}
+
+bool SongFile::UpdatePrepare()
+{
+    if(!preparing)
+        return false;
+    return UpdateIndex(preparedIndex);
+}
+
+bool SongFile::IsPrepared()
+{
+    return preparing && !preparedIndex->scanning;
+}
+
+void SongFile::CancelPrepare()
+{
+    preparing = false;
+}
+
+bool SongFile::SwitchToPrepared()
+{
+    if(!IsPrepared() || saveState == SongSaveEncoding)
+        return false;
+    preparing = false;
+    editCount++;
+    SongIndex *index = preparedIndex;
+    preparedIndex = loadedIndex;
+    loadedIndex = index;
+    // nothing of the old song can be left over, the new one might not have a record for everything
+    songData->InitDefaults();
+    for(int i=0;i<16;i++)
+    {
+        voices[i].Reset();
+    }
+    VoiceData::lockPool.Init();
+    if(!loadedIndex->exists)
+    {
+        // a new song, it stays dirty so the first save writes all of it
+        unloadedPatterns = 0;
+        needsCompaction = false;
+        return true;
+    }
+    ApplyIndex(loadedIndex);
+    return true;
+}
+
+void SongFile::BeginIndex(SongIndex *index, uint16_t fileId, bool verify)
+{
+    index->fileId = fileId;
+    index->verify = verify;
+    index->needsCompaction = false;
+    index->hasPatternRecords = false;
+    index->indexedLength = 0;
+    index->songOffset = 0;
+    memset(index->voiceOffsets, 0, sizeof(index->voiceOffsets));
+    index->lockRecordCount = 0;
+    index->lockOverflow = false;
+    memset(index->patternOffsets, 0, sizeof(index->patternOffsets));
+    index->serializer.Init(fileId);
+    index->exists = index->serializer.writeFile.initialized;
+    index->scanning = index->exists;
+}
+
+bool SongFile::UpdateIndex(SongIndex *index)
+{
+    if(!index->scanning)
+        return false;
+    Serializer &s = index->serializer;
+    pb_istream_t serializerStream = {&deserialize_callback, &s, SIZE_MAX};
+    if(index->verify && !s.IsAtEnd())
+    {
+        uint32_t segmentStart = s.GetReadPosition();
+        if(!ScanSegment(&s, &serializerStream))
+        {
+            // most likely a save that lost power, everything before it is still good
+            printf("song file segment at %i failed verification\n", segmentStart);
+            index->needsCompaction = true;
+            index->scanning = false;
+            return false;
+        }
+        s.SeekTo(segmentStart);
+    }
+    // one segment, or the whole file when it doesn't have commit records
+    while(!s.IsAtEnd())
+    {
+        uint8_t type = s.GetNextValue();
+        if(type == SongRecordPadding)
+        {
+            s.SkipToNextPage();
+            continue;
+        }
+        uint8_t recordIndex = s.GetNextValue();
+        if(type == SongRecordCommit)
+        {
+            // skip the crc, the next segment starts on a fresh page
+            s.Skip(4);
+            s.SkipToNextPage();
+            index->indexedLength = s.GetReadPosition();
+            if(index->verify)
+                break;
+            continue;
+        }
+        // keep a corrupt length from reading past the end of the file
+        serializerStream.bytes_left = s.RemainingBytes();
+        uint32_t offset = s.GetReadPosition();
+        uint32_t length;
+        if(!pb_decode_varint32(&serializerStream, &length) || length > s.RemainingBytes() || !IndexRecord(index, type, recordIndex, offset))
+        {
+            // can't find the next record boundary, keep what we have and rewrite the file on the next save
+            printf("unknown song record type %i index %i\n", type, recordIndex);
+            index->needsCompaction = true;
+            index->scanning = false;
+            return false;
+        }
+        s.Skip(length);
+    }
+    if(s.IsAtEnd())
+    {
+        index->indexedLength = s.GetReadPosition();
+        index->scanning = false;
+    }
+    return index->scanning;
+}
+
+bool SongFile::IndexRecord(SongIndex *index, uint8_t type, uint8_t recordIndex, uint32_t offset)
+{
+    switch(type)
+    {
+        case SongRecordSongData:
+            index->songOffset = offset;
+            return true;
+        case SongRecordVoiceData:
+            if(recordIndex >= 16)
+                return false;
+            index->voiceOffsets[recordIndex] = offset;
+            return true;
+        case SongRecordPattern:
+            index->patternOffsets[recordIndex] = offset;
+            index->hasPatternRecords = true;
+            return true;
+        case SongRecordLockPool:
+            if(index->lockRecordCount < SONG_INDEX_LOCK_RECORDS)
+                index->lockOffsets[index->lockRecordCount++] = offset;
+            else
+                index->lockOverflow = true;
+            return true;
+    }
+    return false;
+}
+
+void SongFile::ApplyIndex(SongIndex *index)
+{
+    editCount++;
+    Serializer &s = index->serializer;
+    pb_istream_t serializerStream = {&deserialize_callback, &s, SIZE_MAX};
+    // song and voice records hold everything, so only the newest one counts
+    if(index->songOffset)
+    {
+        s.SeekTo(index->songOffset);
+        serializerStream.bytes_left = s.RemainingBytes();
+        songData->Deserialize(&serializerStream);
+    }
+    for(int i=0;i<16;i++)
+    {
+        if(!index->voiceOffsets[i])
+            continue;
+        s.SeekTo(index->voiceOffsets[i]);
+        serializerStream.bytes_left = s.RemainingBytes();
+        voices[i].Deserialize(&serializerStream);
+    }
+    if(index->lockOverflow)
+    {
+        ReplayLockRecords(index);
+    }
+    else
+    {
+        for(int i=0;i<index->lockRecordCount;i++)
+        {
+            s.SeekTo(index->lockOffsets[i]);
+            serializerStream.bytes_left = s.RemainingBytes();
+            VoiceData::lockPool.Deserialize(&serializerStream);
+        }
+    }
+    unloadedPatterns = 0;
+    for(int i=0;i<16*16;i++)
+    {
+        if(index->patternOffsets[i])
+            unloadedPatterns |= 1<<(i&0xf);
+    }
+    loadingFile = this;
+    // files without commit records get rewritten in the current format on the next save
+    needsCompaction = index->needsCompaction || !index->verify;
+    ClearDirty();
+    VoiceData::lockPool.ExtendLegacyPool();
+    // after ClearDirty, locks that get relinked by the sort have to be saved
+    for(int i=0;i<16;i++)
+    {
+        voices[i].RebuildLockIndex();
+    }
+    if(!index->hasPatternRecords)
+    {
+        // the patterns are still inside the voice records, newer voice records
+        // won't have them, so give every pattern its own record on the next save
+        for(int i=0;i<16;i++)
+        {
+            for(int p=0;p<16;p++)
+            {
+                voices[i].MarkPatternDirty(p);
+            }
+        }
+    }
+}
+
+void SongFile::ReplayLockRecords(SongIndex *index)
+{
+    Serializer &s = index->serializer;
+    pb_istream_t serializerStream = {&deserialize_callback, &s, SIZE_MAX};
+    s.SeekTo(0);
+    // the index already checked everything up to here
+    while(s.GetReadPosition() < index->indexedLength)
+    {
+        uint8_t type = s.GetNextValue();
+        if(type == SongRecordPadding)
+        {
+            s.SkipToNextPage();
+            continue;
+        }
+        s.GetNextValue();
+        if(type == SongRecordCommit)
+        {
+            s.Skip(4);
+            s.SkipToNextPage();
+            continue;
+        }
+        serializerStream.bytes_left = s.RemainingBytes();
+        if(type == SongRecordLockPool)
+        {
+            VoiceData::lockPool.Deserialize(&serializerStream);
+            continue;
+        }
+        uint32_t length;
+        pb_decode_varint32(&serializerStream, &length);
+        s.Skip(length);
+    }
+}
+
+void SongFile::LoadPattern(uint8_t pattern)
+{
+    if(!((unloadedPatterns>>pattern)&1))
+        return;
+    editCount++;
+    Serializer &s = loadedIndex->serializer;
+    pb_istream_t serializerStream = {&deserialize_callback, &s, SIZE_MAX};
+    for(int v=0;v<16;v++)
+    {
+        uint32_t offset = loadedIndex->patternOffsets[v*16+pattern];
+        // a pattern that was edited before it got loaded is newer than the file
+        if(offset == 0 || voices[v].IsPatternDirty(pattern))
+            continue;
+        s.SeekTo(offset);
+        serializerStream.bytes_left = s.RemainingBytes();
+        voices[v].DeserializePattern(&serializerStream, pattern);
+    }
+    unloadedPatterns &= ~(1<<pattern);
+}
+
+bool SongFile::UpdateLoad()
+{
+    if(unloadedPatterns == 0)
+        return false;
+    uint8_t pattern = 0;
+    while(!((unloadedPatterns>>pattern)&1))
+        pattern++;
+    LoadPattern(pattern);
+    return unloadedPatterns != 0;
+}
+
+void SongFile::FinishLoading()
+{
+    while(UpdateLoad());
+}
+
+bool SongFile::LoadLegacy(uint16_t fileId)
+{
+    unloadedPatterns = 0;
+    Serializer s;
+    s.Init(fileId);
+    if(!s.writeFile.initialized)
+        return false;
+    pb_istream_t serializerStream = {&deserialize_callback, &s, SIZE_MAX};
+    editCount++;
+    songData->Deserialize(&serializerStream);
+    for(int i=0;i<16;i++)
+    {
+        voices[i].Deserialize(&serializerStream);
+    }
+    VoiceData::lockPool.Deserialize(&serializerStream);
+    ClearDirty();
+    VoiceData::lockPool.ExtendLegacyPool();
+    for(int i=0;i<16;i++)
+    {
+        voices[i].RebuildLockIndex();
+    }
+    // convert to the record format on the next save
+    needsCompaction = true;
+    printf("loaded legacy filesize %i\n", s.writeFile.filesize);
+    return true;
+}
+
+void SongFile::ClearDirty()
+{
+    songData->ClearDirty();
+    for(int i=0;i<16;i++)
+    {
+        voices[i].ClearDirty();
+        for(int p=0;p<16;p++)
+        {
+            voices[i].ClearPatternDirty(p);
+        }
+    }
+    VoiceData::lockPool.ClearDirty();
+}
+
+void SongFile::Reclaim(uint16_t fileId)
+{
+    if(IsReclaiming(fileId))
+        return;
+    // this gets called while playing, so never erase here. a slot that doesn't fit
+    // gets reclaimed on the next boot or erased before a full save reuses it
+    if(reclaimCount == SONG_RECLAIM_FILES)
+    {
+        printf("reclaim queue full, file %x stays for now\n", fileId);
+        return;
+    }
+    reclaimFileIds[reclaimCount++] = fileId;
+}
+
+bool SongFile::UpdateReclaim()
+{
+    if(reclaimCount == 0)
+        return false;
+    if(!ffs_erase_step(GetFilesystem(), reclaimFileIds[0]))
+    {
+        reclaimCount--;
+        memmove(reclaimFileIds, reclaimFileIds+1, reclaimCount*sizeof(reclaimFileIds[0]));
+    }
+    return reclaimCount > 0;
+}
+
+bool SongFile::IsReclaiming(uint16_t fileId)
+{
+    for(int i=0;i<reclaimCount;i++)
+    {
+        if(reclaimFileIds[i] == fileId)
+            return true;
+    }
+    return false;
+}
+
+void SongFile::EraseNow(uint16_t fileId)
+{
+    while(ffs_erase_step(GetFilesystem(), fileId));
+    for(int i=0;i<reclaimCount;i++)
+    {
+        if(reclaimFileIds[i] == fileId)
+        {
+            reclaimCount--;
+            memmove(reclaimFileIds+i, reclaimFileIds+i+1, (reclaimCount-i)*sizeof(reclaimFileIds[0]));
+            break;
+        }
+    }
+}
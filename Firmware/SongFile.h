@@ -0,0 +1,242 @@
+#ifndef SONG_FILE_H_
+#define SONG_FILE_H_
+
+#include <stdio.h>
+#include <string.h>
+#include "filesystem.h"
+#include "Serializer.h"
+#include "SongData.h"
+#include "voice_data.h"
+
+/*
+
+song file layout
+----------------
+the song file is an append only log of records, so saving only needs to write
+the parts of the song that changed since the last save. each record is
+
+    type (1 byte) | index (1 byte) | length delimited protobuf message
+
+a type of zero means the rest of the page is padding (Serializer::Finish fills
+the tail of the last page with zeros). records are replayed in order on load,
+later records replace earlier ones. lock pool records only contain the locks
+that changed, the lock index is part of the message.
+
+every save is a segment that starts on a page boundary and ends with a commit
+record followed by a little endian crc32 of the segment up to and including the
+commit header. segments are only applied once their crc checks out, so a save
+that was cut off by power loss is ignored and the song loads as it was before.
+
+voice records leave out the patterns, each pattern is its own record with an
+index of voice*16+pattern. the lock pool is split into records of
+SONG_FILE_LOCKS_PER_RECORD locks, the index of a lock pool record is the chunk
+number.
+
+loading happens in two steps. indexing checks the segment crcs and remembers
+where the newest song, voice and pattern records are, and where every lock pool
+record is (lock records only hold the locks that changed, so all of them get
+replayed). applying the index then decodes the song, voice and lock pool
+records. patterns are decoded by LoadPattern when they are first needed and by
+UpdateLoad in the background.
+
+Prepare indexes another song a segment at a time while the current one keeps
+playing, so SwitchToPrepared only has to decode a few small records.
+
+saves run in the background: UpdateSave encodes one record into a queue of ram
+pages or moves one page into flash per call, so it can run between audio blocks.
+the save is a snapshot of the song at BeginSave. anything that is edited before
+its record has been encoded gets encoded right away by the beforeWrite hooks, so
+the record still holds the old state and the edit goes into the next save. the
+hooks run from the edit paths, some of them inside the audio render, so they only
+ever encode into the ram queue. the save steps leave SONG_SAVE_HOOK_PAGES free
+for them, and if a hook's record still doesn't fit the save is given up. its
+segment never gets a commit record, so loading skips it, and the next save writes
+the whole song into the other slot.
+
+once the log grows past SONG_FILE_COMPACT_SIZE the next save writes the whole
+song into the other slot (fileId ^ SONG_SLOT_FLAG). the new slot only becomes
+live once GlobalData points at it, and the old slot is erased in the
+background afterwards, so the live copy is never erased before its
+replacement is on flash.
+
+*/
+
+#define SONG_FILE_COMPACT_SIZE (128*1024)
+#define SONG_SLOT_FLAG 0x1000
+#define SONG_FILE_LOCKS_PER_RECORD 128
+#define SONG_FILE_LOCK_RECORDS (LOCKCOUNT/SONG_FILE_LOCKS_PER_RECORD)
+// song data, 16 voices, 16x16 patterns and the lock pool chunks, in the order they are written
+#define SONG_SAVE_ITEM_VOICE 1
+#define SONG_SAVE_ITEM_PATTERN 17
+#define SONG_SAVE_ITEM_LOCKS (SONG_SAVE_ITEM_PATTERN+16*16)
+#define SONG_SAVE_ITEM_COUNT (SONG_SAVE_ITEM_LOCKS+SONG_FILE_LOCK_RECORDS)
+#define SONG_SAVE_QUEUE_PAGES 16
+// a new record is only started when this many pages are free, so the queue doesn't have to spill
+// a full lock record is ~2k, voices are smaller
+#define SONG_SAVE_RECORD_PAGES 9
+// room left after a save step for the hooks, a song, voice or pattern record
+#define SONG_SAVE_HOOK_PAGES 3
+// pages read back per UpdateSave while verifying
+#define SONG_SAVE_VERIFY_PAGES 16
+// files waiting to be erased by UpdateReclaim
+#define SONG_RECLAIM_FILES 4
+// songs with more lock records than this replay them with a scan over the whole file
+#define SONG_INDEX_LOCK_RECORDS (SONG_FILE_LOCK_RECORDS*2)
+
+enum SongRecordType
+{
+    SongRecordPadding   = 0,
+    SongRecordSongData  = 1,
+    SongRecordVoiceData = 2,
+    SongRecordLockPool  = 3,
+    SongRecordCommit    = 4,
+    SongRecordPattern   = 5,
+};
+
+enum SongSaveState
+{
+    SongSaveIdle,
+    SongSaveEncoding,
+    SongSaveFlushing,
+    SongSaveVerifying,
+};
+
+enum SongSaveResult
+{
+    SongSaveResultIdle,
+    SongSaveResultBusy,
+    // the save has finished, SavedFileId has the file that holds the song now
+    SongSaveResultDone,
+};
+
+// where the records of a song file are, offsets of 0 mean there is no record
+struct SongIndex
+{
+    Serializer serializer;
+    uint16_t fileId;
+    bool exists;
+    bool verify;
+    bool scanning;
+    bool needsCompaction;
+    bool hasPatternRecords;
+    // everything before this has been checked and indexed
+    uint32_t indexedLength;
+    uint32_t songOffset;
+    uint32_t voiceOffsets[16];
+    uint32_t lockOffsets[SONG_INDEX_LOCK_RECORDS];
+    uint8_t lockRecordCount;
+    bool lockOverflow;
+    // voice*16+pattern
+    uint32_t patternOffsets[16*16];
+};
+
+class SongFile
+{
+    public:
+        void Init(SongData *_songData, VoiceData *_voices);
+        bool NeedsSave();
+        // allowCompaction = false only appends, so it never has to erase flash
+        // returns false if there was nothing to save
+        bool BeginSave(uint16_t fileId, bool allowCompaction);
+        SongSaveResult UpdateSave();
+        bool IsSaving();
+        // 0-255
+        uint8_t GetSaveProgress();
+        // when this differs from the id passed to BeginSave the caller has to
+        // commit the new id and then Reclaim the old one
+        uint16_t SavedFileId();
+        // blocking version of the above, returns SavedFileId
+        uint16_t Save(uint16_t fileId, bool allowCompaction);
+        // encodes everything that changed into the ram queue in one go, so the song can be
+        // swapped out straight away while UpdateSave writes the queue out. returns false and
+        // leaves the song untouched if the changes don't fit, true if there was nothing to save
+        bool SaveSnapshot(uint16_t fileId);
+        // verify = false for files written before segments had commit records
+        bool Load(uint16_t fileId, bool verify);
+        // songs written before the record log was added
+        bool LoadLegacy(uint16_t fileId);
+        // indexes another song file a segment at a time, so it can be switched to
+        // without a stall. a file that doesn't exist prepares an empty song
+        void Prepare(uint16_t fileId);
+        // returns true while the prepared file is still being indexed
+        bool UpdatePrepare();
+        bool IsPrepared();
+        void CancelPrepare();
+        // replaces the loaded song with the prepared one, the loaded song needs to be saved
+        // first. a save that is done encoding doesn't read the song anymore, so it can still be running
+        bool SwitchToPrepared();
+        // decodes this pattern for every voice if it hasn't been yet
+        void LoadPattern(uint8_t pattern);
+        // decodes one more pattern, returns true while there are patterns left
+        bool UpdateLoad();
+        void FinishLoading();
+        // goes up with every edit hook and every load, the ui compares it to tell
+        // if the song data it shows might be different
+        static uint32_t GetEditCount() { return editCount; }
+        // schedule a file to be erased by UpdateReclaim, never erases anything itself
+        void Reclaim(uint16_t fileId);
+        // erases one flash block of the oldest reclaimed file, returns true while there is work left
+        bool UpdateReclaim();
+        // true until every block of this file is gone
+        bool IsReclaiming(uint16_t fileId);
+    private:
+        static void BeforeSongWrite(SongData *song);
+        static void BeforeVoiceWrite(VoiceData *voice);
+        static void BeforePatternWrite(VoiceData *voice, uint8_t pattern);
+        static void BeforeLockWrite(uint16_t position);
+        void EncodeBeforeWrite(uint16_t item);
+        void AbortSave();
+        static SongFile *activeSave;
+        static uint32_t editCount;
+        // the file that still has patterns to decode
+        static SongFile *loadingFile;
+        void EncodeItem(uint16_t item);
+        void WriteItem(pb_ostream_t *s, uint16_t item);
+        void FinishSegment();
+        bool IsPendingItem(uint16_t item);
+        bool IsDirtyItem(uint16_t item);
+        void WriteRecord(pb_ostream_t *s, uint8_t type, uint8_t index);
+        bool ScanSegment(Serializer *s, pb_istream_t *stream);
+        void BeginIndex(SongIndex *index, uint16_t fileId, bool verify);
+        // indexes one segment, returns true while there is more to do
+        bool UpdateIndex(SongIndex *index);
+        bool IndexRecord(SongIndex *index, uint8_t type, uint8_t recordIndex, uint32_t offset);
+        void ApplyIndex(SongIndex *index);
+        void ReplayLockRecords(SongIndex *index);
+        void EraseNow(uint16_t fileId);
+        void ClearDirty();
+        SongData *songData;
+        VoiceData *voices;
+        bool needsCompaction = false;
+        uint16_t reclaimFileIds[SONG_RECLAIM_FILES];
+        uint8_t reclaimCount = 0;
+
+        // background save
+        SongSaveState saveState = SongSaveIdle;
+        Serializer saveSerializer;
+        uint8_t saveQueue[SONG_SAVE_QUEUE_PAGES][256];
+        uint32_t pendingItems[(SONG_SAVE_ITEM_COUNT+31)/32];
+        uint16_t nextItem;
+        uint16_t pendingItemCount;
+        uint16_t itemCount;
+        bool saveCompact;
+        uint16_t saveFileId;
+        uint16_t saveTargetId;
+        uint16_t savedFileId;
+        uint16_t saveFreeLocks;
+        uint32_t segmentStart;
+        uint32_t segmentLength;
+        uint32_t segmentCrc;
+        uint32_t verifyPosition;
+        uint32_t verifyCrc;
+
+        // the loaded song, its patterns are decoded lazily
+        SongIndex indexes[2];
+        SongIndex *loadedIndex = &indexes[0];
+        uint16_t unloadedPatterns = 0;
+        // the song to switch to next
+        SongIndex *preparedIndex = &indexes[1];
+        bool preparing = false;
+};
+
+#endif // SONG_FILE_H_
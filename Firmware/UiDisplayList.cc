@@ -0,0 +1,241 @@
+#include "UiDisplayList.h"
+#include "m6x118pt7b.h"
+
+UiDisplayList displayList;
+
+UiDisplayList* GetDisplayList()
+{
+    return &displayList;
+}
+
+void UiDisplayList::Begin()
+{
+    opCount[current] = 0;
+    currentWidget = UiWidgetMessage;
+    // a widget that wasn't drawn last frame has nothing to reuse
+    inputsValid &= keyedWidgets;
+    keyedWidgets = 0;
+}
+
+bool UiDisplayList::Reuse(UiWidget widget, const uint32_t *inputs, uint8_t count)
+{
+    currentWidget = widget;
+    keyedWidgets |= 1<<widget;
+    if(count > UI_WIDGET_INPUTS)
+        count = UI_WIDGET_INPUTS;
+    if((inputsValid>>widget)&1 && widgetInputCount[widget] == count && memcmp(widgetInputs[widget], inputs, count*sizeof(uint32_t)) == 0)
+    {
+        // whether the last frame was drawn or skipped, the other list has what it showed
+        uint8_t last = current^1;
+        for(uint8_t i=0;i<opCount[last] && opCount[current] < UI_MAX_OPS;i++)
+        {
+            if(ops[last][i].widget == widget)
+                ops[current][opCount[current]++] = ops[last][i];
+        }
+        reusedWidgets++;
+        return true;
+    }
+    memcpy(widgetInputs[widget], inputs, count*sizeof(uint32_t));
+    widgetInputCount[widget] = count;
+    inputsValid |= 1<<widget;
+    return false;
+}
+
+UiOp* UiDisplayList::Add(UiOpType type, int16_t x, int16_t y, int16_t w, int16_t h)
+{
+    if(opCount[current] >= UI_MAX_OPS)
+    {
+        printf("ui display list full\n");
+        return NULL;
+    }
+    UiOp *op = &ops[current][opCount[current]++];
+    // the whole op gets compared, so the unused text has to be the same every time
+    memset(op, 0, sizeof(UiOp));
+    op->type = type;
+    op->widget = currentWidget;
+    op->x = x;
+    op->y = y;
+    op->w = w;
+    op->h = h;
+    return op;
+}
+
+void UiDisplayList::DrawString(int16_t x, int16_t y, const char *str, bool white)
+{
+    UiOp *op = Add(UiOpString, x, y, 0, 0);
+    if(op == NULL)
+        return;
+    op->white = white;
+    strncpy(op->text, str, UI_TEXT_LENGTH-1);
+}
+
+void UiDisplayList::DrawSmallString(int16_t x, int16_t y, const char *str)
+{
+    UiOp *op = Add(UiOpSmallString, x, y, 0, 0);
+    if(op == NULL)
+        return;
+    strncpy(op->text, str, UI_TEXT_LENGTH-1);
+}
+
+void UiDisplayList::DrawSquare(int16_t x, int16_t y, int16_t w, int16_t h)
+{
+    Add(UiOpSquare, x, y, w, h);
+}
+
+void UiDisplayList::DrawSquareRounded(int16_t x, int16_t y, int16_t w, int16_t h)
+{
+    Add(UiOpSquareRounded, x, y, w, h);
+}
+
+void UiDisplayList::ClearSquare(int16_t x, int16_t y, int16_t w, int16_t h)
+{
+    Add(UiOpClearSquare, x, y, w, h);
+}
+
+void UiDisplayList::ClearSquareRounded(int16_t x, int16_t y, int16_t w, int16_t h)
+{
+    Add(UiOpClearSquareRounded, x, y, w, h);
+}
+
+void UiDisplayList::DrawLine(int16_t x1, int16_t y1, int16_t x2, int16_t y2)
+{
+    Add(UiOpLine, x1, y1, x2, y2);
+}
+
+void UiDisplayList::Play(ssd1306_t *p, const UiOp &op)
+{
+    switch(op.type)
+    {
+        case UiOpString:
+            ssd1306_draw_string_gfxfont(p, op.x, op.y, op.text, op.white, 1, 1, &m6x118pt7b);
+            break;
+        case UiOpSmallString:
+            ssd1306_set_string_color(p, false);
+            ssd1306_draw_string(p, op.x, op.y, 1, op.text);
+            break;
+        case UiOpSquare:
+            ssd1306_draw_square(p, op.x, op.y, op.w, op.h);
+            break;
+        case UiOpSquareRounded:
+            ssd1306_draw_square_rounded(p, op.x, op.y, op.w, op.h);
+            break;
+        case UiOpClearSquare:
+            ssd1306_clear_square(p, op.x, op.y, op.w, op.h);
+            break;
+        case UiOpClearSquareRounded:
+            ssd1306_clear_square_rounded(p, op.x, op.y, op.w, op.h);
+            break;
+        case UiOpLine:
+            ssd1306_draw_line(p, op.x, op.y, op.w, op.h);
+            break;
+    }
+}
+
+void UiDisplayList::GetBounds(const UiOp &op, int16_t &x0, int16_t &y0, int16_t &x1, int16_t &y1)
+{
+    switch(op.type)
+    {
+        case UiOpString:
+        {
+            // m6x11 glyphs stay inside their advance, 10 above the baseline and 4 below
+            int16_t width = 0;
+            for(const char *c=op.text;*c;c++)
+            {
+                if(*c >= m6x118pt7b.first && *c <= m6x118pt7b.last)
+                    width += m6x118pt7b.glyph[*c-m6x118pt7b.first].xAdvance;
+            }
+            x0 = op.x;
+            y0 = op.y-10;
+            x1 = op.x+width;
+            y1 = op.y+4;
+            break;
+        }
+        case UiOpSmallString:
+            // 5x8 glyphs, 8 apart
+            x0 = op.x;
+            y0 = op.y;
+            x1 = op.x+strlen(op.text)*8;
+            y1 = op.y+8;
+            break;
+        case UiOpLine:
+            x0 = op.x < op.w ? op.x : op.w;
+            y0 = op.y < op.h ? op.y : op.h;
+            x1 = (op.x < op.w ? op.w : op.x)+1;
+            y1 = (op.y < op.h ? op.h : op.y)+1;
+            break;
+        default:
+            x0 = op.x;
+            y0 = op.y;
+            x1 = op.x+op.w;
+            y1 = op.y+op.h;
+            break;
+    }
+}
+
+bool UiDisplayList::End(ssd1306_t *p)
+{
+    uint8_t count = opCount[current];
+    uint8_t last = current^1;
+    const UiOp *previous = ops[last];
+    if(valid && count == opCount[last] && memcmp(ops[current], previous, count*sizeof(UiOp)) == 0)
+    {
+        skippedFrames++;
+        return false;
+    }
+    // the widgets that look different, an op that moved counts for the widgets on both sides
+    bool changed[UiWidgetCount] = {};
+    uint8_t longest = count > opCount[last] ? count : opCount[last];
+    for(uint8_t i=0;i<longest;i++)
+    {
+        if(valid && i < count && i < opCount[last] && memcmp(&ops[current][i], &previous[i], sizeof(UiOp)) == 0)
+            continue;
+        if(i < count)
+            changed[ops[current][i].widget] = true;
+        if(i < opCount[last])
+            changed[previous[i].widget] = true;
+    }
+    for(int i=0;i<UiWidgetCount;i++)
+    {
+        if(changed[i])
+            widgetChanges[i]++;
+    }
+    // the window is everything the changed widgets covered, before and after
+    int16_t wx0 = 0, wy0 = 0, wx1 = p->width, wy1 = p->height;
+    if(valid)
+    {
+        wx0 = p->width;
+        wy0 = p->height;
+        wx1 = 0;
+        wy1 = 0;
+        for(uint8_t list=0;list<2;list++)
+        {
+            for(uint8_t i=0;i<opCount[list];i++)
+            {
+                const UiOp &op = ops[list][i];
+                if(!changed[op.widget])
+                    continue;
+                int16_t x0, y0, x1, y1;
+                GetBounds(op, x0, y0, x1, y1);
+                if(x0 < wx0) wx0 = x0;
+                if(y0 < wy0) wy0 = y0;
+                if(x1 > wx1) wx1 = x1;
+                if(y1 > wy1) wy1 = y1;
+            }
+        }
+    }
+    // whatever the other widgets drew in there goes back in the same order, clipped to the window
+    ssd1306_set_clip(p, wx0, wy0, wx1, wy1);
+    ssd1306_clear_square(p, p->clip_x0, p->clip_y0, p->clip_x1-p->clip_x0, p->clip_y1-p->clip_y0);
+    for(uint8_t i=0;i<count;i++)
+    {
+        int16_t x0, y0, x1, y1;
+        GetBounds(ops[current][i], x0, y0, x1, y1);
+        if(x1 > wx0 && x0 < wx1 && y1 > wy0 && y0 < wy1)
+            Play(p, ops[current][i]);
+    }
+    ssd1306_set_clip(p, 0, 0, p->width, p->height);
+    valid = true;
+    drawnFrames++;
+    current = last;
+    return true;
+}
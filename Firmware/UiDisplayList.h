@@ -0,0 +1,114 @@
+#ifndef UI_DISPLAY_LIST_H_
+#define UI_DISPLAY_LIST_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+extern "C" {
+  #include "ssd1306.h"
+}
+
+/*
+
+ui display list
+---------------
+the screen used to be cleared and drawn from scratch every frame. now the
+drawing code records what it would draw into a display list instead, and the
+list is only played into the framebuffer when it is different from the one
+the last frame played. most frames nothing changes, and then the cost is the
+sprintfs that made the strings and a compare.
+
+the ops are tagged with the widget they belong to. when a frame is different
+only the widgets that changed get redrawn: their area is cleared and every op
+that touches it is played again, clipped to it, the rest of the framebuffer
+stays as it is.
+
+widgets that format text can also hand their inputs to Reuse. when they are
+the same as last frame the widget's ops are copied over from the last list,
+and the sprintfs don't run at all.
+
+*/
+
+#define UI_MAX_OPS 32
+#define UI_TEXT_LENGTH 32
+#define UI_WIDGET_INPUTS 8
+
+enum UiOpType {
+    UiOpString, // gfx font, m6x11
+    UiOpSmallString, // the built in 5x8 font
+    UiOpSquare,
+    UiOpSquareRounded,
+    UiOpClearSquare,
+    UiOpClearSquareRounded,
+    UiOpLine
+};
+
+enum UiWidget {
+    UiWidgetMessage, // the full screen prompts, clearing and sampling
+    UiWidgetStatus, // sound and pattern on the left, or the chain
+    UiWidgetParams,
+    UiWidgetPages,
+    UiWidgetBattery,
+    UiWidgetVoltage, // the battery voltage while holding sound select
+    UiWidgetSave,
+    UiWidgetCount
+};
+
+struct UiOp
+{
+    uint8_t type;
+    uint8_t widget;
+    bool white;
+    int16_t x, y, w, h;
+    char text[UI_TEXT_LENGTH];
+};
+
+class UiDisplayList
+{
+    public:
+        void Begin();
+        // ops after this belong to the widget
+        void SetWidget(UiWidget widget) { currentWidget = widget; }
+        // like SetWidget, and true if the inputs are the same as last frame. then the widget's
+        // ops from last frame are already in the list and the caller skips drawing it
+        bool Reuse(UiWidget widget, const uint32_t *inputs, uint8_t count);
+        void DrawString(int16_t x, int16_t y, const char *str, bool white);
+        void DrawSmallString(int16_t x, int16_t y, const char *str);
+        void DrawSquare(int16_t x, int16_t y, int16_t w, int16_t h);
+        void DrawSquareRounded(int16_t x, int16_t y, int16_t w, int16_t h);
+        void ClearSquare(int16_t x, int16_t y, int16_t w, int16_t h);
+        void ClearSquareRounded(int16_t x, int16_t y, int16_t w, int16_t h);
+        void DrawLine(int16_t x1, int16_t y1, int16_t x2, int16_t y2);
+        // plays the list into the framebuffer if it changed, true if it did
+        bool End(ssd1306_t *p);
+        // next End draws even if nothing changed, for when something else drew on the framebuffer
+        void Invalidate() { valid = false; }
+        uint32_t GetDrawnFrames() { return drawnFrames; }
+        uint32_t GetSkippedFrames() { return skippedFrames; }
+        uint32_t GetWidgetChanges(UiWidget widget) { return widgetChanges[widget]; }
+        uint32_t GetReusedWidgets() { return reusedWidgets; }
+    private:
+        UiOp* Add(UiOpType type, int16_t x, int16_t y, int16_t w, int16_t h);
+        void Play(ssd1306_t *p, const UiOp &op);
+        // the pixels an op can touch, x1 and y1 exclusive
+        void GetBounds(const UiOp &op, int16_t &x0, int16_t &y0, int16_t &x1, int16_t &y1);
+        UiOp ops[2][UI_MAX_OPS];
+        uint8_t opCount[2] = {0, 0};
+        uint8_t current = 0;
+        uint8_t currentWidget = UiWidgetMessage;
+        bool valid = false;
+        uint32_t drawnFrames = 0;
+        uint32_t skippedFrames = 0;
+        uint32_t widgetChanges[UiWidgetCount] = {};
+        uint32_t reusedWidgets = 0;
+        uint32_t widgetInputs[UiWidgetCount][UI_WIDGET_INPUTS];
+        uint8_t widgetInputCount[UiWidgetCount];
+        // widgets whose inputs match their ops in the last list
+        uint16_t inputsValid = 0;
+        // widgets that went through Reuse this frame
+        uint16_t keyedWidgets = 0;
+};
+
+UiDisplayList* GetDisplayList();
+
+#endif // UI_DISPLAY_LIST_H_
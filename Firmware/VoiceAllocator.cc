@@ -0,0 +1,141 @@
+#include "VoiceAllocator.h"
+
+void VoiceAllocator::Init()
+{
+    playing = 0;
+    held = 0;
+    for(int i=0;i<ALLOCATOR_VOICES;i++)
+    {
+        notes[i] = -1;
+        age[i] = i;
+    }
+    allocations = 0;
+    steals = 0;
+    allocateTime = 0;
+    maxAllocateTime = 0;
+}
+
+void VoiceAllocator::SetPlaying(uint8_t playingMask)
+{
+    // a held key keeps its voice even once the envelope has finished
+    playing = playingMask;
+}
+
+void VoiceAllocator::MakeNewest(uint8_t voice)
+{
+    int i = 0;
+    while(age[i] != voice)
+        i++;
+    for(;i<ALLOCATOR_VOICES-1;i++)
+        age[i] = age[i+1];
+    age[ALLOCATOR_VOICES-1] = voice;
+}
+
+uint8_t VoiceAllocator::FindOldest(uint8_t mask)
+{
+    for(int i=0;i<ALLOCATOR_VOICES;i++)
+    {
+        if(((mask>>age[i])&1) > 0)
+            return age[i];
+    }
+    return ALLOCATOR_NO_VOICE;
+}
+
+uint8_t __not_in_flash_func(VoiceAllocator::Allocate)(uint8_t note)
+{
+    // the same key again goes back on its own voice, rather than stacking up
+    for(int i=0;i<ALLOCATOR_VOICES;i++)
+    {
+        if(notes[i] == note && ((held>>i)&1) > 0)
+            return i;
+    }
+    uint8_t free = ~(playing|held);
+    if(free != 0)
+        return __builtin_ctz(free);
+    steals++;
+    uint8_t voice = FindOldest(~held);
+    if(voice != ALLOCATOR_NO_VOICE)
+        return voice;
+    return age[0];
+}
+
+uint8_t __not_in_flash_func(VoiceAllocator::NoteOn)(uint8_t note)
+{
+    uint32_t start = time_us_32();
+    uint8_t voice = Allocate(note);
+    notes[voice] = note;
+    held |= 1<<voice;
+    playing |= 1<<voice;
+    MakeNewest(voice);
+    allocations++;
+    uint32_t elapsed = time_us_32()-start;
+    allocateTime += elapsed;
+    if(elapsed > maxAllocateTime)
+        maxAllocateTime = elapsed;
+    return voice;
+}
+
+uint8_t VoiceAllocator::NoteOff(uint8_t note)
+{
+    for(int i=0;i<ALLOCATOR_VOICES;i++)
+    {
+        if(notes[i] == note && ((held>>i)&1) > 0)
+        {
+            held &= ~(1<<i);
+            // the released voices get stolen in the order they were let go
+            MakeNewest(i);
+            return i;
+        }
+    }
+    return ALLOCATOR_NO_VOICE;
+}
+
+void VoiceAllocator::Take(uint8_t voice)
+{
+    if(voice >= ALLOCATOR_VOICES)
+        return;
+    held &= ~(1<<voice);
+    playing |= 1<<voice;
+    notes[voice] = -1;
+    MakeNewest(voice);
+}
+
+static bool CheckVoice(const char *name, uint8_t voice, uint8_t expected)
+{
+    if(voice == expected)
+        return true;
+    printf("voice allocator %s: got voice %i, expected %i\n", name, voice, expected);
+    return false;
+}
+
+bool TestVoiceAllocator()
+{
+    VoiceAllocator allocator;
+    bool passed = true;
+    allocator.Init();
+    allocator.SetPlaying(0);
+    // fill every voice, note 60+i lands on voice i
+    for(int i=0;i<ALLOCATOR_VOICES;i++)
+    {
+        passed &= CheckVoice("free voice", allocator.NoteOn(60+i), i);
+    }
+    // let go of them out of the order they started in, the envelopes are all still sounding
+    passed &= CheckVoice("note off", allocator.NoteOff(65), 5);
+    passed &= CheckVoice("note off", allocator.NoteOff(62), 2);
+    passed &= CheckVoice("note off", allocator.NoteOff(67), 7);
+    // the steal takes the one released first, not the oldest one started
+    passed &= CheckVoice("steal released first", allocator.NoteOn(80), 5);
+    passed &= CheckVoice("steal released next", allocator.NoteOn(81), 2);
+    passed &= CheckVoice("steal released last", allocator.NoteOn(82), 7);
+    // with every voice held the oldest held one goes
+    passed &= CheckVoice("steal held", allocator.NoteOn(83), 0);
+    // the same key again stays on its voice
+    passed &= CheckVoice("same key", allocator.NoteOn(81), 2);
+    // once an envelope has finished its voice is free again
+    allocator.NoteOff(64);
+    allocator.SetPlaying(0xff&~(1<<4));
+    passed &= CheckVoice("finished voice", allocator.NoteOn(90), 4);
+    passed &= CheckVoice("stolen note off", allocator.NoteOff(60), ALLOCATOR_NO_VOICE);
+    printf("voice allocator test %s, %i steals\n", passed ? "passed" : "failed", allocator.GetSteals());
+    return passed;
+}
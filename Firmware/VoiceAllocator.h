@@ -0,0 +1,60 @@
+#ifndef VOICE_ALLOCATOR_H_
+#define VOICE_ALLOCATOR_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "pico/stdlib.h"
+
+/*
+
+voice allocator
+---------------
+hands out the instruments to notes coming in over midi. which instruments
+are busy is kept as bits, so finding a free one is a count of trailing
+zeros. when there isn't one, the voice that was let go of first is taken,
+then the oldest one that is still held. the envelopes only decay, so the
+voice released first is also the quietest.
+
+the sequencer plays on fixed instruments and just takes them, Take tells the
+allocator so a note off doesn't end a sequenced note.
+
+*/
+
+#define ALLOCATOR_VOICES 8
+#define ALLOCATOR_NO_VOICE 0xff
+
+class VoiceAllocator
+{
+    public:
+        void Init();
+        // the instruments that are still sounding, once a block before any notes come in
+        void SetPlaying(uint8_t playingMask);
+        // the instrument to play the note on
+        uint8_t NoteOn(uint8_t note);
+        // the instrument the note was on, ALLOCATOR_NO_VOICE when it already got stolen
+        uint8_t NoteOff(uint8_t note);
+        void Take(uint8_t voice);
+        uint32_t GetAllocations() { return allocations; }
+        uint32_t GetSteals() { return steals; }
+        // time spent allocating in us, the total and the longest one
+        uint32_t GetAllocateTime() { return allocateTime; }
+        uint32_t GetMaxAllocateTime() { return maxAllocateTime; }
+    private:
+        uint8_t Allocate(uint8_t note);
+        void MakeNewest(uint8_t voice);
+        uint8_t FindOldest(uint8_t mask);
+        uint8_t playing; // a bit per instrument that is sounding
+        uint8_t held; // a bit per instrument with a key down
+        int16_t notes[ALLOCATOR_VOICES];
+        // oldest first, held voices by when they started and released ones by when they were let go
+        uint8_t age[ALLOCATOR_VOICES];
+        uint32_t allocations;
+        uint32_t steals;
+        uint32_t allocateTime;
+        uint32_t maxAllocateTime;
+};
+
+// true if the allocator picks the voices it should, see VoiceAllocator.cc
+bool TestVoiceAllocator();
+
+#endif // VOICE_ALLOCATOR_H_
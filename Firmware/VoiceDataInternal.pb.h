@@ -64,7 +64,8 @@ typedef struct _VoiceDataInternal {
     } extraTypeUnion;
     uint8_t sampleAttack;
     uint8_t sampleDecay;
-    /* these are per pattern */
+    /* these are per pattern, song files store them as separate records (see SongFile.h) */
+    pb_size_t patterns_count;
     VoiceDataInternal_Pattern patterns[16];
 } VoiceDataInternal;
 
@@ -79,11 +80,11 @@ extern "C" {
 #endif
 
 /* Initializer values for message structs */
-#define VoiceDataInternal_init_default           {0, {{NULL}, NULL}, 0, 0, 0, 0, false, VoiceDataInternal_EnvelopeData_init_default, false, VoiceDataInternal_EnvelopeData_init_default, 0, 0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, {0}, 0, 0, {VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default}}
+#define VoiceDataInternal_init_default           {0, {{NULL}, NULL}, 0, 0, 0, 0, false, VoiceDataInternal_EnvelopeData_init_default, false, VoiceDataInternal_EnvelopeData_init_default, 0, 0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, {0}, 0, 0, 0, {VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default, VoiceDataInternal_Pattern_init_default}}
 #define VoiceDataInternal_Pattern_init_default   {0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}}
 #define VoiceDataInternal_EnvelopeData_init_default {0, 0, 0, 0}
 #define VoiceDataInternal_LockPointer_init_default {0, 0}
-#define VoiceDataInternal_init_zero              {0, {{NULL}, NULL}, 0, 0, 0, 0, false, VoiceDataInternal_EnvelopeData_init_zero, false, VoiceDataInternal_EnvelopeData_init_zero, 0, 0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, {0}, 0, 0, {VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero}}
+#define VoiceDataInternal_init_zero              {0, {{NULL}, NULL}, 0, 0, 0, 0, false, VoiceDataInternal_EnvelopeData_init_zero, false, VoiceDataInternal_EnvelopeData_init_zero, 0, 0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, {0}, 0, 0, 0, {VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero, VoiceDataInternal_Pattern_init_zero}}
 #define VoiceDataInternal_Pattern_init_zero      {0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}}
 #define VoiceDataInternal_EnvelopeData_init_zero {0, 0, 0, 0}
 #define VoiceDataInternal_LockPointer_init_zero  {0, 0}
@@ -171,7 +172,7 @@ X(a, STATIC,   ONEOF,    UINT32,   (extraTypeUnion,samplerType,extraTypeUnion.sa
 X(a, STATIC,   ONEOF,    UINT32,   (extraTypeUnion,midiChannel,extraTypeUnion.midiChannel),  66) \
 X(a, STATIC,   SINGULAR, UINT32,   sampleAttack,     67) \
 X(a, STATIC,   SINGULAR, UINT32,   sampleDecay,      68) \
-X(a, STATIC,   FIXARRAY, MESSAGE,  patterns,         69)
+X(a, STATIC,   REPEATED, MESSAGE,  patterns,         69)
 #define VoiceDataInternal_CALLBACK pb_default_field_callback
 #define VoiceDataInternal_DEFAULT NULL
 #define VoiceDataInternal_locksForPattern_MSGTYPE VoiceDataInternal_LockPointer
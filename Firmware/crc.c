@@ -0,0 +1,42 @@
+#include "crc.h"
+
+#if !PICO_NO_HARDWARE
+#include "hardware/dma.h"
+
+static int crc_dma_channel = -1;
+static uint8_t crc_dma_sink;
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length)
+{
+    if(length == 0)
+        return crc;
+    if(crc_dma_channel < 0)
+        crc_dma_channel = dma_claim_unused_channel(true);
+    // memory to a single byte sink, the sniffer sees every byte on the way through
+    dma_channel_config c = dma_channel_get_default_config(crc_dma_channel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_sniff_enable(&c, true);
+    dma_sniffer_enable(crc_dma_channel, DMA_SNIFF_CTRL_CALC_VALUE_CRC32R, true);
+    dma_hw->sniff_data = crc;
+    dma_channel_configure(crc_dma_channel, &c, &crc_dma_sink, data, length, true);
+    dma_channel_wait_for_finish_blocking(crc_dma_channel);
+    crc = dma_hw->sniff_data;
+    dma_sniffer_disable();
+    return crc;
+}
+#else
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length)
+{
+    while(length--)
+    {
+        crc ^= *data++;
+        for(int bit=0;bit<8;bit++)
+        {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+        }
+    }
+    return crc;
+}
+#endif
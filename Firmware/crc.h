@@ -0,0 +1,22 @@
+#ifndef CRC_H_
+#define CRC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// reflected crc32 (poly 0xedb88320) without the final inversion, so a running
+// value can be passed back in to continue over the next chunk of data
+#define CRC32_INIT 0xffffffff
+
+// uses the dma sniffer on the rp2040, bitwise software fallback on host builds
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CRC_H_
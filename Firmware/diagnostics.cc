@@ -95,6 +95,7 @@ void Diagnostics::run()
         color[0+1*5] = urgb_u32(200, 10, 10);
         color[1+1*5] = urgb_u32(0, 200, 250);
         color[2+1*5] = urgb_u32(10, 200, 10);
+        color[3+1*5] = urgb_u32(200, 200, 10);
 
         ssd1306_clear(disp);
         sprintf(str, "lit tests");
@@ -122,6 +123,10 @@ void Diagnostics::run()
                 {
                     hardware_shutdown();
                 }
+                if(x==3 && y==1)
+                {
+                    selfTest();
+                }
             }
         }
         lastKeyState = keyState;
@@ -219,4 +224,26 @@ void Diagnostics::flashQuickClear()
         ssd1306_show(disp);
         sleep_ms(3000);
     }
-}
\ No newline at end of file
+}
+// the logic tests that don't need any hardware, the details go out over serial
+void Diagnostics::selfTest()
+{
+    ssd1306_t* disp = GetDisplay();
+    ssd1306_clear(disp);
+    sprintf(str, "running self tests");
+    ssd1306_draw_string_gfxfont(disp, 3, 12, str, true, 1, 1, &m6x118pt7b);
+    ssd1306_show(disp);
+    int failed = 0;
+    if(!TestVoiceAllocator())
+        failed++;
+    if(!TestClockRecovery())
+        failed++;
+    ssd1306_clear(disp);
+    if(failed == 0)
+        sprintf(str, "self tests ok");
+    else
+        sprintf(str, "%i self tests failed", failed);
+    ssd1306_draw_string_gfxfont(disp, 3, 12, str, true, 1, 1, &m6x118pt7b);
+    ssd1306_show(disp);
+    sleep_ms(3000);
+}
@@ -3,6 +3,8 @@
 #include "ws2812.h"
 #include "m6x118pt7b.h"
 #include <stdio.h>
+#include "VoiceAllocator.h"
+#include "ClockRecovery.h"
 
 
 class Diagnostics
@@ -12,6 +14,7 @@ public:
     void flashQuickClear();
 private:
     void buttonTest();
+    void selfTest();
     uint32_t color[25];
     uint32_t keyState = 0;
     uint32_t lastKeyState = 0;
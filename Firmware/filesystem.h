@@ -93,6 +93,7 @@ FFS_DEF int ffs_append(ffs_filesystem *fs, ffs_file *file, void *buffer, size_t
 FFS_DEF int ffs_seek(ffs_filesystem *fs, ffs_file *file, size_t position);
 FFS_DEF int ffs_read(ffs_filesystem *fs, ffs_file *file, void *buffer, size_t size);
 FFS_DEF int ffs_erase(ffs_filesystem *fs, ffs_file *file);
+FFS_DEF int ffs_erase_step(ffs_filesystem *fs, uint16_t file_id);
 FFS_DEF int ffs_file_size(ffs_filesystem *fs, ffs_file *file);
 
 #ifdef FFS_IMPLEMENTATION
@@ -144,7 +145,8 @@ FFS_DEF int ffs_open(ffs_filesystem *fs, ffs_file *file, uint16_t file_id)
     while(block_offset < fs->size)
     {
         fs->read(block_offset, sizeof(ffs_blockheader), &blockHeader);
-        if(blockHeader.object_id == file_id)
+        // later blocks in the chain can sit at lower addresses than the start block
+        if(blockHeader.object_id == file_id && blockHeader.prior_block == EMPTY_BLOCK)
         {
             found = true;
             file->current_block         = block_offset;
@@ -203,7 +205,7 @@ static int ffs_find_empty_block(ffs_filesystem *fs, uint32_t search_start, uint3
         }
         block_offset += BLOCK_SIZE;
         readPos = readPos+BLOCK_SIZE;
-        if(readPos>fssize)
+        if(readPos>=fssize)
         {
             readPos-=fssize;
         }
@@ -327,7 +329,7 @@ FFS_DEF int __not_in_flash_func(ffs_erase)(ffs_filesystem *fs, ffs_file *file)
     {
         fs->read(block_offset, sizeof(ffs_blockheader), &blockHeader);
         // found matching block
-        if(blockHeader.object_id == file->object_id)
+        if(blockHeader.object_id == file->object_id && blockHeader.prior_block == EMPTY_BLOCK)
         {
             fs->erase(block_offset, BLOCK_SIZE);
             // use jumps to erase the rest
@@ -355,6 +357,26 @@ FFS_DEF int __not_in_flash_func(ffs_erase)(ffs_filesystem *fs, ffs_file *file)
     return -1;
 }
 
+// erases a single block belonging to this id, so a large file can be removed a bit at a time
+// doesn't follow the chain, so it also cleans up blocks left behind by an interrupted erase
+// returns 1 if a block was erased, 0 once there are none left
+FFS_DEF int __not_in_flash_func(ffs_erase_step)(ffs_filesystem *fs, uint16_t file_id)
+{
+    uint32_t block_offset = 0;
+    ffs_blockheader blockHeader;
+    while(block_offset < fs->size)
+    {
+        fs->read(block_offset, sizeof(ffs_blockheader), &blockHeader);
+        if(blockHeader.object_id == file_id)
+        {
+            fs->erase(block_offset, BLOCK_SIZE);
+            return 1;
+        }
+        block_offset+=BLOCK_SIZE;
+    }
+    return 0;
+}
+
 static int ffs_load_blockheader(ffs_filesystem *fs, ffs_file *file, ffs_blockheader *blockheader)
 {
     ffs_blockheader headerForSize;
@@ -30,6 +30,15 @@ typedef struct {
   uint8_t yAdvance; ///< Newline distance (y axis)
 } GFXfont;
 
+/// A font rasterized into columns, for displays that store 8 pixel tall pages
+/// each column has the top row of its glyph in the top bit, shifting it down by
+/// the row the glyph starts on gives the bits for the pages of a 32 pixel display
+typedef struct {
+  const GFXfont *font;   ///< Font the columns were made from
+  uint32_t *columns;     ///< Columns of every glyph, concatenated
+  uint16_t *glyphColumn; ///< First column of each glyph
+} GFXPageFont;
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,5 +1,6 @@
 #include "hardware.h"
 #include "ssd1306.h"
+#include "keyscan.pio.h"
 
 #define LINE_IN_DETECT 24
 #define HEADPHONE_DETECT 16
@@ -19,6 +20,38 @@ static int8_t lastHpVol = -10;
 
 i2c_dma_t* i2c_dma;
 
+// the last scan of the matrix, the dma keeps it up to date
+static volatile uint32_t keyscan_raw;
+static uint32_t debounced_keys;
+static uint32_t key_change_time[25];
+static queue_t key_events;
+static struct repeating_timer poll_timer;
+// diagnostics calls hardware_init a second time, the scanning and polling only gets set up once
+static bool hardware_started;
+
+// adc inputs 0 and 1 are the pots, 2 is the battery
+#define ADC_CHANNELS 3
+#define ADC_BATTERY_CHANNEL 2
+#define ADC_RING_LENGTH 256
+// a whole number of laps of the ring and of the channels, so the next dma channel carries on where the last one stopped
+#define ADC_DMA_COUNT (ADC_RING_LENGTH*ADC_CHANNELS*0x10000)
+
+static uint16_t adc_ring[ADC_RING_LENGTH] __attribute__((aligned(ADC_RING_LENGTH*2)));
+static int adc_dma[2];
+static uint16_t adc_read_pos;
+static uint32_t adc_sum[ADC_CHANNELS];
+static uint16_t adc_count[ADC_CHANNELS];
+// the pots after the hysteresis, 16 bits
+static uint16_t pot_value[2];
+static uint8_t pots_started;
+// both pots as 12 bits, a in the top half
+static volatile uint32_t pot_values;
+static volatile bool pots_changed;
+
+static void hardware_adc_init();
+static void hardware_keyscan_init();
+static bool hardware_poll_callback(struct repeating_timer *t);
+
 void hardware_init()
 {
     // give all the caps some time to warm up
@@ -28,10 +61,14 @@ void hardware_init()
     // gpio_put(BLINK_PIN_LED, true);
     set_sys_clock_khz(200000, true);
 
-    adc_init();
-    adc_gpio_init(26);
-    adc_gpio_init(27);
-    adc_gpio_init(28);
+    if(!hardware_started)
+    {
+        adc_init();
+        adc_gpio_init(26);
+        adc_gpio_init(27);
+        adc_gpio_init(28);
+        hardware_adc_init();
+    }
 
     gpio_init(USB_POWER_SENSE);
     // in the past I had issues with bad ADC values when this was set to in - keep an eye on this
@@ -51,15 +88,20 @@ void hardware_init()
     gpio_set_dir(HEADPHONE_DETECT, GPIO_IN);
     gpio_pull_up(HEADPHONE_DETECT);
 
-    // setup the rows / colums for input
-    for (size_t i = 0; i < 5; i++)
+    if(!hardware_started)
     {
-        gpio_init(col_pin_base+i);
-        gpio_set_dir(col_pin_base+i, GPIO_OUT);
-        gpio_disable_pulls(col_pin_base+i);
-        gpio_init(row_pin_base+i);
-        gpio_set_dir(row_pin_base+i, GPIO_IN);
-        gpio_pull_down(row_pin_base+i);
+        // setup the rows / colums for input
+        for (size_t i = 0; i < 5; i++)
+        {
+            gpio_init(col_pin_base+i);
+            gpio_disable_pulls(col_pin_base+i);
+            gpio_init(row_pin_base+i);
+            gpio_set_dir(row_pin_base+i, GPIO_IN);
+            gpio_pull_down(row_pin_base+i);
+        }
+        hardware_keyscan_init();
+        add_repeating_timer_us(-HARDWARE_POLL_US, hardware_poll_callback, NULL, &poll_timer);
+        hardware_started = true;
     }
     
     gpio_init(SUBSYSTEM_RESET_PIN);
@@ -125,50 +167,188 @@ i2c_dma_t* hardware_get_i2c()
     return i2c_dma;
 }
 
-bool hardware_get_key_state(uint8_t x, uint8_t y)
+// key x*5+y is bit x*5+y, key 0 is the power switch rather than the matrix
+static uint32_t __not_in_flash_func(hardware_read_keys)()
 {
-    if(x==0&&y==0)
-        return !gpio_get(23);
-    gpio_put_masked(0x7c0, 1<<(col_pin_base+x));
-    sleep_us(2);
-    return gpio_get(row_pin_base+y);
+    return (keyscan_raw & 0x1fffffe) | (gpio_get(23) ? 0 : 1);
 }
 
-void hardware_get_all_key_state(uint32_t *keyState)
+// the change goes out as soon as it is seen, then the key is left alone until it stops bouncing
+static void __not_in_flash_func(hardware_debounce_keys)(uint32_t now)
+{
+    uint32_t changed = hardware_read_keys() ^ debounced_keys;
+    while(changed)
+    {
+        int key = __builtin_ctz(changed);
+        changed &= changed-1;
+        if(now-key_change_time[key] < KEY_DEBOUNCE_US)
+            continue;
+        key_event_t event;
+        event.time = now;
+        event.key = key;
+        event.pressed = !(debounced_keys & (1ul<<key));
+        // with the queue full the key stays changed, it goes out on a later poll
+        if(!queue_try_add(&key_events, &event))
+            break;
+        debounced_keys ^= 1ul<<key;
+        key_change_time[key] = now;
+    }
+}
+
+static void hardware_adc_init()
+{
+    adc_select_input(0);
+    adc_set_round_robin((1u<<ADC_CHANNELS)-1);
+    adc_fifo_setup(true, true, 1, false, false);
+    // the adc clock is 48mhz, a sample every div+1 cycles
+    adc_set_clkdiv(48000000/ADC_SAMPLE_RATE-1);
+
+    // the same two channel trick as the key scan, both write round the one ring
+    adc_dma[0] = dma_claim_unused_channel(true);
+    adc_dma[1] = dma_claim_unused_channel(true);
+    for (int i = 0; i < 2; i++)
+    {
+        dma_channel_config c = dma_channel_get_default_config(adc_dma[i]);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+        channel_config_set_read_increment(&c, false);
+        channel_config_set_write_increment(&c, true);
+        channel_config_set_ring(&c, true, __builtin_ctz(sizeof(adc_ring)));
+        channel_config_set_dreq(&c, DREQ_ADC);
+        channel_config_set_chain_to(&c, adc_dma[i^1]);
+        dma_channel_configure(adc_dma[i], &c, adc_ring, &adc_hw->fifo, ADC_DMA_COUNT, i == 0);
+    }
+    adc_run(true);
+}
+
+// a pot only follows once it has moved past the hysteresis, then it gets dragged along
+static bool __not_in_flash_func(hardware_update_pot)(uint8_t pot, uint16_t value)
+{
+    if(!(pots_started & (1<<pot)))
+    {
+        pots_started |= 1<<pot;
+        pot_value[pot] = value;
+        return true;
+    }
+    if(value > pot_value[pot]+ADC_HYSTERESIS)
+    {
+        pot_value[pot] = value-ADC_HYSTERESIS;
+        return true;
+    }
+    if(value+ADC_HYSTERESIS < pot_value[pot])
+    {
+        pot_value[pot] = value+ADC_HYSTERESIS;
+        return true;
+    }
+    return false;
+}
+
+// the channel comes from the dma transfer count rather than being counted along,
+// so a poll that misses a whole lap (a flash erase runs with interrupts off) can't knock it out of step
+static void __not_in_flash_func(hardware_process_adc)()
 {
-    gpio_put(col_pin_base, true);
-    // read keys
-    for (size_t i = 0; i < 5; i++)
+    int active = dma_channel_is_busy(adc_dma[0]) ? adc_dma[0] : adc_dma[1];
+    // each dma channel starts on a whole number of laps, so this is the sample count modulo both
+    uint32_t written = ADC_DMA_COUNT-dma_channel_hw_addr(active)->transfer_count;
+    uint16_t write_pos = written&(ADC_RING_LENGTH-1);
+    uint16_t pending = (write_pos-adc_read_pos)&(ADC_RING_LENGTH-1);
+    uint8_t channel = (written+ADC_DMA_COUNT-pending)%ADC_CHANNELS;
+    bool changed = false;
+    while(adc_read_pos != write_pos)
     {
-        // the mask here are the gpio pins for the colums
-        gpio_put_masked(0x7c0, 1<<(col_pin_base+i));
-        sleep_us(1);
-        for (size_t j = 0; j < 5; j++)
+        uint8_t c = channel;
+        adc_sum[c] += adc_ring[adc_read_pos]&0xfff;
+        adc_read_pos = (adc_read_pos+1)&(ADC_RING_LENGTH-1);
+        channel = c == ADC_CHANNELS-1 ? 0 : c+1;
+        if(c == ADC_BATTERY_CHANNEL)
         {
-            int index = (i*5+j);
-            bool keyVal = index==0?!gpio_get(23):gpio_get(j+row_pin_base);
-            if(keyVal)
-            {
-                *keyState |= 1ul << index;
-            }
-            else
-            {
-                *keyState &= ~(1ul << index);
-            }
+            if(++adc_count[c] < ADC_BATTERY_OVERSAMPLE)
+                continue;
+            battery_level = (adc_sum[c]/ADC_BATTERY_OVERSAMPLE)>>4;
         }
+        else
+        {
+            if(++adc_count[c] < ADC_POT_OVERSAMPLE)
+                continue;
+            // input 1 is pot a
+            if(hardware_update_pot(c == 1 ? 0 : 1, adc_sum[c]*16/ADC_POT_OVERSAMPLE))
+                changed = true;
+        }
+        adc_sum[c] = 0;
+        adc_count[c] = 0;
+    }
+    if(changed)
+    {
+        pot_values = ((uint32_t)(pot_value[0]>>4)<<16)|(pot_value[1]>>4);
+        pots_changed = true;
     }
 }
 
-uint8_t hardware_get_battery_level()
+static bool __not_in_flash_func(hardware_poll_callback)(struct repeating_timer *t)
 {
-    return battery_level;
+    hardware_debounce_keys(time_us_32());
+    hardware_process_adc();
+    return true;
+}
+
+static void hardware_keyscan_init()
+{
+    PIO pio = pio0;
+    uint sm = pio_claim_unused_sm(pio, true);
+    uint offset = pio_add_program(pio, &keyscan_program);
+    keyscan_program_init(pio, sm, offset, col_pin_base, row_pin_base);
+
+    // two channels that trigger each other, so the scan never stops
+    int channels[2];
+    channels[0] = dma_claim_unused_channel(true);
+    channels[1] = dma_claim_unused_channel(true);
+    for (int i = 0; i < 2; i++)
+    {
+        dma_channel_config c = dma_channel_get_default_config(channels[i]);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, false);
+        channel_config_set_write_increment(&c, false);
+        channel_config_set_dreq(&c, pio_get_dreq(pio, sm, false));
+        channel_config_set_chain_to(&c, channels[i^1]);
+        dma_channel_configure(channels[i], &c, &keyscan_raw, &pio->rxf[sm], 0xffffffff, i == 0);
+    }
+
+    queue_init(&key_events, sizeof(key_event_t), KEY_EVENT_QUEUE_LENGTH);
+    // let a couple of scans land first
+    sleep_us(200);
+}
+
+bool hardware_get_key_state(uint8_t x, uint8_t y)
+{
+    return (hardware_read_keys()>>(x*5+y)) & 1;
+}
+
+void hardware_get_all_key_state(uint32_t *keyState)
+{
+    *keyState = hardware_read_keys();
 }
 
-void hardware_update_battery_level()
+bool hardware_get_key_event(key_event_t *event)
 {
-    adc_select_input(2);
-    battery_level = adc_read()>>4;
+    return queue_try_remove(&key_events, event);
 }
+
+bool hardware_get_pots(uint16_t *a, uint16_t *b)
+{
+    if(!pots_changed)
+        return false;
+    // cleared first, a change that lands in between just comes round again
+    pots_changed = false;
+    uint32_t values = pot_values;
+    *a = values>>16;
+    *b = values&0xffff;
+    return true;
+}
+
+uint8_t hardware_get_battery_level()
+{
+    return battery_level;
+}
+
 float hardware_get_battery_level_float()
 {
     // 2.33 is voltage divider r1+r2/r2, or in this case 1m+750k/750k or 2.33f
@@ -192,7 +372,9 @@ void hardware_shutdown()
     uint32_t color[20] = {0};
     memset(color, 0, 20 * sizeof(uint32_t));
     ws2812_setColors(color);
-    ws2812_trigger();
+    // the trigger doesn't wait, the clear has to get out before the power goes
+    while(!ws2812_trigger())
+        tight_loop_contents();
 
     // wait for the powerkey to go low, then shutdown
     while(hardware_get_key_state(0,0))
@@ -7,6 +7,7 @@
 #include "hardware/watchdog.h"
 #include "hardware/adc.h"
 #include "pico/bootrom.h"
+#include "pico/util/queue.h"
 #include "ws2812.h"
 #include "i2c_dma.h"
 
@@ -14,6 +15,29 @@
 extern "C" {
 #endif
 
+// keys that change again within this long of their last change are bouncing
+#define KEY_DEBOUNCE_US 5000
+#define KEY_EVENT_QUEUE_LENGTH 32
+// how often the debouncer looks at the scanned keys and the adc samples get used up
+#define HARDWARE_POLL_US 1000
+
+// the adc goes round robin over the two pots and the battery, 4khz each
+#define ADC_SAMPLE_RATE 12000
+// 4ms of samples for each pot reading
+#define ADC_POT_OVERSAMPLE 16
+// 64ms for the battery, it hardly moves
+#define ADC_BATTERY_OVERSAMPLE 256
+// a pot has to move this far to change, in 16 bit units (two 12 bit steps)
+#define ADC_HYSTERESIS 32
+
+typedef struct
+{
+    // time_us_32 when the debouncer saw the change
+    uint32_t time;
+    uint8_t key;
+    bool pressed;
+} key_event_t;
+
 void hardware_init();
 void hardware_input_init();
 void hardware_shutdown();
@@ -21,12 +45,15 @@ void hardware_reboot_usb();
 void hardware_check_i2c_pullups(bool *scl, bool *sda);
 bool hardware_get_key_state(uint8_t x, uint8_t y);
 void hardware_get_all_key_state(uint32_t *keystate);
+// pops the next debounced key change, false if there are none
+bool hardware_get_key_event(key_event_t *event);
+// the pots as 12 bit values, false if they haven't moved since the last call
+bool hardware_get_pots(uint16_t *a, uint16_t *b);
 i2c_dma_t* hardware_get_i2c();
 
 uint8_t hardware_get_battery_level();
 float hardware_get_battery_level_float();
 bool hardware_has_usb_power();
-void hardware_update_battery_level();
 void hardware_set_mic(bool mic_state);
 void hardware_set_hpvol(int8_t hpVol);
 bool hardware_line_in_detected();
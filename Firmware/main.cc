@@ -41,6 +41,7 @@ extern "C" {
 #include "GlobalDefines.h"
 #include "bsp/board.h"
 #include "Midi.h"
+#include "Scheduler.h"
 
 using namespace braids;
 
@@ -86,6 +87,14 @@ int audioGenOffset = 0;
 GrooveBox gbox;
 USBSerialDevice usbSerialDevice;
 auto_init_mutex(audioProcessMutex);
+uint32_t color[25];
+
+Scheduler scheduler;
+int audioTask = SCHEDULER_NO_TASK;
+int saveTask = SCHEDULER_NO_TASK;
+// print the scheduler stats about once a minute, a task per housekeeping tick
+// each line is the task's run time avg/max, latency avg/max and missed deadlines
+#define SCHEDULER_STATS_FRAMES (30*60)
 
 int triCount = 0;
 int note = 60;
@@ -104,6 +113,8 @@ void __not_in_flash_func(dma_input_handler)() {
         {
             inBufOffset = (inBufOffset+1)%2;
             audioInReady = true;
+            if(audioOutReady)
+                scheduler.MakeReady(audioTask);
             mutex_exit(&audioProcessMutex);
         }
     }
@@ -118,6 +129,8 @@ void __not_in_flash_func(dma_output_handler)() {
         {
             outBufOffset = (outBufOffset+1)%2;
             audioOutReady = true;
+            if(audioInReady)
+                scheduler.MakeReady(audioTask);
             mutex_exit(&audioProcessMutex);
         }
     }
@@ -140,6 +153,91 @@ bool usb_timer_callback(struct repeating_timer *t) {
     return true;
 }
 
+// the main loop tasks, most urgent first: audio > midi > keys > display > save > housekeeping
+bool firstAudioRendered = false;
+bool AudioTask()
+{
+    if(!(audioOutReady && audioInReady))
+        return false;
+    mutex_enter_blocking(&audioProcessMutex); 
+    for(int i=0;i<BLOCKS_PER_SEND;i++)
+    {
+        uint32_t *input = capture_buf+inBufOffset*SAMPLES_PER_SEND+SAMPLES_PER_BLOCK*i;
+        uint32_t *output = output_buf+outBufOffset*SAMPLES_PER_SEND+SAMPLES_PER_BLOCK*i;
+        gbox.Render((int16_t*)(output), (int16_t*)(input), SAMPLES_PER_BLOCK);
+    }
+    audioInReady = false;
+    audioOutReady = false;
+    mutex_exit(&audioProcessMutex);
+    if(!firstAudioRendered)
+    {
+        firstAudioRendered = true;
+        printf("boot to first audio %ims\n", to_ms_since_boot(get_absolute_time()));
+    }
+    // a full block of time until the next one is due, move the background save along
+    scheduler.MakeReady(saveTask);
+    return false;
+}
+
+bool MidiTask()
+{
+    tud_task(); // tinyusb device task
+    midi_task(); // read and clear incoming midi
+    return false;
+}
+
+bool InputTask()
+{
+    // the keys are scanned and debounced in the background, this only takes the changes
+    gbox.HandleKeyEvents();
+    uint16_t potA, potB;
+    if(hardware_get_pots(&potA, &potB))
+        gbox.OnAdcUpdate(potA, potB);
+    return false;
+}
+
+uint8_t displayStage = 0;
+bool DisplayTask()
+{
+    // drawing and sending are split, so anything more urgent can go in between
+    if(displayStage == 0)
+    {
+        gbox.UpdateDisplay(GetDisplay());
+        displayStage = 1;
+        return true;
+    }
+    // hardware_has_usb_power(); // this call just turns on the green debug led currently
+    gbox.SendDisplay(GetDisplay());
+    displayStage = 0;
+    return false;
+}
+
+bool SaveTask()
+{
+    gbox.UpdateSave();
+    return false;
+}
+
+uint16_t statsFrames = 0;
+bool HousekeepingTask()
+{
+    gbox.UpdateHousekeeping();
+    if(++statsFrames > SCHEDULER_STATS_FRAMES)
+    {
+        int task = statsFrames-SCHEDULER_STATS_FRAMES-1;
+        if(task < scheduler.GetTaskCount())
+        {
+            scheduler.PrintStats(task);
+        }
+        else
+        {
+            statsFrames = 0;
+            scheduler.ResetStats();
+        }
+    }
+    return false;
+}
+
 bool screen_flip_ready = false;
 int drawY = 0;
 void __not_in_flash_func(draw_screen)()
@@ -267,7 +365,6 @@ int main()
     }
 
     ws2812_init();
-    uint32_t color[25];
     memset(color, 0, 25 * sizeof(uint32_t));
     ws2812_setColors(color+5);
     ws2812_trigger();
@@ -284,12 +381,8 @@ int main()
     struct repeating_timer timer;
     struct repeating_timer timer2;
 
-    // requires some looping to get a good startup battery reading
-    for(int i=0;i<100;i++)
-    {
-        sleep_ms(1);
-        hardware_update_battery_level();
-    }
+    // the battery is averaged in the background, the first reading takes ~64ms to come in
+    sleep_ms(100);
 
     if(!hardware_has_usb_power() && hardware_get_battery_level_float() < 3.6f)
     {
@@ -317,69 +410,29 @@ int main()
     memset(output_buf, SAMPLES_PER_SEND*2, sizeof(uint32_t));
     memset(capture_buf, SAMPLES_PER_SEND*2, sizeof(uint32_t));
 
+    // the audio dma handlers make the audio task ready, so this goes first
+    scheduler.Init();
+    // a send is 8ms of audio at 32k, it has to start within half of that
+    audioTask = scheduler.AddTask("audio", AudioTask, 0, SAMPLES_PER_SEND*1000000/32000/2);
+    scheduler.AddTask("midi", MidiTask, 1000, 2000);
+    scheduler.AddTask("keys", InputTask, 1000, 2000);
+    scheduler.AddTask("display", DisplayTask, 33333, 10000);
+    saveTask = scheduler.AddTask("save", SaveTask, 0);
+    scheduler.AddTask("housekeeping", HousekeepingTask, 33333);
+
     configure_audio_driver();
 
     tlvDriverInit();
 
     int step = 0;
-    uint32_t keyState = 0;
-    uint32_t lastKeyState = 0;
-
-    add_repeating_timer_ms(-33, repeating_timer_callback, NULL, &timer);
 
-    adc_select_input(0);
     int16_t touchCounter = 0x7fff;
     int16_t headphoneCheck = 60;
     uint8_t brightnesscount = 0;
     int lostCount = 0;
     while(true)
     {
-        tud_task(); // tinyusb device task
-        midi_task(); // read and clear incoming midi
-        if(audioOutReady && audioInReady)
-        {
-            mutex_enter_blocking(&audioProcessMutex); 
-            for(int i=0;i<BLOCKS_PER_SEND;i++)
-            {
-                uint32_t *input = capture_buf+inBufOffset*SAMPLES_PER_SEND+SAMPLES_PER_BLOCK*i;
-                uint32_t *output = output_buf+outBufOffset*SAMPLES_PER_SEND+SAMPLES_PER_BLOCK*i;
-                gbox.Render((int16_t*)(output), (int16_t*)(input), SAMPLES_PER_BLOCK);
-            }
-            audioInReady = false;
-            audioOutReady = false;
-            mutex_exit(&audioProcessMutex);
-        }
-        else
-        {
-            hardware_get_all_key_state(&keyState);
-            
-            // act on keychanges
-            for (size_t i = 0; i < 25; i++)
-            {
-                uint32_t s = keyState & (1ul<<i);
-                if((keyState & (1ul<<i)) != (lastKeyState & (1ul<<i)))
-                {
-                    gbox.OnKeyUpdate(i, s>0); 
-                }
-            }
-            lastKeyState = keyState;
-            if(needsScreenupdate)
-            {
-                adc_select_input(1);
-                uint16_t adc_val = adc_read();
-                adc_select_input(0);
-                // I think that even though adc_read returns 16 bits, the value is only in the bottom? 12
-                gbox.OnAdcUpdate(adc_val, adc_read());
-                hardware_update_battery_level();
-                queue_entry_complete_t result;
-                gbox.UpdateDisplay(GetDisplay());
-                // hardware_has_usb_power(); // this call just turns on the green debug led currently
-                ssd1306_show(GetDisplay());
-                ws2812_setColors(color+5);
-                needsScreenupdate = false;
-                ws2812_trigger();
-            }
-        }
+        scheduler.RunOnce();
     }
     return 0;
 }
\ No newline at end of file
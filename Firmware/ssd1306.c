@@ -37,6 +37,8 @@ SOFTWARE.
 #include "i2c_dma.h"
 #include "hardware.h"
 #define I2C_DMA_CHANNEL_WRITE 11
+// the command bytes that go ahead of the data of each window
+#define SSD1306_WINDOW_COMMANDS 8
 
 ssd1306_t disp;
 
@@ -72,6 +74,7 @@ bool ssd1306_init(ssd1306_t *p, uint16_t width, uint16_t height, uint8_t address
     p->address=address;
     p->string_invert=false;
     p->i2c_i=i2c_instance;
+    ssd1306_set_clip(p, 0, 0, width, height);
 
 
     p->bufsize=(p->pages)*(p->width);
@@ -79,10 +82,19 @@ bool ssd1306_init(ssd1306_t *p, uint16_t width, uint16_t height, uint8_t address
         p->bufsize=0;
         return false;
     }
-    if((p->sendBuffer=malloc((p->bufsize+2)*sizeof(uint16_t)))==NULL) {
+    // every page can need its own window, which is a few command bytes on top of the data
+    if((p->sendBuffer=malloc((p->bufsize+p->pages*SSD1306_WINDOW_COMMANDS+1)*sizeof(uint16_t)))==NULL) {
         p->bufsize=0;
         return false;
     }
+    if((p->shadow=malloc(p->bufsize))==NULL) {
+        p->bufsize=0;
+        return false;
+    }
+    p->shadowValid=false;
+    p->bytesSent=0;
+    p->framesSent=0;
+    p->framesSkipped=0;
     
     ++(p->buffer);
 
@@ -151,8 +163,22 @@ inline void ssd1306_clear(ssd1306_t *p) {
     memset(p->buffer, 0, p->bufsize);
 }
 
+void ssd1306_set_clip(ssd1306_t *p, int32_t x0, int32_t y0, int32_t x1, int32_t y1) {
+    p->clip_x0 = x0 < 0 ? 0 : x0;
+    p->clip_y0 = y0 < 0 ? 0 : y0;
+    p->clip_x1 = x1 > p->width ? p->width : x1;
+    p->clip_y1 = y1 > p->height ? p->height : y1;
+    if(p->clip_x1 < p->clip_x0)
+        p->clip_x1 = p->clip_x0;
+    if(p->clip_y1 < p->clip_y0)
+        p->clip_y1 = p->clip_y0;
+    // the blit has screen row 0 in the top bit, see ssd1306_blit_glyph
+    uint8_t rows = p->clip_y1-p->clip_y0;
+    p->clip_mask = rows == 0 ? 0 : (rows >= 32 ? 0xffffffff : ((1u<<rows)-1)<<(32-p->clip_y1));
+}
+
 void ssd1306_draw_pixel(ssd1306_t *p, uint32_t x, uint32_t y) {
-	if(x>=p->width || y>=p->height) return;
+	if(x<p->clip_x0 || x>=p->clip_x1 || y<p->clip_y0 || y>=p->clip_y1) return;
     x = 127-x;
     y = 31-y;
     p->buffer[x+p->width*(y>>3)]|=0x1<<(y&0x07); // y>>3==y/8 && y&0x7==y%8
@@ -160,7 +186,7 @@ void ssd1306_draw_pixel(ssd1306_t *p, uint32_t x, uint32_t y) {
 
 
 void ssd1306_clear_pixel(ssd1306_t *p, uint32_t x, uint32_t y) {
-	if(x>=p->width || y>=p->height) return;
+	if(x<p->clip_x0 || x>=p->clip_x1 || y<p->clip_y0 || y>=p->clip_y1) return;
     x = 127-x;
     y = 31-y;
     p->buffer[x+p->width*(y>>3)]&=~(0x1<<(y&0x07)); // y>>3==y/8 && y&0x7==y%8
@@ -262,34 +288,64 @@ void ssd1306_draw_string(ssd1306_t *p, uint32_t x, uint32_t y, uint32_t scale, c
     ssd1306_draw_string_with_font(p, x, y, scale, font_8x5, s);
 }
 
+void ssd1306_invalidate(ssd1306_t *p) {
+    p->shadowValid=false;
+}
+
 void ssd1306_show(ssd1306_t *p) {
-    // the last item in the payload sets the startline to zero
-    uint8_t payload[]= {SET_COL_ADDR, 0, p->width-1, SET_PAGE_ADDR, 0, p->pages-1, 0x40};
-    if(p->width==64) {
-        payload[1]+=32;
-        payload[2]+=32;
+    // the last frame is still going out, whatever changed stays changed for the next one
+    if(dma_channel_is_busy(I2C_DMA_CHANNEL_WRITE)) {
+        p->framesSkipped++;
+        return;
     }
-
-    for(size_t i=0; i<sizeof(payload); ++i){
-        ssd1306_write(p, payload[i]);
+    uint8_t colOffset = p->width==64 ? 32 : 0;
+    size_t length = 0;
+    uint32_t dataBytes = 0;
+    // each dirty page is a window, the commands and data for all of them go out in one dma transfer
+    // a restart in front of the control byte starts the next i2c message
+    for(uint8_t page=0;page<p->pages;page++)
+    {
+        uint8_t *row = p->buffer+page*p->width;
+        uint8_t *shadowRow = p->shadow+page*p->width;
+        int first = 0;
+        int last = p->width-1;
+        if(p->shadowValid)
+        {
+            while(first < p->width && row[first] == shadowRow[first])
+                first++;
+            if(first == p->width)
+                continue;
+            while(row[last] == shadowRow[last])
+                last--;
+        }
+        uint16_t *send = p->sendBuffer+length;
+        // control byte 0x00, the bytes after it are commands
+        send[0] = 0x00 | I2C_IC_DATA_CMD_RESTART_BITS;
+        send[1] = SET_COL_ADDR;
+        send[2] = first+colOffset;
+        send[3] = last+colOffset;
+        send[4] = SET_PAGE_ADDR;
+        send[5] = page;
+        send[6] = page;
+        // control byte 0x40, display data
+        send[7] = 0x40 | I2C_IC_DATA_CMD_RESTART_BITS;
+        send += SSD1306_WINDOW_COMMANDS;
+        for(int i=first;i<=last;i++)
+            send[i-first] = row[i];
+        memcpy(shadowRow+first, row+first, last-first+1);
+        length += SSD1306_WINDOW_COMMANDS+last-first+1;
+        dataBytes += last-first+1;
     }
-
-    // prefix the buffer with something?
-    memset(p->sendBuffer, 0, 2*(p->bufsize+2));
-
-    // signal that we are about to write ram / data
-    p->sendBuffer[0]=0x40;
-    // copy the bits into the sendbuffer
-    for(int i=0;i<p->bufsize;i++)
+    if(length == 0)
     {
-        p->sendBuffer[i+1] = *(p->buffer+i);
+        p->framesSkipped++;
+        return;
     }
-    // p->sendBuffer[1] = 0xff;
-    // p->sendBuffer[2] = 0xff;
-    p->sendBuffer[0] |= I2C_IC_DATA_CMD_RESTART_BITS;
-    p->sendBuffer[p->bufsize] |= I2C_IC_DATA_CMD_STOP_BITS;
-
-    fancy_write(p->i2c_i, p->address, (uint8_t*)p->sendBuffer, p->bufsize+1, "ssd1306_show");
+    p->shadowValid=true;
+    p->sendBuffer[length-1] |= I2C_IC_DATA_CMD_STOP_BITS;
+    p->bytesSent += dataBytes;
+    p->framesSent++;
+    fancy_write(p->i2c_i, p->address, (uint8_t*)p->sendBuffer, length, "ssd1306_show");
 }
 bool ssd1306_show_more(ssd1306_t *p)
 {
@@ -352,12 +408,92 @@ inline uint8_t *pgm_read_bitmap_ptr(const GFXfont *gfxFont) {
 #endif //__AVR__
 }
 
+// one font gets used for everything, so only the last one is kept
+static GFXPageFont pageFont = {NULL, NULL, NULL};
+
+bool ssd1306_prepare_gfxfont(const GFXfont *gfxFont)
+{
+    if(pageFont.font == gfxFont)
+        return true;
+    uint16_t glyphCount = gfxFont->last-gfxFont->first+1;
+    uint32_t columnCount = 0;
+    for(uint16_t g=0;g<glyphCount;g++)
+    {
+        if(gfxFont->glyph[g].height > 32)
+            return false;
+        columnCount += gfxFont->glyph[g].width;
+    }
+    uint32_t *columns = calloc(columnCount, sizeof(uint32_t));
+    uint16_t *glyphColumn = malloc(glyphCount*sizeof(uint16_t));
+    if(columns == NULL || glyphColumn == NULL)
+    {
+        free(columns);
+        free(glyphColumn);
+        return false;
+    }
+    free(pageFont.columns);
+    free(pageFont.glyphColumn);
+    uint16_t column = 0;
+    for(uint16_t g=0;g<glyphCount;g++)
+    {
+        const GFXglyph *glyph = &gfxFont->glyph[g];
+        const uint8_t *bitmap = gfxFont->bitmap+glyph->bitmapOffset;
+        glyphColumn[g] = column;
+        // the bitmap is rows of bits, msb first, packed without padding
+        uint16_t bit = 0;
+        for(uint8_t yy=0;yy<glyph->height;yy++)
+        {
+            for(uint8_t xx=0;xx<glyph->width;xx++,bit++)
+            {
+                if(bitmap[bit>>3] & (0x80>>(bit&7)))
+                    columns[column+xx] |= 0x80000000u>>yy;
+            }
+        }
+        column += glyph->width;
+    }
+    pageFont.font = gfxFont;
+    pageFont.columns = columns;
+    pageFont.glyphColumn = glyphColumn;
+    return true;
+}
+
+// the display is mounted upside down, screen row 0 is the top bit of the last page
+static void ssd1306_blit_glyph(ssd1306_t *p, int16_t x, int16_t y, uint8_t glyphIndex, bool white)
+{
+    const GFXglyph *glyph = &pageFont.font->glyph[glyphIndex];
+    const uint32_t *columns = pageFont.columns+pageFont.glyphColumn[glyphIndex];
+    int16_t top = y+glyph->yOffset;
+    if(top >= 32 || top <= -32)
+        return;
+    for(uint8_t xx=0;xx<glyph->width;xx++)
+    {
+        int16_t screenX = x+glyph->xOffset+xx;
+        if(screenX < p->clip_x0 || screenX >= p->clip_x1)
+            continue;
+        uint32_t mask = top >= 0 ? columns[xx]>>top : columns[xx]<<-top;
+        mask &= p->clip_mask;
+        uint8_t *column = p->buffer+(p->width-1-screenX);
+        for(uint8_t page=0;page<4 && mask;page++,mask>>=8)
+        {
+            uint8_t bits = mask;
+            if(bits == 0)
+                continue;
+            if(white)
+                column[page*p->width] |= bits;
+            else
+                column[page*p->width] &= ~bits;
+        }
+    }
+}
+
 void ssd1306_draw_string_gfxfont(ssd1306_t *p, int16_t x, int16_t y, const char *s,
                             bool white, uint8_t size_x,
                             uint8_t size_y, const GFXfont *gfxFont)
 {
     int16_t cursor_x = x;
     uint8_t first = pgm_read_byte(&gfxFont->first);
+    // whole bytes at a time when the font is in page columns, the scaled and other sized displays go pixel by pixel
+    bool blit = size_x == 1 && size_y == 1 && p->height == 32 && ssd1306_prepare_gfxfont(gfxFont);
     while(*s) {
         if ((*s < first) || (*s > (uint8_t)pgm_read_byte(&gfxFont->last)))
         {
@@ -367,7 +503,9 @@ void ssd1306_draw_string_gfxfont(ssd1306_t *p, int16_t x, int16_t y, const char
         GFXglyph *glyph = pgm_read_glyph_ptr(gfxFont, *s - first);
         uint8_t w = pgm_read_byte(&glyph->width),
                 h = pgm_read_byte(&glyph->height);
-        if ((w > 0) && (h > 0)) { // Is there an associated bitmap?
+        if ((w > 0) && (h > 0) && blit) {
+            ssd1306_blit_glyph(p, cursor_x, y, *s - first, white);
+        } else if ((w > 0) && (h > 0)) { // Is there an associated bitmap?
             ssd1306_draw_char_gfxfont(p, cursor_x, y, *s,
                         white, size_x,
                         size_y, gfxFont);
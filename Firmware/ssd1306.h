@@ -72,11 +72,19 @@ typedef struct {
     uint8_t *buffer;	/**< display buffer */
     uint16_t *sendBuffer;	/**< buffer for dma sending */
     size_t bufsize;		/**< buffer size */
+    uint8_t *shadow;	/**< what the display has in its ram, to only send what changed */
+    bool shadowValid;	/**< false until the first full frame has gone out */
+    uint32_t bytesSent;	/**< display bytes sent, not counting commands */
+    uint32_t framesSent;
+    uint32_t framesSkipped;	/**< frames with no change, or the last one was still going out */
 	// tracking for our partial screenwrites
 	size_t writeRemain;
 	uint8_t *writeBuffer;
 	int dma_chan_output;
 	bool string_invert;
+	// drawing only touches pixels inside the clip, see ssd1306_set_clip
+	uint8_t clip_x0, clip_y0, clip_x1, clip_y1;
+	uint32_t clip_mask;	/**< the clip rows as a page column mask, for the glyph blit */
 } ssd1306_t;
 // our colors actually go the other way around gbr
 static inline uint32_t urgb_u32(uint8_t r, uint8_t g, uint8_t b) {
@@ -141,13 +149,34 @@ void ssd1306_invert(ssd1306_t *p, uint8_t inv);
 /**
 	@brief display buffer, should be called on change
 
+	only the columns that changed on each page are sent, a frame with no change sends nothing
+
 	@param[in] p : instance of display
 
 */
 void ssd1306_show(ssd1306_t *p);
 
+/**
+	@brief send the whole frame on the next show, for when the display ram can't be trusted
+
+	@param[in] p : instance of display
+
+*/
+void ssd1306_invalidate(ssd1306_t *p);
+
 bool ssd1306_show_more(ssd1306_t *p);
 
+/**
+	@brief limit drawing to a rectangle, so part of the screen can be redrawn without touching the rest
+
+	@param[in] p : instance of display
+	@param[in] x0 : left, inclusive
+	@param[in] y0 : top, inclusive
+	@param[in] x1 : right, exclusive
+	@param[in] y1 : bottom, exclusive
+*/
+void ssd1306_set_clip(ssd1306_t *p, int32_t x0, int32_t y0, int32_t x1, int32_t y1);
+
 /**
 	@brief clear display buffer
 
@@ -264,4 +293,16 @@ void ssd1306_draw_string_gfxfont(ssd1306_t *p, int16_t x, int16_t y, const char
 void ssd1306_draw_char_gfxfont(ssd1306_t *p, int16_t x, int16_t y, unsigned char c,
                             bool white, uint8_t size_x,
                             uint8_t size_y, const GFXfont *gfxFont);
+
+/**
+	@brief rasterize a font into page columns, so unscaled strings are drawn a byte at a time
+
+	the draw functions do this for the font on first use, it only needs calling to take the time up front
+
+	@param[in] gfxFont : font to rasterize
+
+	@return bool.
+	@retval false if the font doesn't fit in 32 bit columns or there isn't the memory
+*/
+bool ssd1306_prepare_gfxfont(const GFXfont *gfxFont);
 #endif
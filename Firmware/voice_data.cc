@@ -1,21 +1,27 @@
 #include "voice_data.h"
-#include "m6x118pt7b.h"
+#include "UiDisplayList.h"
 
 ParamLockPool VoiceData::lockPool;
+void (*VoiceData::beforeWrite)(VoiceData *voice) = NULL;
+void (*VoiceData::beforePatternWrite)(VoiceData *voice, uint8_t pattern) = NULL;
+bool VoiceData::rateChanged = true;
 
 void VoiceData::InitDefaults()
 {
     for (size_t i = 0; i < 16; i++)
     {
         locksForPattern[i] = ParamLockPool::InvalidLockPosition();
+        ClearLockIndex(i);
         internalData.patterns[i].rate = 2*37; // 1x 
         internalData.patterns[i].length = 15*4; // need to up this to fit into 0xff
     }
+    rateChanged = true;
     SetDefaultParams();
 }
 
 void VoiceData::SetDefaultParams()
 {
+    MarkDirty();
     internalData.portamento = 0x00;
     internalData.fineTune = 0x80;
 
@@ -61,7 +67,7 @@ bool VoiceDataInternal_encode_locks(pb_ostream_t *ostream, const pb_field_t *fie
         }
         VoiceDataInternal_LockPointer lock = VoiceDataInternal_LockPointer_init_zero;
         lock.pattern = i;
-        lock.pointer = locksForPattern[i];
+        lock.pointer = ParamLockPool::EncodePosition(locksForPattern[i]);
         if (!pb_encode_submessage(ostream, VoiceDataInternal_LockPointer_fields, &lock))
         {
             const char * error = PB_GET_ERROR(ostream);
@@ -79,39 +85,67 @@ void VoiceData::Serialize(pb_ostream_t *s)
     internalData.which_extraTypeUnion = VoiceDataInternal_synthShape_tag;
     internalData.locksForPattern.funcs.encode = &VoiceDataInternal_encode_locks;
     internalData.locksForPattern.arg = locksForPattern;
+    // patterns are written with SerializePattern
+    internalData.patterns_count = 0;
     pb_encode_ex(s, VoiceDataInternal_fields, &internalData, PB_ENCODE_DELIMITED);
 }
+void VoiceData::SerializePattern(pb_ostream_t *s, uint8_t pattern)
+{
+    pb_encode_ex(s, VoiceDataInternal_Pattern_fields, &internalData.patterns[pattern], PB_ENCODE_DELIMITED);
+}
+void VoiceData::DeserializePattern(pb_istream_t *s, uint8_t pattern)
+{
+    if(!pb_decode_ex(s, VoiceDataInternal_Pattern_fields, &internalData.patterns[pattern], PB_DECODE_DELIMITED))
+    {
+        const char * error = PB_GET_ERROR(s);
+        printf("VoiceData pattern deserialize error: %s\n", error);
+    }
+    rateChanged = true;
+    CountNotesForPattern(pattern);
+}
+void VoiceData::CountNotesForPattern(uint8_t pattern)
+{
+    noteCountForPattern[pattern] = 0;
+    for(int j=0;j<64;j++)
+    {
+        if((GetNotesForPattern(pattern)[j] >> 7) == 1)
+        {
+            noteCountForPattern[pattern]++;
+        }
+    }
+}
 bool VoiceDataInternal_decode_locks(pb_istream_t *stream, const pb_field_iter_t *field, void **arg)
 {
     uint16_t* locksForPattern = *(uint16_t**)arg;
     VoiceDataInternal_LockPointer lock = VoiceDataInternal_LockPointer_init_zero;
     if (!pb_decode(stream, VoiceDataInternal_LockPointer_fields, &lock))
         return false;
-    locksForPattern[lock.pattern] = lock.pointer;
+    locksForPattern[lock.pattern] = ParamLockPool::DecodePosition(lock.pointer);
     return true;
 }
 
 
 void VoiceData::Deserialize(pb_istream_t *s)
 {
+    // patterns without locks aren't written, so clear out anything left from an earlier record
+    for(int i=0;i<16;i++)
+    {
+        locksForPattern[i] = ParamLockPool::InvalidLockPosition();
+        ClearLockIndex(i);
+    }
     internalData.locksForPattern.funcs.decode = &VoiceDataInternal_decode_locks;
     internalData.locksForPattern.arg = locksForPattern;
+    // patterns aren't reset by the decode, older files still have them in the voice record
     if(!pb_decode_ex(s, VoiceDataInternal_fields, &internalData, PB_DECODE_DELIMITED))
     {
         const char * error = PB_GET_ERROR(s);
         printf("VoiceData deserialize error: %s\n", error);
     }
+    baseParamsValid = false;
     // count the number of notes for each pattern
-    for(int i=0;i<16;i++)
+    for(int i=0;i<internalData.patterns_count;i++)
     {
-        noteCountForPattern[i] = 0;
-        for(int j=0;j<64;j++)
-        {
-            if((GetNotesForPattern(i)[j] >> 7) == 1)
-            {
-                noteCountForPattern[i]++;
-            }
-        }
+        CountNotesForPattern(i);
     }
 }
 void VoiceData::SerializeStatic(pb_ostream_t *s)
@@ -127,62 +161,92 @@ void VoiceData::DeserializeStatic(pb_istream_t *s)
 uint8_t VoiceData::GetParamValue(ParamType param, uint8_t lastNotePlayed, uint8_t step, uint8_t pattern)
 {
     uint8_t value;
-    // instrument special case
-    if(GetInstrumentType() == INSTRUMENT_MACRO)
+    if(param == Length)
+        return internalData.patterns[pattern].length;
+    if(param >= PARAM_VECTOR_SIZE)
+        return 0;
+    if(HasLockForStep(step, pattern, param, value))
+        return value;
+    if(GetInstrumentType() == INSTRUMENT_SAMPLE)
     {
         switch(param)
         {
-            case Timbre: return HasLockForStep(step, pattern, Timbre, value)?value:internalData.timbre;
-            case Color: return HasLockForStep(step, pattern, Color, value)?value:internalData.color;
+            case SampleIn: return internalData.sampleStart[lastNotePlayed];
+            case SampleOut: return internalData.sampleLength[lastNotePlayed];
         }
     }
-    if(GetInstrumentType() == INSTRUMENT_MIDI)
-    {
-        switch(param)
-        {
-            case Timbre: return HasLockForStep(step, pattern, Timbre, value)?value:internalData.timbre;
-            case MidiHold: return HasLockForStep(step, pattern, MidiHold, value)?value:internalData.color;
-        }
+    return GetBaseParams().values[param];
+}
+void VoiceData::ResolveParams(uint8_t step, uint8_t pattern, ParamVector &params)
+{
+    params = GetBaseParams();
+    if(step >= 64 || !((stepsWithLocks[pattern]>>step)&1))
+        return;
+    // the locks for a step are next to each other in the sorted list
+    uint16_t position = firstLockForPage[pattern][step>>4];
+    while(lockPool.IsValidLock(position))
+    {
+        ParamLock* lock = lockPool.GetLock(position);
+        if(lock->step > step)
+            break;
+        if(lock->step == step && lock->param < PARAM_VECTOR_SIZE && lock->param != Length)
+            params.values[lock->param] = lock->value;
+        position = lockPool.GetNext(lock);
     }
-    if(GetInstrumentType() == INSTRUMENT_SAMPLE)
-    {
-        switch(param)
-        {
-            case SampleIn: return HasLockForStep(step, pattern, SampleIn, value)?value:internalData.sampleStart[lastNotePlayed];
-            case SampleOut: return HasLockForStep(step, pattern, SampleOut, value)?value:internalData.sampleLength[lastNotePlayed];
-            case AttackTime: return HasLockForStep(step, pattern, AttackTime, value)?value:internalData.sampleAttack;
-            case DecayTime: return HasLockForStep(step, pattern, DecayTime, value)?value:internalData.sampleDecay;
-        }
+}
+// only rebuilt after the voice has been edited, so a trigger never has to go through the switches
+ParamVector& VoiceData::GetBaseParams()
+{
+    if(baseParamsValid)
+        return baseParams;
+    uint8_t *v = baseParams.values;
+    memset(v, 0, sizeof(baseParams.values));
+    v[Cutoff] = internalData.cutoff;
+    v[Resonance] = internalData.resonance;
+    v[Volume] = internalData.volume;
+    v[Pan] = internalData.pan;
+    v[Portamento] = internalData.portamento;
+    v[FineTune] = internalData.fineTune;
+    v[AttackTime] = internalData.env1.attack;
+    v[DecayTime] = internalData.env1.decay;
+    v[Env1Target] = internalData.env1.target;
+    v[Env1Depth] = internalData.env1.depth;
+    v[AttackTime2] = internalData.env2.attack;
+    v[DecayTime2] = internalData.env2.decay;
+    v[Env2Target] = internalData.env2.target;
+    v[Env2Depth] = internalData.env2.depth;
+    v[LFORate] = internalData.lfoRate;
+    v[LFODepth] = internalData.lfoDepth;
+    v[Lfo1Target] = internalData.lfoTarget;
+    v[RetriggerSpeed] = internalData.retriggerSpeed;
+    v[RetriggerLength] = internalData.retriggerLength;
+    v[RetriggerFade] = internalData.retriggerFade;
+    v[DelaySend] = internalData.delaySend;
+    v[ReverbSend] = internalData.reverbSend;
+    v[ConditionMode] = internalData.conditionMode;
+    v[ConditionData] = internalData.conditionData;
+    // instrument special cases
+    switch(GetInstrumentType())
+    {
+        case INSTRUMENT_MACRO:
+            v[Timbre] = internalData.timbre;
+            v[Color] = internalData.color;
+            break;
+        case INSTRUMENT_MIDI:
+            v[Timbre] = internalData.timbre;
+            v[MidiHold] = internalData.color;
+            break;
+        case INSTRUMENT_SAMPLE:
+            v[SampleIn] = internalData.sampleStart[0];
+            v[SampleOut] = internalData.sampleLength[0];
+            v[AttackTime] = internalData.sampleAttack;
+            v[DecayTime] = internalData.sampleDecay;
+            break;
+        default:
+            break;
     }
-    switch(param)
-    {
-        case Cutoff: return HasLockForStep(step, pattern, Cutoff, value)?value:internalData.cutoff;
-        case Resonance: return HasLockForStep(step, pattern, Resonance, value)?value:internalData.resonance;
-        case Volume: return HasLockForStep(step, pattern, Volume, value)?value:internalData.volume;
-        case Pan: return HasLockForStep(step, pattern, Pan, value)?value:internalData.pan;
-        case Portamento: return HasLockForStep(step, pattern, Portamento, value)?value:internalData.portamento;
-        case FineTune: return HasLockForStep(step, pattern, FineTune, value)?value:internalData.fineTune;
-        case AttackTime: return HasLockForStep(step, pattern, AttackTime, value)?value:internalData.env1.attack;
-        case DecayTime: return HasLockForStep(step, pattern, DecayTime, value)?value:internalData.env1.decay;
-        case Env1Target: return HasLockForStep(step, pattern, Env1Target, value)?value:internalData.env1.target;
-        case Env1Depth: return HasLockForStep(step, pattern, Env1Depth, value)?value:internalData.env1.depth;
-        case AttackTime2: return HasLockForStep(step, pattern, AttackTime2, value)?value:internalData.env2.attack;
-        case DecayTime2: return HasLockForStep(step, pattern, DecayTime2, value)?value:internalData.env2.decay;
-        case Env2Target: return HasLockForStep(step, pattern, Env2Target, value)?value:internalData.env2.target;
-        case Env2Depth: return HasLockForStep(step, pattern, Env2Depth, value)?value:internalData.env2.depth;
-        case LFORate: return HasLockForStep(step, pattern, LFORate, value)?value:internalData.lfoRate;
-        case LFODepth: return HasLockForStep(step, pattern, LFODepth, value)?value:internalData.lfoDepth;
-        case Lfo1Target: return HasLockForStep(step, pattern, Lfo1Target, value)?value:internalData.lfoTarget;
-        case RetriggerSpeed: return HasLockForStep(step, pattern, RetriggerSpeed, value)?value:internalData.retriggerSpeed;
-        case RetriggerLength: return HasLockForStep(step, pattern, RetriggerLength, value)?value:internalData.retriggerLength;
-        case RetriggerFade: return HasLockForStep(step, pattern, RetriggerFade, value)?value:internalData.retriggerFade;
-        case Length: return internalData.patterns[pattern].length;
-        case DelaySend: return HasLockForStep(step, pattern, DelaySend, value)?value:internalData.delaySend;
-        case ReverbSend: return HasLockForStep(step, pattern, ReverbSend, value)?value:internalData.reverbSend;
-        case ConditionMode: return HasLockForStep(step, pattern, ConditionMode, value)?value:internalData.conditionMode;
-        case ConditionData: return HasLockForStep(step, pattern, ConditionData, value)?value:internalData.conditionData;
-    }
-    return 0;
+    baseParamsValid = true;
+    return baseParams;
 }
 
 // used for setting the value in place
@@ -663,20 +727,20 @@ uint8_t head_map[] = {
 
 void VoiceData::DrawParamString(uint8_t param, char *str, uint8_t lastNotePlayed, uint8_t currentPattern, uint8_t paramLock, bool showForStep)
 {
-    ssd1306_t* disp = GetDisplay();
+    UiDisplayList *ui = GetDisplayList();
     uint8_t width = 36;
     uint8_t column4 = 128-width;
         bool lockA = false, lockB = false;
         GetParamsAndLocks(param, paramLock, currentPattern, str, str+16, lastNotePlayed, str+32, str+48, lockA, lockB, showForStep);
         if(lockA)
-            ssd1306_draw_square_rounded(disp, column4, 0, width, 15);
+            ui->DrawSquareRounded(column4, 0, width, 15);
         if(lockB)
-            ssd1306_draw_square_rounded(disp, column4, 17, width, 15);
-        ssd1306_draw_string_gfxfont(disp, column4+3, 12, str+32, !lockA, 1, 1, &m6x118pt7b);
-        ssd1306_draw_string_gfxfont(disp, column4+3, 17+12, str+48, !lockB, 1, 1, &m6x118pt7b);
+            ui->DrawSquareRounded(column4, 17, width, 15);
+        ui->DrawString(column4+3, 12, str+32, !lockA);
+        ui->DrawString(column4+3, 17+12, str+48, !lockB);
         
-        ssd1306_draw_string_gfxfont(disp, column4-33, 12, str, true, 1, 1, &m6x118pt7b);    
-        ssd1306_draw_string_gfxfont(disp, column4-33, 17+12, str+16, true, 1, 1, &m6x118pt7b);
+        ui->DrawString(column4-33, 12, str, true);    
+        ui->DrawString(column4-33, 17+12, str+16, true);
 }
 
 
@@ -686,16 +750,35 @@ int8_t VoiceData::GetOctave()
 }
 
 /* PARAMETER LOCK BEHAVIOR */
+// the lock list of each pattern is kept sorted by step, so all the locks for a step
+// are next to each other. stepsWithLocks answers most lookups without touching the
+// list, and firstLockForPage lets the rest start close to their step.
 void VoiceData::StoreParamLock(uint8_t param, uint8_t step, uint8_t pattern, uint8_t value)
 {
     ParamLock *lock;
     // strip the highbit
+    MarkDirty();
     if(GetLockForStep(&lock, step, pattern, param))
     {
+        lockPool.MarkDirty(lock);
         lock->value = value;
         // printf("updated param lock step: %i param: %i value: %i\n", step, param, value);
         return;
     }
+    // the lock only has 6 bits for each
+    if(step >= 64 || param >= 64)
+    {
+        printf("param lock step %i param %i out of range\n", step, param);
+        return;
+    }
+    // new locks go after the locks that are already there for this step
+    uint16_t previous = ParamLockPool::InvalidLockPosition();
+    uint16_t next = locksForPattern[pattern];
+    while(lockPool.IsValidLock(next) && lockPool.GetLock(next)->step <= step)
+    {
+        previous = next;
+        next = lockPool.GetNext(lockPool.GetLock(next));
+    }
     if(lockPool.GetFreeParamLock(&lock))
     {
         if(!lockPool.IsValidLock(lock))
@@ -703,47 +786,75 @@ void VoiceData::StoreParamLock(uint8_t param, uint8_t step, uint8_t pattern, uin
             printf("out of lock space\n failed to add new lock");
             return;
         }
+        uint16_t position = lockPool.GetLockPosition(lock);
         lock->param = param;
         lock->step = step;
         lock->value = value;
-        lock->next = locksForPattern[pattern];
-        locksForPattern[pattern] = lockPool.GetLockPosition(lock);
+        lockPool.SetNext(lock, next);
+        if(lockPool.IsValidLock(previous))
+        {
+            lockPool.MarkDirty(lockPool.GetLock(previous));
+            lockPool.SetNext(lockPool.GetLock(previous), position);
+        }
+        else
+        {
+            locksForPattern[pattern] = position;
+        }
+        stepsWithLocks[pattern] |= 1ull<<step;
+        if(!lockPool.IsValidLock(previous) || (lockPool.GetLock(previous)->step>>4) != (step>>4))
+        {
+            firstLockForPage[pattern][step>>4] = position;
+        }
         return;
     }
     printf("failed to add param lock\n");
 }
 void VoiceData::ClearParameterLocks(uint8_t pattern)
 {
+    MarkDirty();
     ParamLock* lock = lockPool.GetLock(locksForPattern[pattern]);
     while(lockPool.IsValidLock(lock))
     {
-        ParamLock* nextLock = lockPool.GetLock(lock->next);
+        ParamLock* nextLock = lockPool.GetLock(lockPool.GetNext(lock));
         lockPool.ReturnLockToPool(lock);
         lock = nextLock;
     }
     locksForPattern[pattern] = ParamLockPool::InvalidLockPosition();
+    ClearLockIndex(pattern);
 }
 void VoiceData::RemoveLocksForStep(uint8_t pattern, uint8_t step)
 {
-    ParamLock* lock = lockPool.GetLock(locksForPattern[pattern]);
-    ParamLock* lastLock = lock;
-    while(lockPool.IsValidLock(lock))
+    if(step >= 64 || !((stepsWithLocks[pattern]>>step)&1))
+        return;
+    MarkDirty();
+    uint16_t previous = ParamLockPool::InvalidLockPosition();
+    uint16_t position = locksForPattern[pattern];
+    while(lockPool.IsValidLock(position) && lockPool.GetLock(position)->step < step)
     {
-        ParamLock* nextLock = lockPool.GetLock(lock->next);
-        if(lock->step == step)
-        {
-            lastLock->next = lock->next;
-            lockPool.ReturnLockToPool(lock);
-            if(lockPool.GetLockPosition(lock) == locksForPattern[pattern])
-            {
-                locksForPattern[pattern] = lockPool.GetLockPosition(nextLock);
-            }
-        }
-        else
-        {
-            lastLock = lock;
-        }
-        lock = nextLock;
+        previous = position;
+        position = lockPool.GetNext(lockPool.GetLock(position));
+    }
+    while(lockPool.IsValidLock(position) && lockPool.GetLock(position)->step == step)
+    {
+        ParamLock *lock = lockPool.GetLock(position);
+        position = lockPool.GetNext(lock);
+        lockPool.ReturnLockToPool(lock);
+    }
+    if(lockPool.IsValidLock(previous))
+    {
+        lockPool.MarkDirty(lockPool.GetLock(previous));
+        lockPool.SetNext(lockPool.GetLock(previous), position);
+    }
+    else
+    {
+        locksForPattern[pattern] = position;
+    }
+    stepsWithLocks[pattern] &= ~(1ull<<step);
+    uint8_t page = step>>4;
+    if(!lockPool.IsValidLock(previous) || (lockPool.GetLock(previous)->step>>4) != page)
+    {
+        bool samePage = lockPool.IsValidLock(position) && (lockPool.GetLock(position)->step>>4) == page;
+        firstLockForPage[pattern][page] = samePage ? position : ParamLockPool::InvalidLockPosition();
     }
 }
 void VoiceData::CopyParameterLocks(uint8_t fromPattern, uint8_t toPattern)
@@ -752,7 +863,7 @@ void VoiceData::CopyParameterLocks(uint8_t fromPattern, uint8_t toPattern)
     while(lockPool.IsValidLock(lock))
     {
         StoreParamLock(lock->param, lock->step, toPattern, lock->value);
-        lock = lockPool.GetLock(lock->next);
+        lock = lockPool.GetLock(lockPool.GetNext(lock));
     }
 }
 bool VoiceData::HasLockForStep(uint8_t step, uint8_t pattern, uint8_t param, uint8_t &value)
@@ -768,30 +879,93 @@ bool VoiceData::HasLockForStep(uint8_t step, uint8_t pattern, uint8_t param, uin
 }
 bool VoiceData::HasAnyLockForStep(uint8_t step, uint8_t pattern)
 {
-    ParamLock* lock = lockPool.GetLock(locksForPattern[pattern]);
-    while(lockPool.IsValidLock(lock))
+    return step < 64 && ((stepsWithLocks[pattern]>>step)&1);
+}
+bool VoiceData::GetLockForStep(ParamLock **lockOut, uint8_t step, uint8_t pattern, uint8_t param)
+{
+    if(step >= 64 || !((stepsWithLocks[pattern]>>step)&1))
+        return false;
+    uint16_t position = firstLockForPage[pattern][step>>4];
+    while(lockPool.IsValidLock(position))
     {
-        if(lock->step == step)
+        ParamLock* lock = lockPool.GetLock(position);
+        if(lock->step > step)
+            return false;
+        if(lock->param == param && lock->step == step)
         {
+            *lockOut = lock;
             return true;
         }
-        lock = lockPool.GetLock(lock->next);
+        position = lockPool.GetNext(lock);
     }
     return false;
 }
-bool VoiceData::GetLockForStep(ParamLock **lockOut, uint8_t step, uint8_t pattern, uint8_t param)
+void VoiceData::ClearLockIndex(uint8_t pattern)
 {
-    ParamLock* lock = lockPool.GetLock(locksForPattern[pattern]);
-    while(lockPool.IsValidLock(lock))
+    stepsWithLocks[pattern] = 0;
+    for(int page=0;page<4;page++)
     {
-        if(lock->param == param && lock->step == step)
+        firstLockForPage[pattern][page] = ParamLockPool::InvalidLockPosition();
+    }
+}
+void VoiceData::RebuildLockIndex()
+{
+    for(int pattern=0;pattern<16;pattern++)
+    {
+        // lists saved before the index existed are in the order the locks were added
+        bool sorted = true;
+        ParamLock* check = lockPool.GetLock(locksForPattern[pattern]);
+        while(lockPool.IsValidLock(check) && lockPool.IsValidLock(lockPool.GetNext(check)))
         {
-            *lockOut = lock;
-            return true;
+            if(lockPool.GetLock(lockPool.GetNext(check))->step < check->step)
+                sorted = false;
+            check = lockPool.GetLock(lockPool.GetNext(check));
+        }
+        if(!sorted)
+        {
+            MarkDirty();
+            uint16_t sortedHead = ParamLockPool::InvalidLockPosition();
+            uint16_t position = locksForPattern[pattern];
+            while(lockPool.IsValidLock(position))
+            {
+                ParamLock* lock = lockPool.GetLock(position);
+                uint16_t next = lockPool.GetNext(lock);
+                lockPool.MarkDirty(lock);
+                // insertion sort, equal steps keep their order
+                uint16_t previous = ParamLockPool::InvalidLockPosition();
+                uint16_t current = sortedHead;
+                while(lockPool.IsValidLock(current) && lockPool.GetLock(current)->step <= lock->step)
+                {
+                    previous = current;
+                    current = lockPool.GetNext(lockPool.GetLock(current));
+                }
+                lockPool.SetNext(lock, current);
+                if(lockPool.IsValidLock(previous))
+                    lockPool.SetNext(lockPool.GetLock(previous), position);
+                else
+                    sortedHead = position;
+                position = next;
+            }
+            locksForPattern[pattern] = sortedHead;
+        }
+        ClearLockIndex(pattern);
+        uint16_t position = locksForPattern[pattern];
+        int8_t lastPage = -1;
+        while(lockPool.IsValidLock(position))
+        {
+            ParamLock* lock = lockPool.GetLock(position);
+            if(lock->step < 64)
+            {
+                stepsWithLocks[pattern] |= 1ull<<lock->step;
+                if((lock->step>>4) != lastPage)
+                {
+                    lastPage = lock->step>>4;
+                    firstLockForPage[pattern][lastPage] = position;
+                }
+            }
+            position = lockPool.GetNext(lock);
         }
-        lock = lockPool.GetLock(lock->next);
     }
-    return false;
 }
 
 
@@ -808,7 +982,7 @@ void TestVoiceData()
     printf("%i, %i\n", hasLock, lockValue);
 
     int lostLockCount = 0;
-    for(int l=0;l<16*256;l++)
+    for(int l=0;l<LOCKCOUNT;l++)
     {
         ParamLock *searchingForLock = voiceData.lockPool.GetLock(l);
         bool foundLock = false;
@@ -823,11 +997,11 @@ void TestVoiceData()
                         foundLock = true;
                         break;
                     }
-                    if(lock == voiceData.lockPool.GetLock(lock->next))
+                    if(lock == voiceData.lockPool.GetLock(voiceData.lockPool.GetNext(lock)))
                     {
                         break;
                     }
-                    lock = voiceData.lockPool.GetLock(lock->next);
+                    lock = voiceData.lockPool.GetLock(voiceData.lockPool.GetNext(lock));
                 }
             }
         }
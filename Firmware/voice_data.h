@@ -87,12 +87,22 @@ enum ParamType {
     Lfo1Target = 34,
     RetriggerFade = 36,
     Length = 40,
+    Rate = 41, // pattern playback rate
     ConditionMode = 42,
     ConditionData = 43,
     DelaySend = 44, 
     ReverbSend = 45
 };
 
+// ParamType values all fit below this
+#define PARAM_VECTOR_SIZE 46
+
+// the value of every parameter as the instruments use it, indexed by ParamType
+struct ParamVector
+{
+    uint8_t values[PARAM_VECTOR_SIZE];
+};
+
 enum SamplerPlayerType
 {
   SAMPLE_PLAYER_SLICE,
@@ -115,6 +125,7 @@ class VoiceData
             uint8_t targetLength = priorLength*2;
             if(targetLength>64)
                 return;
+            MarkPatternDirty(pattern);
             noteCountForPattern[pattern] = noteCountForPattern[pattern]*2;
             internalData.patterns[pattern].length = (targetLength-1)*4;
             for (size_t i = 0; i < priorLength; i++)
@@ -125,10 +136,22 @@ class VoiceData
         }
 
         void InitDefaults();
+        // back to an empty voice, for starting on another song
+        void Reset()
+        {
+            internalData = VoiceDataInternal_init_default;
+            memset(noteCountForPattern, 0, sizeof(noteCountForPattern));
+            InitDefaults();
+            dirtyPatterns = 0xffff;
+        }
+        // the voice record, everything except the patterns
         void Serialize(pb_ostream_t *s);
         void Deserialize(pb_istream_t *s);
+        void SerializePattern(pb_ostream_t *s, uint8_t pattern);
+        void DeserializePattern(pb_istream_t *s, uint8_t pattern);
         void CopyPattern(uint8_t from, uint8_t to)
         {
+            MarkPatternDirty(to);
             internalData.patterns[to].rate = internalData.patterns[from].rate; // 1x 
             internalData.patterns[to].length = internalData.patterns[from].length; // need to up this to fit into 0xff
             for (size_t i = 0; i < 64; i++)
@@ -140,6 +163,12 @@ class VoiceData
         }
         void SetNoteForPattern(uint8_t pattern, uint8_t note, uint8_t value)
         {
+            // a pattern that hasn't been loaded yet still holds the defaults, so load it before comparing
+            if(beforePatternWrite)
+                beforePatternWrite(this, pattern);
+            if(internalData.patterns[pattern].notes[note] == value)
+                return;
+            MarkPatternDirty(pattern);
             bool lastNoteActive = (internalData.patterns[pattern].notes[note] >> 7) == 1;
             bool currentNoteActive = (value >> 7) == 1;
             internalData.patterns[pattern].notes[note] = value;
@@ -185,6 +214,9 @@ class VoiceData
         void DrawParamString(uint8_t param, char *str, uint8_t lastNotePlayed, uint8_t currentPattern, uint8_t paramLock, bool showForStep);
         bool CheckLockAndSetDisplay(bool showForStep, uint8_t step, uint8_t pattern, uint8_t param, uint8_t value, char *paramString);
         uint8_t GetParamValue(ParamType param, uint8_t lastNotePlayed, uint8_t step, uint8_t currentPattern);
+        // every parameter with the locks of this step applied, this is what a trigger uses.
+        // SampleIn and SampleOut depend on the key, they hold the values for key 0
+        void ResolveParams(uint8_t step, uint8_t pattern, ParamVector &params);
 
         uint8_t GetMidiChannel(){
             return internalData.extraTypeUnion.midiChannel >> 4;
@@ -210,6 +242,7 @@ class VoiceData
             return (InstrumentType)((((uint16_t)internalData.instrumentType)*3) >> 8);
         }
         void SetInstrumentType(InstrumentType instrumentType) {
+            MarkDirty();
             internalData.instrumentType = (internalData.instrumentType * (0xff / 4));
         }
         void SetFile(ffs_file *_file)
@@ -234,6 +267,8 @@ class VoiceData
         void CopyParameterLocks(uint8_t fromPattern, uint8_t toPattern);
         bool HasLockForStep(uint8_t step, uint8_t pattern, uint8_t param, uint8_t &value);
         bool HasAnyLockForStep(uint8_t step, uint8_t pattern);
+        // sorts the lock lists and rebuilds the lookup index, call once the lock pool has been loaded
+        void RebuildLockIndex();
 
         bool LockableParam(uint8_t param);
         
@@ -250,6 +285,7 @@ class VoiceData
         static void DeserializeStatic(pb_istream_t *s);
         void CopyFrom(VoiceData &copy)
         {
+            MarkDirty();
             internalData.instrumentType = copy.internalData.instrumentType;
             // this copies the subtype (sampler type, synth shape or midichannel)
             internalData.extraTypeUnion.samplerType = copy.internalData.extraTypeUnion.samplerType;
@@ -286,6 +322,59 @@ class VoiceData
         }
 
 
+        // set whenever something that gets saved changes, so the song file only
+        // needs to write the voices that were actually edited. Writes through
+        // GetParam need to call this themselves.
+        void MarkDirty()
+        {
+            if(beforeWrite)
+                beforeWrite(this);
+            dirty = true;
+            // the write happens after this returns, baseParams is rebuilt on the next lookup
+            baseParamsValid = false;
+        }
+        bool IsDirty()
+        {
+            return dirty;
+        }
+        void ClearDirty()
+        {
+            dirty = false;
+        }
+        // patterns are saved as their own records, so they have their own flags
+        void MarkPatternDirty(uint8_t pattern)
+        {
+            if(beforePatternWrite)
+                beforePatternWrite(this, pattern);
+            dirtyPatterns |= 1<<pattern;
+            rateChanged = true;
+        }
+        bool IsPatternDirty(uint8_t pattern)
+        {
+            return (dirtyPatterns>>pattern)&1;
+        }
+        bool HasDirtyPatterns()
+        {
+            return dirtyPatterns != 0;
+        }
+        void ClearPatternDirty(uint8_t pattern)
+        {
+            dirtyPatterns &= ~(1<<pattern);
+        }
+        // for writes through GetParam, pattern length and rate live in the pattern record
+        void MarkParamDirty(uint8_t param, uint8_t pattern)
+        {
+            if(param == Length || param == Rate)
+                MarkPatternDirty(pattern);
+            else
+                MarkDirty();
+        }
+        // called before a voice is changed, lets a save that is in progress write out the old state first
+        static void (*beforeWrite)(VoiceData *voice);
+        static void (*beforePatternWrite)(VoiceData *voice, uint8_t pattern);
+        // set when a pattern rate might have changed, the sequencer reschedules its tracks on the next pulse
+        static bool rateChanged;
+
         uint8_t nextRequestedStep;
 
         // these are per pattern
@@ -293,10 +382,22 @@ class VoiceData
         
         static ParamLockPool lockPool;
         uint16_t locksForPattern[16] = {0};
+        // lock lookup index, bit n is set when step n has a lock
+        uint64_t stepsWithLocks[16] = {0};
+        // first lock of each 16 step page in the sorted lock list
+        uint16_t firstLockForPage[16][4];
         uint8_t noteCountForPattern[16] = {0}; 
     private:
         VoiceDataInternal internalData;
+        bool dirty = true;
+        uint16_t dirtyPatterns = 0xffff;
+        void CountNotesForPattern(uint8_t pattern);
+        void ClearLockIndex(uint8_t pattern);
         bool GetLockForStep(ParamLock **lockOut, uint8_t step, uint8_t pattern, uint8_t param);
+        ParamVector& GetBaseParams();
+        // the parameters without any locks, shared by every step
+        ParamVector baseParams;
+        bool baseParamsValid = false;
         ffs_file *file;
 };
 
@@ -5,152 +5,75 @@
  */
 
 // originally https://github.com/raspberrypi/pico-examples/blob/master/pio/ws2812/ws2812_parallel.c
+// there is only the one string, so this uses the serial program and the dma sends grb words straight from the frames
 
  #include "ws2812.h"
 
-#define FRAC_BITS 4
-#define NUM_PIXELS 25
-#define WS2812_PIN_BASE 22
+// the dma is done once the last words are in the fifo, they still take up to 8*30us to shift out
+#define WS2812_RESET_US (8*30+300)
 
-// horrible temporary hack to avoid changing pattern code
-static uint8_t *current_string_out;
-static bool current_string_4color;
+static uint32_t my_colors[20];
+// set when the colors changed and haven't gone out yet
+static bool colors_pending = true;
 
-static inline void ws_put_pixel(uint32_t pixel_grb) {
-    *current_string_out++ = pixel_grb & 0xffu;
-    *current_string_out++ = (pixel_grb >> 8u) & 0xffu;
-    *current_string_out++ = (pixel_grb >> 16u) & 0xffu;
-    if (current_string_4color) {
-        *current_string_out++ = 0; // todo adjust?
-    }
-}
-static inline uint32_t ws_urgb_u32(uint8_t r, uint8_t g, uint8_t b) {
-    return
-            ((uint32_t) (r) << 8) |
-            ((uint32_t) (g) << 16) |
-            (uint32_t) (b);
-}
-
-
-// Add FRAC_BITS planes of e to s and store in d
-void add_error(value_bits_t *d, const value_bits_t *s, const value_bits_t *e) {
-    uint32_t carry_plane = 0;
-    // add the FRAC_BITS low planes
-    for (int p = VALUE_PLANE_COUNT - 1; p >= 8; p--) {
-        uint32_t e_plane = e->planes[p];
-        uint32_t s_plane = s->planes[p];
-        d->planes[p] = (e_plane ^ s_plane) ^ carry_plane;
-        carry_plane = (e_plane & s_plane) | (carry_plane & (s_plane ^ e_plane));
-    }
-    // then just ripple carry through the non fractional bits
-    for (int p = 7; p >= 0; p--) {
-        uint32_t s_plane = s->planes[p];
-        d->planes[p] = s_plane ^ carry_plane;
-        carry_plane &= s_plane;
-    }
-}
+// two sets of dithered frames, the dma sends one while the other gets filled
+static uint32_t frames[2][WS2812_DITHER_FRAMES][NUM_PIXELS];
+// false when every frame of the set is the same, so it only needs to go out once
+static bool set_dithered[2];
+static volatile uint8_t sending_set = 0;
+static volatile uint8_t next_set = 0;
+static volatile bool running = false;
+static uint8_t dither_frame = 0;
 
-// takes 8 bit color values, multiply by brightness and store in bit planes
-void transform_strings(string_t **strings, uint num_strings, value_bits_t *values, uint value_length,
-                       uint frac_brightness) {
-    for (uint v = 0; v < value_length; v++) {
-        memset(&values[v], 0, sizeof(values[v]));
-        for (int i = 0; i < num_strings; i++) {
-            if (v < strings[i]->data_len) {
-                // todo clamp?
-                uint32_t value = (strings[i]->data[v] * strings[i]->frac_brightness) >> 8u;
-                value = (value * frac_brightness) >> 8u;
-                for (int j = 0; j < VALUE_PLANE_COUNT && value; j++, value >>= 1u) {
-                    if (value & 1u) values[v].planes[VALUE_PLANE_COUNT - 1 - j] |= 1u << i;
-                }
-            }
-        }
-    }
-}
+static int dma_channel;
+static uint32_t dma_channel_mask;
+static alarm_id_t reset_delay_alarm_id;
 
-void dither_values(const value_bits_t *colors, value_bits_t *state, const value_bits_t *old_state, uint value_length) {
-    for (uint i = 0; i < value_length; i++) {
-        add_error(state + i, colors + i, old_state + i);
-    }
+static void __not_in_flash_func(start_frame)()
+{
+    sending_set = next_set;
+    dither_frame = (dither_frame+1)&(WS2812_DITHER_FRAMES-1);
+    dma_channel_transfer_from_buffer_now(dma_channel, frames[sending_set][dither_frame], NUM_PIXELS);
 }
 
-// requested colors * 4 to allow for RGBW
-static value_bits_t colors[NUM_PIXELS * 4];
-// double buffer the state of the string, since we update next version in parallel with DMAing out old version
-static value_bits_t states[2][NUM_PIXELS * 4];
-
-// example - string 0 is RGB only
-static uint8_t string0_data[NUM_PIXELS * 3];
-
-string_t string0 = {
-    .data = string0_data,
-    .data_len = sizeof(string0_data),
-    .frac_brightness = 0x100,
-};
-
-
-string_t *strings[] = {
-    &string0,
-};
-
-// chain channel for configuring main dma channel to output from disjoint 8 word fragments of memory
-#define DMA_CB_CHANNEL 1
-
-uint32_t dma_channel_mask;
-uint32_t dma_cb_channel_mask;
-int dma_cb_channel;
-
-// start of each value fragment (+1 for NULL terminator)
-static uintptr_t fragment_start[NUM_PIXELS * 4 + 1];
-
-// posted when it is safe to output a new set of values
-static struct semaphore reset_delay_complete_sem;
-// alarm handle for handling delay
-alarm_id_t reset_delay_alarm_id;
-
-int64_t reset_delay_complete(alarm_id_t id, void *user_data) {
+static int64_t __not_in_flash_func(reset_delay_complete)(alarm_id_t id, void *user_data)
+{
     reset_delay_alarm_id = 0;
-    sem_release(&reset_delay_complete_sem);
+    // a still frame without dithering stops once it is out, the leds hold it
+    if(next_set == sending_set && !set_dithered[sending_set])
+        running = false;
+    else
+        start_frame();
     // no repeat
     return 0;
 }
 
-void __not_in_flash_func(dma_complete_handler)() {
+static void __not_in_flash_func(dma_complete_handler)()
+{
     if (dma_hw->ints0 & dma_channel_mask) {
         // clear IRQ
         dma_hw->ints0 = dma_channel_mask;
-        // when the dma is complete we start the reset delay timer
+        // when the dma is complete we start the reset delay timer, the next frame goes after it
         if (reset_delay_alarm_id) cancel_alarm(reset_delay_alarm_id);
-        reset_delay_alarm_id = add_alarm_in_us(400, reset_delay_complete, NULL, true);
+        reset_delay_alarm_id = add_alarm_in_us(WS2812_RESET_US, reset_delay_complete, NULL, true);
     }
 }
 
-void dma_init(PIO pio, uint sm) {    
-    int dma_channel = dma_claim_unused_channel(false);
+static void dma_init(PIO pio, uint sm)
+{
+    dma_channel = dma_claim_unused_channel(true);
     dma_channel_mask = 1u << dma_channel;
-    dma_cb_channel = dma_claim_unused_channel(true);
-    dma_cb_channel_mask = 1u << dma_cb_channel;
 
-    // main DMA channel outputs 8 word fragments, and then chains back to the chain channel
     dma_channel_config channel_config = dma_channel_get_default_config(dma_channel);
+    channel_config_set_transfer_data_size(&channel_config, DMA_SIZE_32);
+    channel_config_set_read_increment(&channel_config, true);
+    channel_config_set_write_increment(&channel_config, false);
     channel_config_set_dreq(&channel_config, pio_get_dreq(pio, sm, true));
-    channel_config_set_chain_to(&channel_config, dma_cb_channel);
-    channel_config_set_irq_quiet(&channel_config, true);
     dma_channel_configure(dma_channel,
                           &channel_config,
                           &pio->txf[sm],
-                          NULL, // set by chain
-                          8, // 8 words for 8 bit planes
-                          false);
-
-    // chain channel sends single word pointer to start of fragment each time
-    dma_channel_config chain_config = dma_channel_get_default_config(dma_cb_channel);
-    dma_channel_configure(dma_cb_channel,
-                          &chain_config,
-                          &dma_channel_hw_addr(
-                                  dma_channel)->al3_read_addr_trig,  // ch DMA config (target "ring" buffer size 4) - this is (read_addr trigger)
-                          NULL, // set later
-                          1,
+                          NULL, // set per frame
+                          NUM_PIXELS,
                           false);
 
     irq_add_shared_handler(DMA_IRQ_0, dma_complete_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
@@ -158,51 +81,76 @@ void dma_init(PIO pio, uint sm) {
     irq_set_enabled(DMA_IRQ_0, true);
 }
 
-void output_strings_dma(value_bits_t *bits, uint value_length) {
-    for (uint i = 0; i < value_length; i++) {
-        fragment_start[i] = (uintptr_t) bits[i].planes; // MSB first
+// the leds get a quarter of the 8 bit colors, the two bits that drops come back
+// as an ordered dither over the frames. the pattern is offset per pixel so they don't all flicker together
+static bool build_frames(uint32_t set[WS2812_DITHER_FRAMES][NUM_PIXELS])
+{
+    static const uint8_t pattern[WS2812_DITHER_FRAMES] = {0, 2, 1, 3};
+    bool dithered = false;
+    for (int j = 0; j < NUM_PIXELS; j++)
+    {
+        uint32_t c = j < 20 ? my_colors[j] : 0;
+        // our colors go out high byte first, then the low and the middle one
+        uint8_t v[3] = {(c>>16u) & 0xffu, c & 0xffu, (c>>8u) & 0xffu};
+        if((v[0]|v[1]|v[2]) & 3)
+            dithered = true;
+        for (int f = 0; f < WS2812_DITHER_FRAMES; f++)
+        {
+            uint32_t word = 0;
+            for (int k = 0; k < 3; k++)
+            {
+                uint32_t out = (v[k]>>2) + ((v[k]&3) > pattern[(f+j)&(WS2812_DITHER_FRAMES-1)]);
+                word = (word<<8)|out;
+            }
+            // the program shifts out the top 24 bits
+            set[f][j] = word<<8;
+        }
     }
-    fragment_start[value_length] = 0;
-    dma_channel_hw_addr(dma_cb_channel)->al3_read_addr_trig = (uintptr_t) fragment_start;
+    return dithered;
 }
 
-uint32_t my_colors[20];
-uint current = 0;
-int brightness = 0xff<<FRAC_BITS;
-
 int ws2812_init() {
     // todo get free sm
     PIO wspio = pio0;
     int wssm = pio_claim_unused_sm(wspio, true);
-    uint offset = pio_add_program(wspio, &ws2812_parallel_program);
+    uint offset = pio_add_program(wspio, &ws2812_program);
 
-    ws2812_parallel_program_init(wspio, wssm, offset, WS2812_PIN_BASE, count_of(strings), 800000);
+    ws2812_program_init(wspio, wssm, offset, WS2812_PIN_BASE, 800000, false);
 
-    sem_init(&reset_delay_complete_sem, 1, 1); // initially posted so we don't block first time
     dma_init(wspio, wssm);
     memset(my_colors, 0, 4*20);
+    memset(frames, 0, sizeof(frames));
+    return 0;
 }
-void ws2812_setColors(uint32_t *incoming_colors)
+
+bool ws2812_setColors(uint32_t *incoming_colors)
 {
+    if(memcmp(my_colors, incoming_colors, 20*4) == 0)
+        return false;
     memcpy(my_colors, incoming_colors, 20*4);
+    colors_pending = true;
+    return true;
 }
-void ws2812_trigger()
+
+bool ws2812_trigger()
 {
-    if(sem_available(&reset_delay_complete_sem) > 0)
+    // the leds hold their color, there is only something to do when it changes
+    if(!colors_pending)
+        return true;
+    // the dma hasn't picked up the last set yet, filling the other one would tear the frame it is sending
+    if(next_set != sending_set)
+        return false;
+    uint8_t set = sending_set^1;
+    set_dithered[set] = build_frames(frames[set]);
+    colors_pending = false;
+    // the alarm moves on to the new set after the frame it is on
+    uint32_t save = save_and_disable_interrupts();
+    next_set = set;
+    if(!running)
     {
-        current_string_out = string0.data;
-        current_string_4color = false;
-        for (size_t j = 0; j < 20; j++)
-        {
-            uint8_t r = my_colors[j] & 0xffu;
-            uint8_t g = (my_colors[j]>>8u) & 0xffu;
-            uint8_t b = (my_colors[j]>>16u) & 0xffu;
-            ws_put_pixel(ws_urgb_u32(r>>2,g>>2,b>>2));
-        }
-        transform_strings(strings, count_of(strings), colors, NUM_PIXELS * 4, brightness);
-        dither_values(colors, states[current], states[current ^ 1], NUM_PIXELS * 4);
-        sem_acquire_blocking(&reset_delay_complete_sem);
-        output_strings_dma(states[current], NUM_PIXELS * 4);
-        current ^= 1;
+        running = true;
+        start_frame();
     }
-}
\ No newline at end of file
+    restore_interrupts(save);
+    return true;
+}